@@ -0,0 +1,73 @@
+<?php
+
+/**
+ * Request/reply round trips through a load balancing broker over inproc:
+ * the broker written in PHP on recvMulti/sendMulti against the native
+ * ZMQBroker thread. Client and worker are DEALER sockets driven by this
+ * script. Prints one JSON object per mode.
+ *
+ * hhvm broker.php [requests]
+ */
+
+$requests = isset($argv[1]) ? (int)$argv[1] : 100000;
+
+$context = new ZMQContext(1, false);
+
+foreach (array('php', 'native') as $mode) {
+    $frontend_dsn = 'inproc://bench-broker-front-' . $mode;
+    $backend_dsn = 'inproc://bench-broker-back-' . $mode;
+    if ($mode == 'native') {
+        $broker = new ZMQBroker($context, $frontend_dsn, $backend_dsn);
+        $broker->start();
+    } else {
+        $frontend = new ZMQSocket($context, ZMQ::SOCKET_ROUTER);
+        $backend = new ZMQSocket($context, ZMQ::SOCKET_ROUTER);
+        $frontend->bind($frontend_dsn);
+        $backend->bind($backend_dsn);
+        $ready = array();
+    }
+
+    $client = new ZMQSocket($context, ZMQ::SOCKET_DEALER);
+    $worker = new ZMQSocket($context, ZMQ::SOCKET_DEALER);
+    $client->connect($frontend_dsn);
+    $worker->connect($backend_dsn);
+
+    $worker->sendMulti(array('', 'READY'));
+    if ($mode == 'php') {
+        $ready[] = $backend->recvMulti()[0];
+    }
+
+    $start = microtime(true);
+    for ($i = 0; $i < $requests; $i++) {
+        $client->sendMulti(array('', 'job'));
+        if ($mode == 'php') {
+            $request = $frontend->recvMulti();
+            $backend->sendMulti(array_merge(array(array_shift($ready), ''), $request));
+        }
+
+        $job = $worker->recvMulti();
+        $job[count($job) - 1] = 'done';
+        $worker->sendMulti($job);
+
+        if ($mode == 'php') {
+            $reply = $backend->recvMulti();
+            $ready[] = $reply[0];
+            $frontend->sendMulti(array_slice($reply, 2));
+        }
+        $client->recvMulti();
+    }
+    $elapsed = microtime(true) - $start;
+
+    if ($mode == 'native') {
+        $broker->stop();
+    }
+
+    echo json_encode(array(
+        'bench' => 'broker',
+        'mode' => $mode,
+        'transport' => 'inproc',
+        'requests' => $requests,
+        'reqs_per_sec' => (int)($requests / $elapsed),
+        'usec_per_req' => round($elapsed * 1000000 / $requests, 3),
+    )) . PHP_EOL;
+}
@@ -0,0 +1,90 @@
+<?php
+
+/**
+ * Throughput and added latency of small-message coalescing for 64B events
+ * over tcp loopback. Throughput is end to end: the sender publishes in
+ * bursts and the receiver drains them with recvBatch. Latency is measured
+ * with the send queue, whose writer thread flushes batches on the interval
+ * timer, by sending one event at a time. Prints one JSON object per mode.
+ *
+ * hhvm coalesce.php [messages] [samples]
+ */
+
+$messages = isset($argv[1]) ? (int)$argv[1] : 1000000;
+$samples = isset($argv[2]) ? (int)$argv[2] : 1000;
+$size = 64;
+$burst = 1000;
+
+$modes = array(
+    array('max_bytes' => 0, 'interval_us' => 0, 'queue' => false),
+    array('max_bytes' => 8192, 'interval_us' => 1000, 'queue' => false),
+    array('max_bytes' => 65536, 'interval_us' => 1000, 'queue' => false),
+    array('max_bytes' => 0, 'interval_us' => 0, 'queue' => true),
+    array('max_bytes' => 8192, 'interval_us' => 100, 'queue' => true),
+    array('max_bytes' => 8192, 'interval_us' => 1000, 'queue' => true),
+    array('max_bytes' => 65536, 'interval_us' => 1000, 'queue' => true),
+);
+
+$context = new ZMQContext(1, false);
+$event = str_repeat('x', $size);
+
+foreach ($modes as $index => $mode) {
+    $endpoint = 'tcp://127.0.0.1:' . (5591 + $index);
+    $receiver = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+    $sender = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+    $sender->setSockOpt(ZMQ::SOCKOPT_SNDHWM, 0);
+    $receiver->setSockOpt(ZMQ::SOCKOPT_RCVHWM, 0);
+    $receiver->setDecoding(ZMQ::DECODE_BATCH);
+    $receiver->bind($endpoint);
+    $sender->connect($endpoint);
+    if ($mode['max_bytes'] > 0) {
+        $sender->setCoalescing($mode['max_bytes'], $mode['interval_us']);
+    }
+    if ($mode['queue']) {
+        $sender->enableSendQueue(65536, ZMQ::SEND_QUEUE_BLOCK);
+    }
+
+    $start = microtime(true);
+    for ($sent = 0; $sent < $messages; $sent += $burst) {
+        for ($i = 0; $i < $burst; $i++) {
+            $sender->send($event);
+        }
+        if (!$mode['queue'] && $mode['max_bytes'] > 0) {
+            $sender->flush();
+        }
+        for ($received = 0; $received < $burst; ) {
+            $received += count($receiver->recvBatch($burst - $received));
+        }
+    }
+    $elapsed = microtime(true) - $start;
+    $frames = $receiver->getStats()['messages_received'];
+
+    $latency = null;
+    if ($mode['queue'] || $mode['max_bytes'] == 0) {
+        $total = 0.0;
+        for ($i = 0; $i < $samples; $i++) {
+            $start = microtime(true);
+            $sender->send($event);
+            $receiver->recv();
+            $total += microtime(true) - $start;
+        }
+        $latency = round($total * 1000000 / $samples, 3);
+    }
+
+    echo json_encode(array(
+        'bench' => 'coalesce',
+        'transport' => 'tcp',
+        'size' => $size,
+        'max_bytes' => $mode['max_bytes'],
+        'interval_us' => $mode['interval_us'],
+        'send_queue' => $mode['queue'],
+        'messages' => $sent,
+        'frames' => $frames,
+        'msgs_per_sec' => (int)($sent / $elapsed),
+        'usec_latency' => $latency,
+    )) . PHP_EOL;
+
+    if ($mode['queue']) {
+        $sender->disableSendQueue();
+    }
+}
@@ -0,0 +1,69 @@
+<?php
+
+/**
+ * inproc needs both ends in one context, so the inproc latency and
+ * throughput are measured in a single process: ping-pong between a PAIR
+ * pair for latency, PUSH/PULL in batches for throughput. Prints the same
+ * JSON objects as remote_lat.php and local_thr.php.
+ *
+ * hhvm inproc.php <message-size> <roundtrips> <message-count>
+ */
+
+if ($argc < 4) {
+    fwrite(STDERR, "usage: inproc.php <message-size> <roundtrips> <message-count>" . PHP_EOL);
+    exit(1);
+}
+$size = (int)$argv[1];
+$roundtrips = (int)$argv[2];
+$count = (int)$argv[3];
+$message = str_repeat('x', $size);
+
+$context = new ZMQContext(1, false);
+
+$ping = new ZMQSocket($context, ZMQ::SOCKET_PAIR);
+$pong = new ZMQSocket($context, ZMQ::SOCKET_PAIR);
+$ping->bind('inproc://bench-lat');
+$pong->connect('inproc://bench-lat');
+
+$start = microtime(true);
+for ($i = 0; $i < $roundtrips; $i++) {
+    $ping->send($message);
+    $pong->send($pong->recv());
+    $ping->recv();
+}
+$elapsed = microtime(true) - $start;
+
+echo json_encode(array(
+    'bench' => 'latency',
+    'endpoint' => 'inproc://bench-lat',
+    'size' => $size,
+    'roundtrips' => $roundtrips,
+    'usec_latency' => round($elapsed * 1000000 / $roundtrips / 2, 3),
+)) . PHP_EOL;
+
+$push = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+$pull = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+$pull->bind('inproc://bench-thr');
+$push->connect('inproc://bench-thr');
+
+// stay below the default HWM of 1000 so send never blocks
+$batch = 500;
+$start = microtime(true);
+for ($sent = 0; $sent < $count; $sent += $batch) {
+    for ($i = 0; $i < $batch; $i++) {
+        $push->send($message);
+    }
+    for ($i = 0; $i < $batch; $i++) {
+        $pull->recv();
+    }
+}
+$elapsed = microtime(true) - $start;
+
+echo json_encode(array(
+    'bench' => 'throughput',
+    'endpoint' => 'inproc://bench-thr',
+    'size' => $size,
+    'messages' => $sent,
+    'msgs_per_sec' => (int)($sent / $elapsed),
+    'mbit_per_sec' => round($sent * $size * 8 / $elapsed / 1000000, 1),
+)) . PHP_EOL;
@@ -0,0 +1,27 @@
+<?php
+
+/**
+ * Latency harness, echo side: binds a REP socket and sends every message
+ * back. Start it before remote_lat.php.
+ *
+ * hhvm local_lat.php <endpoint> <message-size> <roundtrips>
+ */
+
+if ($argc < 4) {
+    fwrite(STDERR, "usage: local_lat.php <endpoint> <message-size> <roundtrips>" . PHP_EOL);
+    exit(1);
+}
+list(, $endpoint, $size, $roundtrips) = $argv;
+
+$context = new ZMQContext(1, false);
+$socket = new ZMQSocket($context, ZMQ::SOCKET_REP);
+$socket->bind($endpoint);
+
+for ($i = 0; $i < (int)$roundtrips; $i++) {
+    $message = $socket->recv();
+    if (strlen($message) != (int)$size) {
+        fwrite(STDERR, "unexpected message size " . strlen($message) . PHP_EOL);
+        exit(1);
+    }
+    $socket->send($message);
+}
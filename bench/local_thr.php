@@ -0,0 +1,37 @@
+<?php
+
+/**
+ * Throughput harness, measuring side: binds a PULL socket, receives the
+ * messages sent by remote_thr.php and prints one JSON object with the
+ * throughput. The clock starts at the first message.
+ *
+ * hhvm local_thr.php <endpoint> <message-size> <message-count>
+ */
+
+if ($argc < 4) {
+    fwrite(STDERR, "usage: local_thr.php <endpoint> <message-size> <message-count>" . PHP_EOL);
+    exit(1);
+}
+list(, $endpoint, $size, $count) = $argv;
+$size = (int)$size;
+$count = (int)$count;
+
+$context = new ZMQContext(1, false);
+$socket = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+$socket->bind($endpoint);
+
+$socket->recv();
+$start = microtime(true);
+for ($i = 1; $i < $count; $i++) {
+    $socket->recv();
+}
+$elapsed = microtime(true) - $start;
+
+echo json_encode(array(
+    'bench' => 'throughput',
+    'endpoint' => $endpoint,
+    'size' => $size,
+    'messages' => $count,
+    'msgs_per_sec' => (int)($count / $elapsed),
+    'mbit_per_sec' => round($count * $size * 8 / $elapsed / 1000000, 1),
+)) . PHP_EOL;
@@ -0,0 +1,188 @@
+/*
+ * libzmq baselines for the native hot paths of the extension. They do not
+ * link the extension: each one replays what the named php_zmq_* function
+ * does with libzmq directly, so the results bound the native cost and can
+ * be compared across libzmq builds without an HHVM:
+ *
+ *   send_copy      message_t(size) + memcpy + send (php_zmq_socket_send)
+ *   send_zerocopy  message_t(data, size, free_fn) + send (payloads >= 16KB)
+ *   recv_copy      recv + one copy into an exact-size buffer (php_zmq_socket_recv)
+ *   poll_rebuild   malloc + memset of the pollitem array on every poll
+ *   poll_persist   persistent pollitem array (php_zmq_poll_poll)
+ *   sockopt_set    setsockopt(ZMQ_SNDHWM)
+ *   sockopt_get    getsockopt(ZMQ_SNDHWM)
+ *
+ * Prints one JSON object per benchmark and size, marked "baseline":"libzmq"
+ * to keep them apart from the results of the PHP scripts.
+ *
+ * zmq_microbench [iterations]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "zmq.hpp"
+
+static const size_t kSizes[] = { 64, 1024, 64 * 1024, 1024 * 1024 };
+static const int kPollSockets = 100;
+
+static double now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void report(const char* bench, size_t size, long iterations, double elapsed_ns)
+{
+    printf("{\"bench\":\"%s\",\"baseline\":\"libzmq\",\"transport\":\"inproc\",\"size\":%zu,"
+           "\"iterations\":%ld,\"ns_per_op\":%.1f}\n", bench, size, iterations, elapsed_ns / iterations);
+    fflush(stdout);
+}
+
+static void no_free(void* data, void* hint)
+{
+    (void)data;
+    (void)hint;
+}
+
+// the receiver is drained every kBatch sends so the pipe never hits its HWM
+static const int kBatch = 100;
+
+// the send and recv loops run whole batches
+static long batched(long iterations)
+{
+    return (iterations + kBatch - 1) / kBatch * kBatch;
+}
+
+static void drain(zmq::socket_t& receiver, int count)
+{
+    zmq::message_t msg;
+    for(int i = 0; i < count; i++){
+        receiver.recv(&msg);
+    }
+}
+
+static void bench_send(zmq::socket_t& sender, zmq::socket_t& receiver, size_t size, long iterations, bool zero_copy)
+{
+    std::vector<char> payload(size, 'x');
+    double elapsed = 0;
+    iterations = batched(iterations);
+    for(long i = 0; i < iterations; i += kBatch){
+        double start = now_ns();
+        for(int j = 0; j < kBatch; j++){
+            if(zero_copy){
+                zmq::message_t msg(payload.data(), size, no_free);
+                sender.send(msg);
+            }else{
+                zmq::message_t msg(size);
+                memcpy(msg.data(), payload.data(), size);
+                sender.send(msg);
+            }
+        }
+        elapsed += now_ns() - start;
+        drain(receiver, kBatch);
+    }
+    report(zero_copy ? "send_zerocopy" : "send_copy", size, iterations, elapsed);
+}
+
+static void bench_recv(zmq::socket_t& sender, zmq::socket_t& receiver, size_t size, long iterations)
+{
+    std::vector<char> payload(size, 'x');
+    double elapsed = 0;
+    iterations = batched(iterations);
+    for(long i = 0; i < iterations; i += kBatch){
+        for(int j = 0; j < kBatch; j++){
+            sender.send(payload.data(), size);
+        }
+        double start = now_ns();
+        for(int j = 0; j < kBatch; j++){
+            zmq::message_t msg;
+            receiver.recv(&msg);
+            char* str = (char*)malloc(msg.size());
+            memcpy(str, msg.data(), msg.size());
+            free(str);
+        }
+        elapsed += now_ns() - start;
+    }
+    report("recv_copy", size, iterations, elapsed);
+}
+
+static void bench_poll(zmq::context_t& ctx, long iterations)
+{
+    std::vector<zmq::socket_t*> sockets;
+    for(int i = 0; i < kPollSockets; i++){
+        sockets.push_back(new zmq::socket_t(ctx, ZMQ_PULL));
+    }
+
+    double start = now_ns();
+    for(long i = 0; i < iterations; i++){
+        zmq_pollitem_t* items = (zmq_pollitem_t*)malloc(sizeof(zmq_pollitem_t) * kPollSockets);
+        for(int j = 0; j < kPollSockets; j++){
+            memset(&items[j], 0, sizeof(zmq_pollitem_t));
+            items[j].socket = *sockets[j];
+            items[j].events = ZMQ_POLLIN;
+        }
+        zmq::poll(items, kPollSockets, 0);
+        free(items);
+    }
+    report("poll_rebuild", kPollSockets, iterations, now_ns() - start);
+
+    std::vector<zmq_pollitem_t> items(kPollSockets);
+    for(int j = 0; j < kPollSockets; j++){
+        memset(&items[j], 0, sizeof(zmq_pollitem_t));
+        items[j].socket = *sockets[j];
+        items[j].events = ZMQ_POLLIN;
+    }
+    start = now_ns();
+    for(long i = 0; i < iterations; i++){
+        zmq::poll(items.data(), kPollSockets, 0);
+    }
+    report("poll_persist", kPollSockets, iterations, now_ns() - start);
+
+    for(auto sock : sockets){
+        delete sock;
+    }
+}
+
+static void bench_sockopt(zmq::socket_t& sock, long iterations)
+{
+    double start = now_ns();
+    for(long i = 0; i < iterations; i++){
+        int v = 1000 + (i & 1);
+        sock.setsockopt(ZMQ_SNDHWM, &v, sizeof(int));
+    }
+    report("sockopt_set", sizeof(int), iterations, now_ns() - start);
+
+    start = now_ns();
+    for(long i = 0; i < iterations; i++){
+        int v;
+        size_t size = sizeof(int);
+        sock.getsockopt(ZMQ_SNDHWM, &v, &size);
+    }
+    report("sockopt_get", sizeof(int), iterations, now_ns() - start);
+}
+
+int main(int argc, char** argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 100000;
+
+    zmq::context_t ctx(1);
+    zmq::socket_t receiver(ctx, ZMQ_PAIR);
+    zmq::socket_t sender(ctx, ZMQ_PAIR);
+    receiver.bind("inproc://microbench");
+    sender.connect("inproc://microbench");
+
+    for(size_t size : kSizes){
+        // keep the big sizes from dominating the run time
+        long n = size >= 64 * 1024 ? iterations / 100 : iterations;
+        bench_send(sender, receiver, size, n, false);
+        bench_send(sender, receiver, size, n, true);
+        bench_recv(sender, receiver, size, n);
+    }
+    bench_poll(ctx, iterations / 10);
+    bench_sockopt(sender, iterations);
+    return 0;
+}
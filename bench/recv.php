@@ -0,0 +1,43 @@
+<?php
+
+/**
+ * Measures ZMQSocket::recv for 1KB, 64KB and 8MB frames over inproc.
+ * Prints one JSON object per message size.
+ *
+ * hhvm recv.php [iterations]
+ */
+
+$iterations = isset($argv[1]) ? (int)$argv[1] : 1000;
+
+$context = new ZMQContext(1, false);
+$sender = new ZMQSocket($context, ZMQ::SOCKET_PAIR);
+$receiver = new ZMQSocket($context, ZMQ::SOCKET_PAIR);
+$receiver->bind('inproc://bench-recv');
+$sender->connect('inproc://bench-recv');
+
+foreach (array(1024, 64 * 1024, 8 * 1024 * 1024) as $size) {
+    $payload = str_repeat('x', $size);
+    // large frames are slow enough that fewer rounds give stable numbers
+    $rounds = $size > 64 * 1024 ? max(10, (int)($iterations / 100)) : $iterations;
+
+    $recv_time = 0.0;
+    for ($i = 0; $i < $rounds; $i++) {
+        $sender->send($payload);
+        $start = microtime(true);
+        $message = $receiver->recv();
+        $recv_time += microtime(true) - $start;
+        if (strlen($message) != $size) {
+            fwrite(STDERR, "unexpected message size " . strlen($message) . PHP_EOL);
+            exit(1);
+        }
+    }
+
+    echo json_encode(array(
+        'bench' => 'recv',
+        'transport' => 'inproc',
+        'size' => $size,
+        'messages' => $rounds,
+        'usec_per_msg' => round($recv_time * 1000000 / $rounds, 3),
+        'mb_per_sec' => round($size * $rounds / $recv_time / 1048576, 1),
+    )) . PHP_EOL;
+}
@@ -0,0 +1,36 @@
+<?php
+
+/**
+ * Latency harness, measuring side: sends messages over a REQ socket and
+ * waits for each echo. Prints one JSON object with the one-way latency.
+ *
+ * hhvm remote_lat.php <endpoint> <message-size> <roundtrips>
+ */
+
+if ($argc < 4) {
+    fwrite(STDERR, "usage: remote_lat.php <endpoint> <message-size> <roundtrips>" . PHP_EOL);
+    exit(1);
+}
+list(, $endpoint, $size, $roundtrips) = $argv;
+$size = (int)$size;
+$roundtrips = (int)$roundtrips;
+
+$context = new ZMQContext(1, false);
+$socket = new ZMQSocket($context, ZMQ::SOCKET_REQ);
+$socket->connect($endpoint);
+
+$message = str_repeat('x', $size);
+$start = microtime(true);
+for ($i = 0; $i < $roundtrips; $i++) {
+    $socket->send($message);
+    $socket->recv();
+}
+$elapsed = microtime(true) - $start;
+
+echo json_encode(array(
+    'bench' => 'latency',
+    'endpoint' => $endpoint,
+    'size' => $size,
+    'roundtrips' => $roundtrips,
+    'usec_latency' => round($elapsed * 1000000 / $roundtrips / 2, 3),
+)) . PHP_EOL;
@@ -0,0 +1,24 @@
+<?php
+
+/**
+ * Throughput harness, sending side: connects a PUSH socket and sends the
+ * messages as fast as possible.
+ *
+ * hhvm remote_thr.php <endpoint> <message-size> <message-count>
+ */
+
+if ($argc < 4) {
+    fwrite(STDERR, "usage: remote_thr.php <endpoint> <message-size> <message-count>" . PHP_EOL);
+    exit(1);
+}
+list(, $endpoint, $size, $count) = $argv;
+
+$context = new ZMQContext(1, false);
+$socket = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+// the default linger keeps the messages queued until they are delivered
+$socket->connect($endpoint);
+
+$message = str_repeat('x', (int)$size);
+for ($i = 0; $i < (int)$count; $i++) {
+    $socket->send($message);
+}
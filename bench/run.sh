@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Runs the latency and throughput harnesses over inproc, ipc and tcp
+# loopback for a range of message sizes, then the microbenchmarks when
+# they have been built (cmake bench && make). Results are JSON lines,
+# appended to bench_output.txt at the top of the repository unless another
+# file is given. MICROBENCH is the path of the zmq_microbench binary, by
+# default where an in-source build (cd bench && cmake . && make) puts it.
+#
+# sh run.sh [output-file]
+
+HHVM=${HHVM:-hhvm}
+DIR=$(cd "$(dirname "$0")" && pwd)
+OUT=${1:-$DIR/../bench_output.txt}
+SIZES=${SIZES:-"64 1024 65536 1048576"}
+ROUNDTRIPS=${ROUNDTRIPS:-10000}
+COUNT=${COUNT:-100000}
+MICROBENCH=${MICROBENCH:-$DIR/zmq_microbench}
+
+for size in $SIZES; do
+    $HHVM "$DIR/inproc.php" $size $ROUNDTRIPS $COUNT >> "$OUT"
+
+    for endpoint in "ipc:///tmp/hhvm-zmq-bench" "tcp://127.0.0.1:5590"; do
+        $HHVM "$DIR/local_lat.php" $endpoint $size $ROUNDTRIPS &
+        sleep 1
+        $HHVM "$DIR/remote_lat.php" $endpoint $size $ROUNDTRIPS >> "$OUT"
+        wait
+
+        $HHVM "$DIR/local_thr.php" $endpoint $size $COUNT >> "$OUT" &
+        sleep 1
+        $HHVM "$DIR/remote_thr.php" $endpoint $size $COUNT
+        wait
+    done
+done
+
+$HHVM "$DIR/recv.php" >> "$OUT"
+$HHVM "$DIR/send_batch.php" >> "$OUT"
+$HHVM "$DIR/coalesce.php" >> "$OUT"
+$HHVM "$DIR/send_array.php" >> "$OUT"
+$HHVM "$DIR/subscribe.php" >> "$OUT"
+$HHVM "$DIR/broker.php" >> "$OUT"
+$HHVM "$DIR/shm.php" >> "$OUT"
+
+if [ -x "$MICROBENCH" ]; then
+    "$MICROBENCH" >> "$OUT"
+fi
@@ -0,0 +1,52 @@
+<?php
+
+/**
+ * Round trip of a small event array over inproc: serialize() and
+ * json_encode() in PHP against the native MessagePack encoding of
+ * sendArray/recvArray. Prints one JSON object per mode.
+ *
+ * hhvm send_array.php [messages]
+ */
+
+$messages = isset($argv[1]) ? (int)$argv[1] : 200000;
+
+$context = new ZMQContext(1, false);
+$sender = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+$receiver = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+$receiver->bind('inproc://bench-send-array');
+$sender->connect('inproc://bench-send-array');
+
+$event = array(
+    'type' => 'page_view',
+    'user_id' => 123456789,
+    'time' => 1400000000.25,
+    'url' => '/articles/2014/zeromq-on-hhvm',
+    'tags' => array('zmq', 'hhvm', 'php'),
+    'referrer' => null,
+);
+
+foreach (array('serialize', 'json', 'msgpack') as $mode) {
+    $start = microtime(true);
+    for ($i = 0; $i < $messages; $i++) {
+        if ($mode == 'serialize') {
+            $sender->send(serialize($event));
+            $value = unserialize($receiver->recv());
+        } else if ($mode == 'json') {
+            $sender->send(json_encode($event));
+            $value = json_decode($receiver->recv(), true);
+        } else {
+            $sender->sendArray($event);
+            $value = $receiver->recvArray();
+        }
+    }
+    $elapsed = microtime(true) - $start;
+
+    echo json_encode(array(
+        'bench' => 'send_array',
+        'mode' => $mode,
+        'transport' => 'inproc',
+        'messages' => $messages,
+        'msgs_per_sec' => (int)($messages / $elapsed),
+        'usec_per_msg' => round($elapsed * 1000000 / $messages, 3),
+    )) . PHP_EOL;
+}
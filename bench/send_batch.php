@@ -0,0 +1,57 @@
+<?php
+
+/**
+ * Compares ZMQSocket::send in a PHP loop with ZMQSocket::sendBatch for 64B
+ * and 1KB messages over inproc. Prints one JSON object per mode and size.
+ *
+ * hhvm send_batch.php [messages]
+ */
+
+$messages = isset($argv[1]) ? (int)$argv[1] : 1000000;
+$batch_size = 1000;
+
+$context = new ZMQContext(1, false);
+$sender = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+$receiver = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+$sender->setSockOpt(ZMQ::SOCKOPT_SNDHWM, 0);
+$receiver->setSockOpt(ZMQ::SOCKOPT_RCVHWM, 0);
+$receiver->bind('inproc://bench-send-batch');
+$sender->connect('inproc://bench-send-batch');
+
+function drain($receiver, $count) {
+    for ($i = 0; $i < $count; $i++) {
+        $receiver->recv();
+    }
+}
+
+foreach (array(64, 1024) as $size) {
+    $batch = array_fill(0, $batch_size, str_repeat('x', $size));
+    $rounds = (int)($messages / $batch_size);
+
+    foreach (array('send', 'sendBatch') as $mode) {
+        $elapsed = 0.0;
+        for ($r = 0; $r < $rounds; $r++) {
+            $start = microtime(true);
+            if ($mode == 'send') {
+                foreach ($batch as $message) {
+                    $sender->send($message);
+                }
+            } else {
+                $sender->sendBatch($batch);
+            }
+            $elapsed += microtime(true) - $start;
+            drain($receiver, $batch_size);
+        }
+
+        $total = $rounds * $batch_size;
+        echo json_encode(array(
+            'bench' => 'send_batch',
+            'mode' => $mode,
+            'transport' => 'inproc',
+            'size' => $size,
+            'messages' => $total,
+            'msgs_per_sec' => (int)($total / $elapsed),
+            'usec_per_msg' => round($elapsed * 1000000 / $total, 3),
+        )) . PHP_EOL;
+    }
+}
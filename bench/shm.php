@@ -0,0 +1,46 @@
+<?php
+
+/**
+ * Multi-megabyte payloads over ipc, through the socket against the shared
+ * memory offload of setSharedMemory. Prints one JSON object per mode and
+ * size.
+ *
+ * hhvm shm.php [messages]
+ */
+
+$messages = isset($argv[1]) ? (int)$argv[1] : 500;
+
+$context = new ZMQContext(1, false);
+
+foreach (array(1048576, 4194304, 16777216) as $size) {
+    $payload = str_repeat('x', $size);
+    foreach (array('socket', 'shm') as $mode) {
+        $endpoint = 'ipc:///tmp/hhvm-zmq-bench-shm-' . $mode . '-' . $size;
+        $receiver = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+        $sender = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+        $receiver->bind($endpoint);
+        $sender->connect($endpoint);
+        if ($mode == 'shm') {
+            $receiver->setDecoding(ZMQ::DECODE_SHARED);
+            $sender->setSharedMemory(65536);
+        }
+
+        $start = microtime(true);
+        for ($i = 0; $i < $messages; $i++) {
+            $sender->send($payload);
+            $receiver->recv();
+        }
+        $elapsed = microtime(true) - $start;
+
+        echo json_encode(array(
+            'bench' => 'shm',
+            'mode' => $mode,
+            'transport' => 'ipc',
+            'size' => $size,
+            'messages' => $messages,
+            'msgs_per_sec' => (int)($messages / $elapsed),
+            'usec_per_msg' => round($elapsed * 1000000 / $messages, 3),
+            'mb_per_sec' => round($messages * $size / 1048576 / $elapsed, 1),
+        )) . PHP_EOL;
+    }
+}
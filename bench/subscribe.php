@@ -0,0 +1,75 @@
+<?php
+
+/**
+ * Routing of messages to one of many topic subscriptions: the native trie
+ * of recvTagged against longest-prefix matching in PHP after recvBatch.
+ * Prints one JSON object per mode and subscription count.
+ *
+ * hhvm subscribe.php [messages]
+ */
+
+$messages = isset($argv[1]) ? (int)$argv[1] : 100000;
+$batch = 1000;
+
+foreach (array(100, 10000) as $count) {
+    $prefixes = array();
+    for ($i = 0; $i < $count; $i++) {
+        $prefixes[] = sprintf('sensor.%05d.', $i);
+    }
+    $topics = array();
+    for ($i = 0; $i < $batch; $i++) {
+        $topics[] = $prefixes[mt_rand(0, $count - 1)] . 'reading 42';
+    }
+
+    foreach (array('php', 'trie') as $mode) {
+        $context = new ZMQContext(1, false);
+        $publisher = new ZMQSocket($context, ZMQ::SOCKET_PUB);
+        $subscriber = new ZMQSocket($context, ZMQ::SOCKET_SUB);
+        $publisher->setSockOpt(ZMQ::SOCKOPT_SNDHWM, 0);
+        $subscriber->setSockOpt(ZMQ::SOCKOPT_RCVHWM, 0);
+        $publisher->bind('inproc://bench-subscribe');
+        $subscriber->connect('inproc://bench-subscribe');
+        foreach ($prefixes as $prefix) {
+            if ($mode == 'trie') {
+                $subscriber->subscribe($prefix);
+            } else {
+                $subscriber->setSockOpt(ZMQ::SOCKOPT_SUBSCRIBE, $prefix);
+            }
+        }
+        usleep(200000);
+
+        $elapsed = 0.0;
+        for ($sent = 0; $sent < $messages; $sent += $batch) {
+            $publisher->sendBatch($topics);
+            $start = microtime(true);
+            if ($mode == 'trie') {
+                for ($received = 0; $received < $batch; ) {
+                    $received += count(zmq_socket_recv_tagged($subscriber->getSocket(), $batch - $received, -1));
+                }
+            } else {
+                for ($received = 0; $received < $batch; ) {
+                    foreach ($subscriber->recvBatch($batch - $received) as $message) {
+                        $match = null;
+                        foreach ($prefixes as $prefix) {
+                            if (strncmp($message, $prefix, strlen($prefix)) == 0
+                                && ($match === null || strlen($prefix) > strlen($match))) {
+                                $match = $prefix;
+                            }
+                        }
+                        $received++;
+                    }
+                }
+            }
+            $elapsed += microtime(true) - $start;
+        }
+
+        echo json_encode(array(
+            'bench' => 'subscribe',
+            'mode' => $mode,
+            'subscriptions' => $count,
+            'messages' => $sent,
+            'msgs_per_sec' => (int)($sent / $elapsed),
+            'usec_per_msg' => round($elapsed * 1000000 / $sent, 3),
+        )) . PHP_EOL;
+    }
+}
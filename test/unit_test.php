@@ -20,6 +20,38 @@ class UnitTest extends PHPUnit_Framework_TestCase
         $this->assertEquals(2, $context->getOpt(ZMQ::ZMQ_IO_THREADS));
     }
 
+    public function testPersistentContext()
+    {
+        $before = ZMQContext::getPersistentStats();
+        $first = new ZMQContext(4, true);
+        $second = new ZMQContext(4, true);
+        $after = ZMQContext::getPersistentStats();
+
+        $this->assertEquals(4, $second->getOpt(ZMQ::ZMQ_IO_THREADS));
+        $this->assertGreaterThanOrEqual($before['contexts_reused'] + 1, $after['contexts_reused']);
+
+        // resizing one of them leaves the shared context alone
+        $second->setOpt(ZMQ::ZMQ_MAX_SOCKETS, 3);
+        $this->assertEquals(3, $second->getOpt(ZMQ::ZMQ_MAX_SOCKETS));
+        $this->assertEquals(1023, $first->getOpt(ZMQ::ZMQ_MAX_SOCKETS));
+        $third = new ZMQContext(4, true);
+        $this->assertEquals(1023, $third->getOpt(ZMQ::ZMQ_MAX_SOCKETS));
+    }
+
+    public function testContextAffinity()
+    {
+        $context = new ZMQContext(2, false, 1023, array('auto_affinity' => true));
+        $affinity = array();
+        for($i = 0; $i < 3; $i++){
+            $socket = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+            $affinity[] = $socket->getSockOpt(ZMQ::SOCKOPT_AFFINITY);
+        }
+        $this->assertEquals(array(1, 2, 1), $affinity);
+
+        $this->setExpectedException('Exception');
+        new ZMQContext(1, false, 1023, array('no_such_option' => 1));
+    }
+
     public function testSocket()
     {
         $context = new ZMQContext();
@@ -30,6 +62,468 @@ class UnitTest extends PHPUnit_Framework_TestCase
         $this->assertEquals('socket # push', $socket->getPersistentId());
     }
 
+    public function testSocketPool()
+    {
+        $context = new ZMQContext(1, true);
+        $first = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+        $second = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+        $first->bind('inproc://test-pool-first');
+        $second->bind('inproc://test-pool-second');
+
+        $socket = new ZMQSocket($context, ZMQ::SOCKET_PUSH, 'test-pool');
+        $this->assertFalse($socket->isReused());
+        $socket->connect('inproc://test-pool-first');
+        // back to the pool
+        $socket = null;
+
+        $socket = new ZMQSocket($context, ZMQ::SOCKET_PUSH, 'test-pool');
+        $this->assertTrue($socket->isReused());
+        $socket->connect('inproc://test-pool-first');
+        $this->assertEquals(array('inproc://test-pool-first' => 1), $socket->getEndpoints()['connect']);
+        $socket = null;
+
+        // another endpoint under the same id, the first peer gets nothing
+        $socket = new ZMQSocket($context, ZMQ::SOCKET_PUSH, 'test-pool');
+        $this->assertTrue($socket->isReused());
+        $socket->connect('inproc://test-pool-second');
+        $socket->send('a')->send('b');
+        $this->assertEquals(array('a', 'b'), $second->recvBatch(2, 1000));
+        $this->assertEquals(array(), $first->recvBatch(1, 100));
+        $this->assertEquals(array('inproc://test-pool-second' => 1), $socket->getEndpoints()['connect']);
+    }
+
+    public function testMultipart()
+    {
+        $context = new ZMQContext(1, false);
+
+        $receiver = new ZMQSocket($context, ZMQ::SOCKET_PAIR);
+        $sender = new ZMQSocket($context, ZMQ::SOCKET_PAIR);
+        $receiver->bind('inproc://test-multipart');
+        $sender->connect('inproc://test-multipart');
+
+        $frames = array('topic', '', str_repeat('x', 32 * 1024));
+        $sender->sendMulti($frames);
+        $this->assertEquals($frames, $receiver->recvMulti());
+    }
+
+    public function testSendBatch()
+    {
+        $context = new ZMQContext(1, false);
+
+        $receiver = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+        $sender = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+        $receiver->bind('inproc://test-send-batch');
+        $sender->connect('inproc://test-send-batch');
+
+        $this->assertEquals(3, $sender->sendBatch(array('a', 'b', 'c')));
+        $this->assertEquals('a', $receiver->recv());
+        $this->assertEquals('b', $receiver->recv());
+        $this->assertEquals('c', $receiver->recv());
+
+        $stats = $sender->getStats();
+        $this->assertEquals(3, $stats['messages_sent']);
+        $this->assertEquals(3, $stats['bytes_sent']);
+        $this->assertEquals(3, $stats['send_wait']['count']);
+        $this->assertGreaterThanOrEqual(3, zmq_stats()['messages_received']);
+    }
+
+    public function testSendQueue()
+    {
+        $context = new ZMQContext(1, false);
+
+        $receiver = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+        $sender = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+        $receiver->bind('inproc://test-send-queue');
+        $sender->connect('inproc://test-send-queue');
+
+        $sender->enableSendQueue(16);
+        $sender->send('a')->sendMulti(array('b', 'c'));
+        $this->assertEquals(array('a'), $receiver->recvMulti());
+        $this->assertEquals(array('b', 'c'), $receiver->recvMulti());
+        $this->assertEquals(2, $sender->getSendQueueStats()['enqueued']);
+        $this->assertFalse($sender->getSockOpt(ZMQ::SOCKOPT_SNDHWM));
+        try{
+            $sender->connect('inproc://test-send-queue-other');
+            $this->fail('connect on a socket owned by the writer thread');
+        }catch(ZMQException $e){
+        }
+        $sender->disableSendQueue();
+        $this->assertNotFalse($sender->getSockOpt(ZMQ::SOCKOPT_SNDHWM));
+
+        // nobody is connected, so the writer is stuck and the queue fills up
+        $orphan = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+        $orphan->setSockOpt(ZMQ::SOCKOPT_LINGER, 0);
+        $orphan->enableSendQueue(4, ZMQ::SEND_QUEUE_DROP_NEWEST);
+        for ($i = 0; $i < 10; $i++) {
+            $orphan->send('lost');
+        }
+        $stats = $orphan->getSendQueueStats();
+        $this->assertEquals(10, $stats['enqueued'] + $stats['dropped']);
+        $this->assertGreaterThanOrEqual(5, $stats['dropped']);
+        $orphan->disableSendQueue();
+    }
+
+    public function testCoalescing()
+    {
+        $context = new ZMQContext(1, false);
+
+        $receiver = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+        $sender = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+        $receiver->bind('inproc://test-coalescing');
+        $sender->connect('inproc://test-coalescing');
+
+        $sender->setCoalescing(1024, 10000000);
+        $sender->send('a')->send('b')->send('c')->flush();
+        $this->assertEquals(1, $sender->getStats()['messages_sent']);
+
+        // a receiver that did not opt in gets the batch as it was sent
+        $this->assertEquals(1, count($receiver->recvBatch(10, 1000)));
+
+        $receiver->setDecoding(ZMQ::DECODE_BATCH);
+        $sender->send('a')->send('b')->send('c')->flush();
+        $this->assertEquals('a', $receiver->recv());
+        $this->assertEquals(array('b', 'c'), $receiver->recvBatch(10, 1000));
+        $this->assertEquals(2, $receiver->getStats()['messages_received']);
+
+        // too large to coalesce, goes out after the pending batch
+        $large = str_repeat('x', 2048);
+        $sender->send('d')->send($large);
+        $this->assertEquals(array('d', $large), $receiver->recvBatch(10, 1000));
+
+        // multipart frames are never batched nor glued to the batch
+        $sender->send('e')->send('topic', ZMQ::MODE_SNDMORE)->send('body');
+        $this->assertEquals('e', $receiver->recv());
+        $this->assertEquals(array('topic', 'body'), $receiver->recvMulti());
+    }
+
+    public function testCompression()
+    {
+        $context = new ZMQContext(1, false);
+
+        $receiver = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+        $sender = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+        $plain = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+        $receiver->bind('inproc://test-compression');
+        $sender->connect('inproc://test-compression');
+        $plain->connect('inproc://test-compression');
+
+        try {
+            $sender->setCompression(100);
+        } catch (ZMQException $e) {
+            $this->markTestSkipped('built without liblz4');
+        }
+
+        $json = json_encode(array_fill(0, 200, array('event' => 'click', 'page' => '/home')));
+        // a receiver that did not opt in gets the compressed frame
+        $sender->send($json);
+        $this->assertNotEquals($json, $receiver->recv());
+
+        $receiver->setDecoding(ZMQ::DECODE_COMPRESSED);
+        $sender->send($json)->send('short');
+        $this->assertEquals($json, $receiver->recv());
+        $this->assertEquals('short', $receiver->recv());
+        $this->assertLessThan(2 * strlen($json), $sender->getStats()['bytes_sent']);
+
+        // frames of producers that do not compress are left alone
+        $plain->send($json);
+        $this->assertEquals($json, $receiver->recv());
+    }
+
+    public function testSharedMemory()
+    {
+        $context = new ZMQContext(1, false);
+
+        $receiver = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+        $sender = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+        $receiver->bind('inproc://test-shm');
+        $sender->connect('inproc://test-shm');
+        $sender->setSharedMemory(4096);
+
+        // a receiver that did not opt in only gets the handle
+        $large = str_repeat('0123456789abcdef', 65536);
+        $sender->send($large);
+        $this->assertLessThan(1024, strlen($receiver->recv()));
+
+        $receiver->setDecoding(ZMQ::DECODE_SHARED);
+        $sender->send($large);
+        $sender->sendMulti(array('small', $large));
+        $this->assertEquals($large, $receiver->recv());
+        $this->assertEquals(array('small', $large), $receiver->recvMulti());
+
+        // only the handle frames went through the socket
+        $this->assertLessThan(1024, $sender->getStats()['bytes_sent']);
+
+        // handles only travel between endpoints on this host
+        try{
+            $sender->connect('tcp://127.0.0.1:5562');
+            $this->fail('tcp endpoint accepted with shared memory on');
+        }catch(ZMQException $e){
+        }
+        $remote = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+        $remote->connect('tcp://127.0.0.1:5562');
+        try{
+            $remote->setSharedMemory(4096);
+            $this->fail('shared memory accepted on a tcp socket');
+        }catch(ZMQException $e){
+        }
+
+        $publisher = new ZMQSocket($context, ZMQ::SOCKET_PUB);
+        $this->setExpectedException('ZMQException');
+        $publisher->setSharedMemory();
+    }
+
+    public function testSendArray()
+    {
+        $context = new ZMQContext(1, false);
+
+        $receiver = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+        $sender = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+        $receiver->bind('inproc://test-send-array');
+        $sender->connect('inproc://test-send-array');
+
+        $value = array(
+            'int' => 1, 'negative' => -100000, 'max' => PHP_INT_MAX,
+            'float' => 1.5, 'string' => str_repeat('s', 300),
+            'null' => null, 'bool' => true,
+            'list' => array(1, 2, array()), 7 => 'int key',
+        );
+        $sender->sendArray($value);
+        $this->assertSame($value, $receiver->recvArray());
+
+        // MessagePack on the wire, both ways
+        $sender->sendArray(array(1, 2, 3));
+        $this->assertSame("\x93\x01\x02\x03", $receiver->recv());
+        $sender->send("\x82\xa1a\x01\xa1b\x92\x01\xff");
+        $this->assertSame(array('a' => 1, 'b' => array(1, -1)), $receiver->recvArray());
+
+        $sender->send('not msgpack');
+        $this->setExpectedException('ZMQException');
+        $receiver->recvArray();
+    }
+
+    public function testSubscribeTagged()
+    {
+        $context = new ZMQContext(1, false);
+
+        $publisher = new ZMQSocket($context, ZMQ::SOCKET_PUB);
+        $subscriber = new ZMQSocket($context, ZMQ::SOCKET_SUB);
+        $publisher->bind('inproc://test-subscribe');
+        $subscriber->connect('inproc://test-subscribe');
+
+        $seen = array();
+        $subscriber->subscribe('weather.', function($frames, $prefix) use (&$seen) {
+            $seen[] = array($prefix, $frames[0]);
+        });
+        $subscriber->subscribe('weather.paris');
+        $subscriber->subscribe('news')->unsubscribe('news');
+
+        // subscriptions reach the publisher asynchronously
+        usleep(100000);
+        $publisher->send('news.today');
+        $publisher->send('weather.paris 21C');
+        $publisher->sendMulti(array('weather.oslo', '-3C'));
+
+        $this->assertEquals(
+            array('subscription' => 'weather.paris', 'frames' => array('weather.paris 21C')),
+            $subscriber->recvTagged(1000));
+        $this->assertEquals(1, $subscriber->dispatch(10, 1000));
+        $this->assertEquals(array(array('weather.', 'weather.oslo')), $seen);
+        $this->assertEquals(array('weather.' => 1, 'weather.paris' => 1), $subscriber->getSubscriptions());
+    }
+
+    public function testSetSockOpts()
+    {
+        $context = new ZMQContext(1, false);
+        $socket = new ZMQSocket($context, ZMQ::SOCKET_DEALER);
+
+        $socket->setSockOpts(array(
+            ZMQ::SOCKOPT_LINGER => 0,
+            ZMQ::SOCKOPT_SNDHWM => 5000,
+            ZMQ::SOCKOPT_IDENTITY => 'bulk',
+            ZMQ::SOCKOPT_IMMEDIATE => 1,
+        ));
+        $this->assertEquals(0, $socket->getSockOpt(ZMQ::SOCKOPT_LINGER));
+        $this->assertEquals(5000, $socket->getSockOpt(ZMQ::SOCKOPT_SNDHWM));
+        $this->assertEquals('bulk', $socket->getSockOpt(ZMQ::SOCKOPT_IDENTITY));
+        $this->assertEquals(1, $socket->getSockOpt(ZMQ::SOCKOPT_IMMEDIATE));
+
+        // nothing is applied when one of the keys is unknown
+        try{
+            $socket->setSockOpts(array(ZMQ::SOCKOPT_SNDHWM => 10, 12345 => 1));
+            $this->fail('unknown option accepted');
+        }catch(ZMQException $e){
+            $this->assertContains('12345', $e->getMessage());
+        }
+        $this->assertEquals(5000, $socket->getSockOpt(ZMQ::SOCKOPT_SNDHWM));
+
+        $this->setExpectedException('ZMQException');
+        $socket->setSockOpt(ZMQ::SOCKOPT_RCVMORE, 1);
+    }
+
+    public function testBroker()
+    {
+        $context = new ZMQContext(1, false);
+
+        $broker = new ZMQBroker($context, 'inproc://test-broker-front', 'inproc://test-broker-back');
+        $broker->start();
+
+        $worker = new ZMQSocket($context, ZMQ::SOCKET_REQ);
+        $worker->setSockOpt(ZMQ::SOCKOPT_IDENTITY, 'worker-1');
+        $worker->connect('inproc://test-broker-back');
+        $client = new ZMQSocket($context, ZMQ::SOCKET_REQ);
+        $client->connect('inproc://test-broker-front');
+
+        $client->send('hello');
+        $worker->send('READY');
+        $request = $worker->recvMulti();
+        $this->assertEquals(3, count($request));
+        $this->assertEquals(array('', 'hello'), array_slice($request, 1));
+        $stats = $broker->getStats();
+        $this->assertEquals(1, $stats['workers']['worker-1']['inflight']);
+
+        $worker->sendMulti(array($request[0], '', 'HELLO'));
+        $this->assertEquals('HELLO', $client->recv());
+
+        $stats = $broker->getStats();
+        $this->assertEquals(1, $stats['requests']);
+        $this->assertEquals(1, $stats['replies']);
+        $this->assertEquals(0, $stats['queue_depth']);
+        $this->assertEquals(1, $stats['ready_workers']);
+        $this->assertEquals(array('ready' => 1, 'inflight' => 0, 'handled' => 1),
+                            $stats['workers']['worker-1']);
+
+        // a worker that went away after asking for work is dropped
+        $gone = new ZMQSocket($context, ZMQ::SOCKET_REQ);
+        $gone->setSockOpt(ZMQ::SOCKOPT_IDENTITY, 'worker-2');
+        $gone->setSockOpt(ZMQ::SOCKOPT_LINGER, 0);
+        $gone->connect('inproc://test-broker-back');
+        $gone->send('READY');
+        usleep(100000);
+        unset($gone);
+        usleep(100000);
+        $client->send('first');
+        $this->assertEquals('first', $worker->recvMulti()[2]);
+        $other = new ZMQSocket($context, ZMQ::SOCKET_REQ);
+        $other->connect('inproc://test-broker-front');
+        $other->send('second');
+        usleep(100000);
+        $stats = $broker->getStats();
+        $this->assertEquals(1, $stats['unroutable']);
+        $this->assertEquals(1, $stats['queue_depth']);
+        $this->assertFalse(isset($stats['workers']['worker-2']));
+        $broker->stop();
+    }
+
+    public function testRpcClient()
+    {
+        $context = new ZMQContext(1, false);
+
+        $server = new ZMQSocket($context, ZMQ::SOCKET_REP);
+        $server->bind('inproc://test-rpc');
+        $client = new ZMQRpcClient($context, array('inproc://test-rpc'),
+                                   array('attempt_timeout' => 50, 'retries' => 0));
+
+        // both calls are in flight before the server answers
+        $first = $client->call('first');
+        $second = $client->call(array('second', 'part'));
+        $this->assertEquals(2, $client->pending());
+        foreach(array('first', 'second') as $expected){
+            $frames = $server->recvMulti();
+            $this->assertEquals($expected, $frames[0]);
+            $server->send(strtoupper($frames[0]));
+        }
+        $this->assertEquals(array('SECOND'), $client->wait($second));
+        $this->assertEquals(array($first => array('FIRST')), $client->poll(0));
+
+        // a call the server never answers
+        $lost = $client->call('lost', 100);
+        $server->recv();
+        $this->assertEquals(array($lost => false), $client->poll(1000));
+        $this->assertEquals(array(), $client->poll());
+
+        $stats = $client->getStats();
+        $this->assertEquals(3, $stats['sent']);
+        $this->assertEquals(2, $stats['replies']);
+        $this->assertEquals(1, $stats['timeouts']);
+        $this->assertEquals(0, $stats['inflight']);
+    }
+
+    public function testRecvBatch()
+    {
+        $context = new ZMQContext(1, false);
+
+        $receiver = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+        $sender = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+        $receiver->bind('inproc://test-recv-batch');
+        $sender->connect('inproc://test-recv-batch');
+
+        $this->assertEquals(array(), $receiver->recvBatch(10, 0));
+        $sender->sendBatch(array('a', 'b', 'c'));
+        $this->assertEquals(array('a', 'b'), $receiver->recvBatch(2, 100));
+        $this->assertEquals(array('c'), $receiver->recvBatch(10, 100));
+
+        $sender->send('d')->sendMulti(array('e', 'f'))->send('g');
+        $this->assertEquals(array('d', array('e', 'f'), 'g'), $receiver->recvBatch(10, 100));
+    }
+
+    public function testAsync()
+    {
+        $context = new ZMQContext(1, false);
+
+        $receiver = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+        $sender = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+        $receiver->bind('inproc://test-async');
+        $sender->connect('inproc://test-async');
+
+        $pending = $receiver->recvAsync(1000);
+        try{
+            $receiver->recv(ZMQ::MODE_DONTWAIT);
+            $this->fail('recv on a socket with a pending recvAsync');
+        }catch(ZMQException $e){
+        }
+        $sender->sendAsync('ping')->join();
+        $this->assertEquals('ping', $pending->join());
+    }
+
+    public function testMonitor()
+    {
+        $context = new ZMQContext(1, false);
+
+        $server = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+        $server->enableMonitor();
+        $server->bind('tcp://127.0.0.1:5561');
+
+        usleep(100000);
+        $events = $server->getMonitorEvents();
+        $this->assertEquals(ZMQ::EVENT_LISTENING, $events[0]['event']);
+        $counters = $server->getMonitorCounters();
+        $this->assertEquals(1, $counters['listening']);
+        $server->disableMonitor();
+    }
+
+    public function testDevice()
+    {
+        $context = new ZMQContext(1, false);
+
+        $frontend = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+        $backend = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+        $frontend->bind('inproc://test-device-in');
+        $backend->bind('inproc://test-device-out');
+
+        $producer = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+        $consumer = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+        $producer->connect('inproc://test-device-in');
+        $consumer->connect('inproc://test-device-out');
+
+        $device = new ZMQDevice($frontend, $backend);
+        $device->start();
+        $this->assertFalse($frontend->getSockOpt(ZMQ::SOCKOPT_LINGER));
+        $producer->send('through the device');
+        $this->assertEquals(array('through the device'), $consumer->recvBatch(1, 1000));
+        $device->stop();
+        $this->assertNotFalse($frontend->getSockOpt(ZMQ::SOCKOPT_LINGER));
+    }
+
     public function testPoll()
     {
         $context = new ZMQContext();
@@ -49,4 +543,24 @@ class UnitTest extends PHPUnit_Framework_TestCase
         $poll->clear();
         $this->assertEquals(0, $poll->count());
     }
+
+    public function testPollReadable()
+    {
+        $context = new ZMQContext(1, false);
+
+        $receiver = new ZMQSocket($context, ZMQ::SOCKET_PULL);
+        $sender = new ZMQSocket($context, ZMQ::SOCKET_PUSH);
+        $receiver->bind('inproc://test-poll-readable');
+        $sender->connect('inproc://test-poll-readable');
+
+        $poll = new ZMQPoll();
+        $id = $poll->add($receiver, ZMQ::POLL_IN);
+        $this->assertEquals($id, $poll->add($receiver, ZMQ::POLL_IN));
+
+        $sender->send('ping');
+        $readable = $writable = array();
+        $this->assertEquals(1, $poll->poll($readable, $writable, 100));
+        $this->assertSame($receiver, $readable[0]);
+        $this->assertEquals(array(), $poll->getLastErrors());
+    }
 }
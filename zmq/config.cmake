@@ -3,7 +3,19 @@ FIND_LIBRARY(ZMQ_LIBRARY NAMES zmq PATHS /lib /usr/lib /usr/local/lib)
 
 include_directories(${ZMQ_INCLUDE_DIR})
 
+# optional, for ZMQSocket::setCompression
+FIND_PATH(LZ4_INCLUDE_DIR NAMES lz4.h PATHS /usr/include /usr/local/include)
+FIND_LIBRARY(LZ4_LIBRARY NAMES lz4 PATHS /lib /usr/lib /usr/local/lib)
+if(LZ4_INCLUDE_DIR AND LZ4_LIBRARY)
+    include_directories(${LZ4_INCLUDE_DIR})
+    add_definitions(-DZMQ_HAVE_LZ4)
+endif()
+
 HHVM_EXTENSION(zmq ext_zmq.cpp)
 HHVM_SYSTEMLIB(zmq ext_zmq.php)
 
-target_link_libraries(zmq ${ZMQ_LIBRARY})
\ No newline at end of file
+# rt for shm_open with older glibc
+target_link_libraries(zmq ${ZMQ_LIBRARY} rt)
+if(LZ4_INCLUDE_DIR AND LZ4_LIBRARY)
+    target_link_libraries(zmq ${LZ4_LIBRARY})
+endif()
\ No newline at end of file
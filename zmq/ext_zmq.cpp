@@ -1,241 +1,4700 @@
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <ext/hash_map>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
 
 #include "hphp/runtime/base/base-includes.h"
 #include "hphp/runtime/ext/extension.h"
 #include "hphp/runtime/base/complex-types.h"
+#include "hphp/runtime/base/runtime-option.h"
+#include "hphp/runtime/ext/asio/asio_external_thread_event.h"
+#include "hphp/runtime/server/job-queue-vm-stack.h"
+#include "hphp/runtime/server/server.h"
+#include "hphp/runtime/server/transport.h"
+#include "hphp/util/job-queue.h"
 
 #include "zmq.hpp"
+#ifdef ZMQ_HAVE_LZ4
+#include <lz4.h>
+#endif
 
 namespace HPHP {
 
+// How a context runs its I/O threads: the CPUs they may use, their
+// scheduling policy and priority (-1 keeps the libzmq default), and whether
+// new sockets are spread over them with ZMQ_AFFINITY instead of letting
+// libzmq pick the least loaded thread.
+struct ZmqContextOptions {
+    int io_threads;
+    int max_sockets;
+    std::vector<int> cpus;
+    int sched_policy = -1;
+    int priority = -1;
+    bool auto_affinity = false;
+
+    bool operator<(const ZmqContextOptions& o) const {
+        return std::tie(io_threads, max_sockets, cpus, sched_policy, priority, auto_affinity) <
+               std::tie(o.io_threads, o.max_sockets, o.cpus, o.sched_policy, o.priority, o.auto_affinity);
+    }
+};
+
+// A libzmq context and the options it was created with.
+class ZmqContextEntry {
+public:
+    // nullptr if libzmq does not support or rejects one of the options;
+    // they have to be set before the first socket starts the I/O threads
+    static ZmqContextEntry* create(const ZmqContextOptions& options){
+        std::unique_ptr<ZmqContextEntry> entry(new ZmqContextEntry(options));
+        void* handle = *entry->ctx;
+        if(options.sched_policy >= 0 || options.priority >= 0){
+#ifdef ZMQ_THREAD_SCHED_POLICY
+            if(options.sched_policy >= 0 &&
+               zmq_ctx_set(handle, ZMQ_THREAD_SCHED_POLICY, options.sched_policy) != 0){
+                return nullptr;
+            }
+            if(options.priority >= 0 &&
+               zmq_ctx_set(handle, ZMQ_THREAD_PRIORITY, options.priority) != 0){
+                return nullptr;
+            }
+#else
+            return nullptr;
+#endif
+        }
+        if(!options.cpus.empty()){
+#ifdef ZMQ_THREAD_AFFINITY_CPU_ADD
+            for(int cpu : options.cpus){
+                if(zmq_ctx_set(handle, ZMQ_THREAD_AFFINITY_CPU_ADD, cpu) != 0){
+                    return nullptr;
+                }
+            }
+#else
+            return nullptr;
+#endif
+        }
+        return entry.release();
+    }
+
+    ~ZmqContextEntry(){
+        delete ctx;
+    }
+
+    // ZMQ_AFFINITY for a new socket, 0 to leave it to libzmq; the mask has
+    // a bit per I/O thread, so only the first 64 threads are used
+    uint64_t nextAffinity(){
+        if(!options.auto_affinity){
+            return 0;
+        }
+        uint64_t threads = std::min(std::max(options.io_threads, 1), 64);
+        return 1ULL << (sockets.fetch_add(1, std::memory_order_relaxed) % threads);
+    }
+
+    zmq::context_t* ctx;
+    ZmqContextOptions options;
+
+private:
+    explicit ZmqContextEntry(const ZmqContextOptions& o)
+        : ctx(new zmq::context_t(o.io_threads, o.max_sockets)), options(o), sockets(0) {}
+
+    std::atomic<uint64_t> sockets;
+};
+
+// Process-wide registry of persistent contexts, keyed by the options the
+// context was created with. Entries are never destroyed: they live for the
+// whole server so that I/O threads are spawned once and not on every request.
+class PersistentContextRegistry {
+public:
+    static ZmqContextEntry* acquire(const ZmqContextOptions& options){
+        std::lock_guard<std::mutex> lock(s_mutex);
+        auto it = s_contexts.find(options);
+        if(it != s_contexts.end()){
+            s_reused.fetch_add(1, std::memory_order_relaxed);
+            return it->second;
+        }
+        ZmqContextEntry* entry = ZmqContextEntry::create(options);
+        if(entry == nullptr){
+            return nullptr;
+        }
+        s_contexts[options] = entry;
+        s_created.fetch_add(1, std::memory_order_relaxed);
+        return entry;
+    }
+
+    static void stats(Array& arr){
+        {
+            std::lock_guard<std::mutex> lock(s_mutex);
+            arr.set(String("contexts"), (int64_t)s_contexts.size());
+        }
+        arr.set(String("contexts_created"), (int64_t)s_created.load(std::memory_order_relaxed));
+        arr.set(String("contexts_reused"), (int64_t)s_reused.load(std::memory_order_relaxed));
+    }
+
+private:
+    static std::mutex s_mutex;
+    static std::map<ZmqContextOptions, ZmqContextEntry*> s_contexts;
+    static std::atomic<uint64_t> s_created;
+    static std::atomic<uint64_t> s_reused;
+};
+
+std::mutex PersistentContextRegistry::s_mutex;
+std::map<ZmqContextOptions, ZmqContextEntry*> PersistentContextRegistry::s_contexts;
+std::atomic<uint64_t> PersistentContextRegistry::s_created(0);
+std::atomic<uint64_t> PersistentContextRegistry::s_reused(0);
+
 class ZmqContextResource : public SweepableResourceData {
 public:
     DECLARE_RESOURCE_ALLOCATION(ZmqContextResource)
     CLASSNAME_IS("zmq_context")
     virtual const String& o_getClassNameHook() const { return classnameof(); }
 
-    explicit ZmqContextResource(int io_threads) {
-        ctx = new zmq::context_t(io_threads);
-    }
+    // persistent entries belong to the registry, others to the resource
+    explicit ZmqContextResource(ZmqContextEntry* entry, bool is_persistent)
+        : entry(entry), persistent(is_persistent) {}
     virtual ~ZmqContextResource() { 
         close(); 
-        delete ctx;
+        if(!persistent){
+            delete entry;
+        }
     }
     void close() {
-        ctx->close();
+        // persistent contexts are owned by the registry and outlive the request
+        if(!persistent){
+            entry->ctx->close();
+        }
     }
-    zmq::context_t* getContext() { return ctx; }
+    zmq::context_t* getContext() { return entry->ctx; }
+    uint64_t nextAffinity() { return entry->nextAffinity(); }
+
+    // A persistent context is shared with every request that asked for the
+    // same options, so resizing it moves this resource to the registry entry
+    // of the new options instead; sockets made so far stay where they are.
+    int setOpt(int option, int value){
+        if(!persistent){
+            return entry->ctx->set_opt(option, value);
+        }
+        ZmqContextOptions options = entry->options;
+        if(option == ZMQ_IO_THREADS){
+            options.io_threads = value;
+        }else if(option == ZMQ_MAX_SOCKETS){
+            options.max_sockets = value;
+        }else{
+            return -1;
+        }
+        ZmqContextEntry* moved = PersistentContextRegistry::acquire(options);
+        if(moved == nullptr){
+            return -1;
+        }
+        entry = moved;
+        return 0;
+    }
+    bool isPersistent() { return persistent; }
 
 private:
-    zmq::context_t *ctx;
+    ZmqContextEntry* entry;
+    bool persistent;
 };
 
 void ZmqContextResource::sweep() {
     close();
 }
 
-class ZmqSocketResource : public SweepableResourceData {
+// Strings lent to libzmq by zero-copy sends. libzmq calls the free function
+// from its I/O thread, where HHVM refcounts must not be touched, so released
+// strings are queued here and dropped later by the request thread. The
+// socket holds one reference to the tracker and every lent string another,
+// so a free function that runs late never finds it gone.
+class ZeroCopyTracker {
 public:
-    DECLARE_RESOURCE_ALLOCATION(ZmqSocketResource)
-    CLASSNAME_IS("zmq_socket")
-    virtual const String& o_getClassNameHook() const { return classnameof(); }
+    struct Node {
+        ZeroCopyTracker* tracker;
+        StringData* str;
+        Node* next;
+    };
 
-    explicit ZmqSocketResource(zmq::context_t* ctx, int type){
-        sock = new zmq::socket_t(*ctx, type);
+    static ZeroCopyTracker* create() { return new ZeroCopyTracker(); }
+
+    void release(){
+        if(refs.fetch_sub(1, std::memory_order_acq_rel) == 1){
+            collect(false);
+            delete this;
+        }
     }
-    virtual ~ZmqSocketResource() { 
-        close(); 
-        delete sock;
+
+    // pins the string until libzmq is done with its buffer
+    Node* lend(StringData* str){
+        str->incRefCount();
+        refs.fetch_add(1, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(mutex);
+        pending++;
+        return new Node{this, str, nullptr};
     }
-    void close() {
-        sock->close();
+
+    static void freeFn(void* data, void* hint){
+        Node* node = static_cast<Node*>(hint);
+        ZeroCopyTracker* tracker = node->tracker;
+        Node* head = tracker->released.load(std::memory_order_relaxed);
+        do {
+            node->next = head;
+        } while(!tracker->released.compare_exchange_weak(head, node,
+                    std::memory_order_release, std::memory_order_relaxed));
+
+        {
+            std::lock_guard<std::mutex> lock(tracker->mutex);
+            if(--tracker->pending == 0){
+                tracker->cond.notify_all();
+            }
+        }
+        tracker->release();
+    }
+
+    // drops the strings libzmq released; during sweep the request heap is
+    // about to be reset, so the strings are forgotten instead of released
+    void collect(bool release_strings){
+        Node* node = released.exchange(nullptr, std::memory_order_acquire);
+        while(node){
+            Node* next = node->next;
+            if(release_strings){
+                node->str->decRefAndRelease();
+            }
+            delete node;
+            node = next;
+        }
+    }
+
+    bool idle(){
+        std::lock_guard<std::mutex> lock(mutex);
+        return pending == 0;
+    }
+
+    // waits until libzmq released every lent buffer, false on timeout; a
+    // negative timeout waits for as long as it takes
+    bool wait(int64_t timeout_ms){
+        std::unique_lock<std::mutex> lock(mutex);
+        if(timeout_ms < 0){
+            cond.wait(lock, [this]{ return pending == 0; });
+            return true;
+        }
+        return cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this]{ return pending == 0; });
     }
-    zmq::socket_t* getSocket() { return sock; }
 
 private:
-    zmq::socket_t* sock;
+    ZeroCopyTracker() : released(nullptr), refs(1), pending(0) {}
+
+    std::atomic<Node*> released;
+    std::atomic<int64_t> refs;
+    std::mutex mutex;
+    std::condition_variable cond;
+    int64_t pending;  // guarded by mutex
 };
 
-void ZmqSocketResource::sweep() {
-    close();
+// A native thread that took over a socket (a device, a writer thread...).
+// Closing the socket revokes the lease first, which stops that thread.
+class ZmqSocketLease {
+public:
+    virtual ~ZmqSocketLease() {}
+    virtual void revoke() = 0;
+    // true if the thread keeps the socket while it waits in the pool
+    virtual bool outlivesRequest() const { return false; }
+};
+
+#ifdef ZMQ_EVENT_MONITOR_STOPPED
+// Watches a socket with zmq::monitor_t on a native thread. Events go into a
+// single-producer/single-consumer ring that the request drains without
+// blocking; when the ring is full new events are counted as dropped. The
+// counters are kept for the whole life of the monitor.
+class ZmqSocketMonitor : public zmq::monitor_t {
+public:
+    struct Event {
+        int64_t time_us;
+        int event;
+        std::string address;
+    };
+
+    static const size_t kCapacity = 1024;
+
+    ZmqSocketMonitor() : head(0), tail(0), dropped(0), started(false) {
+        for(auto& counter : counters){
+            counter.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // returns once the monitor is attached, so the caller can go on using
+    // the socket from its own thread; rethrows if it could not attach
+    void start(zmq::socket_t* sock, int events){
+        char endpoint[64];
+        snprintf(endpoint, sizeof(endpoint), "inproc://hhvm-zmq-monitor-%p", (void*)this);
+        std::string addr(endpoint);
+        thread = std::thread([this, sock, addr, events]{
+            try{
+                monitor(*sock, addr.c_str(), events);
+            }catch(std::exception& e){
+                std::lock_guard<std::mutex> lock(mutex);
+                error = std::current_exception();
+                cond.notify_all();
+            }
+        });
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this]{ return started || error; });
+            if(started){
+                return;
+            }
+        }
+        thread.join();
+        std::rethrow_exception(error);
+    }
+
+    void stop(){
+        abort();
+        thread.join();
+    }
+
+    // request thread only
+    bool pop(Event& event){
+        uint64_t h = head.load(std::memory_order_relaxed);
+        if(h == tail.load(std::memory_order_acquire)){
+            return false;
+        }
+        event = std::move(ring[h % kCapacity]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    void stats(Array& arr){
+        static const char* names[] = {
+            "connected", "connect_delayed", "connect_retried", "listening",
+            "bind_failed", "accepted", "accept_failed", "closed",
+            "close_failed", "disconnected",
+        };
+        for(int i = 0; i < kCounters; i++){
+            arr.set(String(names[i]), (int64_t)counters[i].load(std::memory_order_relaxed));
+        }
+        arr.set(String("dropped"), (int64_t)dropped.load(std::memory_order_relaxed));
+    }
+
+    virtual void on_monitor_started(){
+        std::lock_guard<std::mutex> lock(mutex);
+        started = true;
+        cond.notify_all();
+    }
+    virtual void on_event_connected(const zmq_event_t& e, const char* addr){ record(0, ZMQ_EVENT_CONNECTED, addr); }
+    virtual void on_event_connect_delayed(const zmq_event_t& e, const char* addr){ record(1, ZMQ_EVENT_CONNECT_DELAYED, addr); }
+    virtual void on_event_connect_retried(const zmq_event_t& e, const char* addr){ record(2, ZMQ_EVENT_CONNECT_RETRIED, addr); }
+    virtual void on_event_listening(const zmq_event_t& e, const char* addr){ record(3, ZMQ_EVENT_LISTENING, addr); }
+    virtual void on_event_bind_failed(const zmq_event_t& e, const char* addr){ record(4, ZMQ_EVENT_BIND_FAILED, addr); }
+    virtual void on_event_accepted(const zmq_event_t& e, const char* addr){ record(5, ZMQ_EVENT_ACCEPTED, addr); }
+    virtual void on_event_accept_failed(const zmq_event_t& e, const char* addr){ record(6, ZMQ_EVENT_ACCEPT_FAILED, addr); }
+    virtual void on_event_closed(const zmq_event_t& e, const char* addr){ record(7, ZMQ_EVENT_CLOSED, addr); }
+    virtual void on_event_close_failed(const zmq_event_t& e, const char* addr){ record(8, ZMQ_EVENT_CLOSE_FAILED, addr); }
+    virtual void on_event_disconnected(const zmq_event_t& e, const char* addr){ record(9, ZMQ_EVENT_DISCONNECTED, addr); }
+
+private:
+    static const int kCounters = 10;
+
+    // monitor thread only
+    void record(int counter, int event, const char* addr){
+        counters[counter].fetch_add(1, std::memory_order_relaxed);
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        if(t - head.load(std::memory_order_acquire) >= kCapacity){
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        Event& slot = ring[t % kCapacity];
+        slot.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        slot.event = event;
+        slot.address = addr;
+        tail.store(t + 1, std::memory_order_release);
+    }
+
+    Event ring[kCapacity];
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> counters[kCounters];
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool started;
+    std::exception_ptr error;
+};
+#endif
+
+// Log-linear histogram of wait times in microseconds: four sub-buckets per
+// power of two, up to 2^40us. Every histogram has a single writer (the
+// thread using the socket, or the thread owning the block) so increments
+// are plain relaxed load/store pairs, no locked instructions.
+class LatencyHistogram {
+public:
+    static const int kBuckets = 156;
+
+    LatencyHistogram() : count(0), total(0), max(0) {
+        for(auto& bucket : buckets){
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    static int bucketOf(uint64_t us){
+        if(us < 4){
+            return us;
+        }
+        if(us >= (1ULL << 40)){
+            return kBuckets - 1;
+        }
+        int e = 63 - __builtin_clzll(us);
+        int sub = (us >> (e - 2)) & 3;
+        return (e - 1) * 4 + sub;
+    }
+
+    // largest value that falls into the bucket
+    static uint64_t upperBound(int bucket){
+        if(bucket < 4){
+            return bucket;
+        }
+        int e = bucket / 4 + 1;
+        int sub = bucket % 4;
+        return ((uint64_t)(4 + sub + 1) << (e - 2)) - 1;
+    }
+
+    void record(uint64_t us){
+        bump(buckets[bucketOf(us)], 1);
+        bump(count, 1);
+        bump(total, us);
+        if(us > max.load(std::memory_order_relaxed)){
+            max.store(us, std::memory_order_relaxed);
+        }
+    }
+
+    void addTo(LatencyHistogram& sum) const {
+        for(int i = 0; i < kBuckets; i++){
+            sum.buckets[i].fetch_add(buckets[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        sum.count.fetch_add(count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        sum.total.fetch_add(total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        uint64_t m = max.load(std::memory_order_relaxed);
+        if(m > sum.max.load(std::memory_order_relaxed)){
+            sum.max.store(m, std::memory_order_relaxed);
+        }
+    }
+
+    // count, total_us, max_us and the non-empty buckets as upper bound => count
+    Array toArray() const {
+        Array hist = Array::Create();
+        Array bounds = Array::Create();
+        for(int i = 0; i < kBuckets; i++){
+            uint64_t n = buckets[i].load(std::memory_order_relaxed);
+            if(n){
+                bounds.set((int64_t)upperBound(i), (int64_t)n);
+            }
+        }
+        hist.set(String("count"), (int64_t)count.load(std::memory_order_relaxed));
+        hist.set(String("total_us"), (int64_t)total.load(std::memory_order_relaxed));
+        hist.set(String("max_us"), (int64_t)max.load(std::memory_order_relaxed));
+        hist.set(String("buckets"), bounds);
+        return hist;
+    }
+
+    static void bump(std::atomic<uint64_t>& counter, uint64_t n){
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> buckets[kBuckets];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> max;
+};
+
+// Hot path counters, kept per socket and per thread. Single writer, see
+// LatencyHistogram.
+struct ZmqStats {
+    std::atomic<uint64_t> messages_sent{0};
+    std::atomic<uint64_t> bytes_sent{0};
+    std::atomic<uint64_t> messages_received{0};
+    std::atomic<uint64_t> bytes_received{0};
+    std::atomic<uint64_t> eagain{0};
+    std::atomic<uint64_t> timeouts{0};
+    std::atomic<uint64_t> errors{0};
+    LatencyHistogram send_wait;
+    LatencyHistogram recv_wait;
+    LatencyHistogram poll_wait;
+
+    void sent(size_t bytes, uint64_t wait_us){
+        LatencyHistogram::bump(messages_sent, 1);
+        LatencyHistogram::bump(bytes_sent, bytes);
+        send_wait.record(wait_us);
+    }
+
+    void received(size_t bytes, uint64_t wait_us){
+        LatencyHistogram::bump(messages_received, 1);
+        LatencyHistogram::bump(bytes_received, bytes);
+        recv_wait.record(wait_us);
+    }
+
+    // EAGAIN of a non-blocking call, or the socket's SNDTIMEO/RCVTIMEO
+    void wouldBlock(int flags){
+        LatencyHistogram::bump((flags & ZMQ_DONTWAIT) ? eagain : timeouts, 1);
+    }
+
+    void failed(){
+        LatencyHistogram::bump(errors, 1);
+    }
+
+    void addTo(ZmqStats& sum) const {
+        sum.messages_sent.fetch_add(messages_sent.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        sum.bytes_sent.fetch_add(bytes_sent.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        sum.messages_received.fetch_add(messages_received.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        sum.bytes_received.fetch_add(bytes_received.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        sum.eagain.fetch_add(eagain.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        sum.timeouts.fetch_add(timeouts.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        sum.errors.fetch_add(errors.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        send_wait.addTo(sum.send_wait);
+        recv_wait.addTo(sum.recv_wait);
+        poll_wait.addTo(sum.poll_wait);
+    }
+
+    Array toArray(bool with_poll) const {
+        Array arr = Array::Create();
+        arr.set(String("messages_sent"), (int64_t)messages_sent.load(std::memory_order_relaxed));
+        arr.set(String("bytes_sent"), (int64_t)bytes_sent.load(std::memory_order_relaxed));
+        arr.set(String("messages_received"), (int64_t)messages_received.load(std::memory_order_relaxed));
+        arr.set(String("bytes_received"), (int64_t)bytes_received.load(std::memory_order_relaxed));
+        arr.set(String("eagain"), (int64_t)eagain.load(std::memory_order_relaxed));
+        arr.set(String("timeouts"), (int64_t)timeouts.load(std::memory_order_relaxed));
+        arr.set(String("errors"), (int64_t)errors.load(std::memory_order_relaxed));
+        arr.set(String("send_wait"), send_wait.toArray());
+        arr.set(String("recv_wait"), recv_wait.toArray());
+        if(with_poll){
+            arr.set(String("poll_wait"), poll_wait.toArray());
+        }
+        return arr;
+    }
+};
+
+// Per-thread ZmqStats blocks, summed on demand by zmq_stats(). A block is
+// registered once per thread and kept after the thread exits so the process
+// totals never go backwards.
+class ZmqThreadStats {
+public:
+    static ZmqStats& local(){
+        static thread_local ZmqStats* stats = nullptr;
+        if(stats == nullptr){
+            stats = new ZmqStats();
+            std::lock_guard<std::mutex> lock(s_mutex);
+            s_blocks.push_back(stats);
+        }
+        return *stats;
+    }
+
+    static void collect(ZmqStats& sum){
+        std::lock_guard<std::mutex> lock(s_mutex);
+        for(auto block : s_blocks){
+            block->addTo(sum);
+        }
+    }
+
+private:
+    static std::mutex s_mutex;
+    static std::vector<ZmqStats*> s_blocks;
+};
+
+std::mutex ZmqThreadStats::s_mutex;
+std::vector<ZmqStats*> ZmqThreadStats::s_blocks;
+
+static inline uint64_t zmq_now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Frames produced by the extension itself start with a small envelope: the
+// magic bytes and a tag saying what the frame carries. Receivers unwrap the
+// kinds they opted into with zmq_socket_decode(), anything else is
+// delivered untouched.
+static const char kZmqEnvelopeMagic[3] = { '\xff', 'Z', 'M' };
+static const size_t kZmqEnvelopeSize = 4;
+
+enum ZmqEnvelopeTag {
+    kZmqEnvelopeBatch = 'B',
+    kZmqEnvelopeCompressed = 'C',
+    kZmqEnvelopeShared = 'S',
+};
+
+// the envelopes a socket unwraps, ZMQ::DECODE_* in PHP
+enum ZmqDecode {
+    kZmqDecodeBatch = 1,
+    kZmqDecodeCompressed = 2,
+    kZmqDecodeShared = 4,
+    kZmqDecodeAll = kZmqDecodeBatch | kZmqDecodeCompressed | kZmqDecodeShared,
+};
+
+static inline void zmq_envelope_put(std::string& buffer, char tag)
+{
+    buffer.append(kZmqEnvelopeMagic, sizeof(kZmqEnvelopeMagic));
+    buffer.push_back(tag);
+}
+
+// the tag of an enveloped frame, 0 for a plain one
+static inline char zmq_envelope_tag(const void* data, size_t size)
+{
+    if(size < kZmqEnvelopeSize || memcmp(data, kZmqEnvelopeMagic, sizeof(kZmqEnvelopeMagic)) != 0){
+        return 0;
+    }
+    return static_cast<const char*>(data)[sizeof(kZmqEnvelopeMagic)];
+}
+
+static inline void zmq_varint_put(std::string& buffer, uint64_t value)
+{
+    while(value >= 0x80){
+        buffer.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back((char)value);
+}
+
+// false on a truncated or overlong varint
+static inline bool zmq_varint_get(const unsigned char*& p, const unsigned char* end, uint64_t& value)
+{
+    value = 0;
+    for(int shift = 0; shift < 64 && p < end; shift += 7){
+        unsigned char byte = *p++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)){
+            return true;
+        }
+    }
+    return false;
 }
 
-class PollItem {
+// Packs small messages into one batch frame: the envelope, then every
+// message as a varint length and its bytes. Used by one thread at a time,
+// the request or the send queue's writer.
+class ZmqCoalescer {
 public:
-    explicit PollItem(zmq::socket_t* s, String i, int t){
-        sock = s;
-        id = i;
-        type = t;
+    ZmqCoalescer(size_t max, uint64_t interval) : max_bytes(max), interval_us(interval) {
+        clear();
     }
 
-    ~PollItem(){
-        sock = nullptr;
+    // larger messages are not worth coalescing and go out on their own
+    bool fits(size_t size) const {
+        return kZmqEnvelopeSize + kMaxVarint + size <= max_bytes;
     }
 
-    int getType(){
-        return type;
+    // the message would push the batch past max_bytes
+    bool overflows(size_t size) const {
+        return buffer.size() + kMaxVarint + size > max_bytes;
     }
-    String getId(){
-        return id;
+
+    void add(const void* data, size_t size, uint64_t now){
+        if(count == 0){
+            first_us = now;
+        }
+        zmq_varint_put(buffer, size);
+        buffer.append(static_cast<const char*>(data), size);
+        count++;
+        last_size = size;
+    }
+
+    bool due(uint64_t now) const {
+        return count > 0 && now - first_us >= interval_us;
+    }
+
+    uint64_t deadline() const { return first_us + interval_us; }
+    size_t pending() const { return count; }
+
+    // copies the batch into msg, a lone message is sent without envelope;
+    // the batch is kept until clear() so a failed send can be retried
+    void build(zmq::message_t& msg) const {
+        if(count == 1){
+            msg.rebuild(last_size);
+            memcpy(msg.data(), buffer.data() + buffer.size() - last_size, last_size);
+        }else{
+            msg.rebuild(buffer.size());
+            memcpy(msg.data(), buffer.data(), buffer.size());
+        }
     }
-    zmq::socket_t* getSock(){
-        return sock;
+
+    void clear(){
+        buffer.clear();
+        buffer.reserve(max_bytes);
+        zmq_envelope_put(buffer, kZmqEnvelopeBatch);
+        count = 0;
+        first_us = 0;
+        last_size = 0;
     }
+
+    const size_t max_bytes;
+    const uint64_t interval_us;
+
 private:
-    zmq::socket_t* sock;
-    String id;
-    int type;
+    static const size_t kMaxVarint = 10;
+
+    std::string buffer;
+    size_t count;
+    uint64_t first_us;
+    size_t last_size;
 };
 
-class ZmqPollResource : public SweepableResourceData {
+// Receive side of ZmqCoalescer: keeps a batch frame and hands out its
+// messages one by one, copied straight from the frame.
+class ZmqUnbatcher {
 public:
-    DECLARE_RESOURCE_ALLOCATION(ZmqPollResource)
-    CLASSNAME_IS("zmq_poll")
-    virtual const String& o_getClassNameHook() const { return classnameof(); }
-    void addPollItem(zmq::socket_t* sock, const String& id, int type){
-        PollItem *item = new PollItem(sock, id, type);
-        items.push_back(item);
+    ZmqUnbatcher() : offset(0) {}
+
+    // takes the frame if it is a well-formed batch
+    bool take(zmq::message_t& msg){
+        if(zmq_envelope_tag(msg.data(), msg.size()) != kZmqEnvelopeBatch){
+            return false;
+        }
+        const unsigned char* p = static_cast<const unsigned char*>(msg.data()) + kZmqEnvelopeSize;
+        const unsigned char* end = static_cast<const unsigned char*>(msg.data()) + msg.size();
+        if(p == end){
+            return false;
+        }
+        while(p < end){
+            uint64_t size;
+            if(!zmq_varint_get(p, end, size) || size > (uint64_t)(end - p)){
+                return false;
+            }
+            p += size;
+        }
+        batch.move(&msg);
+        offset = kZmqEnvelopeSize;
+        return true;
+    }
+
+    bool pending() const { return offset != 0; }
+
+    String next(){
+        const unsigned char* base = static_cast<const unsigned char*>(batch.data());
+        const unsigned char* p = base + offset;
+        uint64_t size = 0;
+        zmq_varint_get(p, base + batch.size(), size);
+        String str(size, ReserveString);
+        memcpy(str.bufferSlice().ptr, p, size);
+        str.setSize(size);
+        offset = (p - base) + size;
+        if(offset == batch.size()){
+            batch.rebuild();
+            offset = 0;
+        }
+        return str;
+    }
+
+private:
+    zmq::message_t batch;
+    size_t offset;
+};
+
+// Prefix trie of the subscriptions of a SUB socket. Every node keeps its
+// children sorted by byte, so a lookup walks the topic once and finds the
+// longest subscribed prefix however many subscriptions there are. Nodes of
+// removed subscriptions are kept for reuse.
+class ZmqTopicTrie {
+public:
+    ZmqTopicTrie() : nodes(1) {}
+
+    // false if the prefix is already subscribed
+    bool insert(const std::string& prefix){
+        uint32_t node = 0;
+        for(unsigned char byte : prefix){
+            int next = child(node, byte);
+            if(next < 0){
+                next = nodes.size();
+                auto& children = nodes[node].children;
+                children.insert(lowerBound(node, byte), std::make_pair(byte, (uint32_t)next));
+                nodes.emplace_back();
+            }
+            node = next;
+        }
+        if(nodes[node].subscription >= 0){
+            return false;
+        }
+        int id;
+        if(free_ids.empty()){
+            id = prefixes.size();
+            prefixes.push_back(prefix);
+            matched.push_back(0);
+            active.push_back(true);
+        }else{
+            id = free_ids.back();
+            free_ids.pop_back();
+            prefixes[id] = prefix;
+            matched[id] = 0;
+            active[id] = true;
+        }
+        nodes[node].subscription = id;
+        return true;
     }
 
-    std::vector<PollItem*> getPollItems(){
-        return items;
+    // false if the prefix was not subscribed
+    bool erase(const std::string& prefix){
+        uint32_t node = 0;
+        for(unsigned char byte : prefix){
+            int next = child(node, byte);
+            if(next < 0){
+                return false;
+            }
+            node = next;
+        }
+        int id = nodes[node].subscription;
+        if(id < 0){
+            return false;
+        }
+        nodes[node].subscription = -1;
+        prefixes[id].clear();
+        active[id] = false;
+        free_ids.push_back(id);
+        return true;
     }
 
-    void removePollItem(String id){
-        std::vector<PollItem*>::iterator it;
-        for(it = items.begin(); it != items.end(); ){
-            if((*it)->getId().same(id)){
-                delete *it;
-                it = items.erase(it);
+    // id of the longest subscribed prefix of the topic, -1 if none
+    int match(const char* topic, size_t size){
+        uint32_t node = 0;
+        int best = nodes[0].subscription;
+        for(size_t i = 0; i < size; i++){
+            int next = child(node, topic[i]);
+            if(next < 0){
                 break;
             }
+            node = next;
+            if(nodes[node].subscription >= 0){
+                best = nodes[node].subscription;
+            }
+        }
+        if(best >= 0){
+            matched[best]++;
+        }
+        return best;
+    }
+
+    const std::string& prefix(int id) const { return prefixes[id]; }
+
+    std::vector<std::string> list() const {
+        std::vector<std::string> result;
+        for(size_t id = 0; id < prefixes.size(); id++){
+            if(active[id]){
+                result.push_back(prefixes[id]);
+            }
+        }
+        return result;
+    }
+
+    // prefix => messages matched
+    Array toArray() const {
+        Array arr = Array::Create();
+        for(size_t id = 0; id < prefixes.size(); id++){
+            if(active[id]){
+                arr.set(String(prefixes[id]), (int64_t)matched[id]);
+            }
+        }
+        return arr;
+    }
+
+private:
+    typedef std::vector<std::pair<unsigned char, uint32_t>> Children;
+
+    struct Node {
+        Children children;
+        int subscription = -1;
+    };
+
+    Children::iterator lowerBound(uint32_t node, unsigned char byte){
+        auto& children = nodes[node].children;
+        return std::lower_bound(children.begin(), children.end(), std::make_pair(byte, (uint32_t)0));
+    }
+
+    int child(uint32_t node, unsigned char byte){
+        auto it = lowerBound(node, byte);
+        if(it == nodes[node].children.end() || it->first != byte){
+            return -1;
+        }
+        return it->second;
+    }
+
+    std::vector<Node> nodes;
+    std::vector<std::string> prefixes;   // subscription id -> prefix
+    std::vector<uint64_t> matched;
+    std::vector<bool> active;
+    std::vector<int> free_ids;
+};
+
+class ZmqSendQueue;
+struct ZmqSocketData;
+
+// Ties a recvAsync to its socket until the request has taken the result.
+// close() cuts the link, since the event itself may be freed on the loop
+// thread once the request has abandoned it.
+struct ZmqAsyncSlot {
+    ZmqSocketData* data;
+};
+
+// Native state of one zmq socket. Plain sockets are owned by their
+// ZmqSocketResource; persistent sockets are owned by the PersistentSocketPool
+// between requests so that their connections survive the request sweep.
+struct ZmqSocketData {
+    ZmqSocketData(zmq::context_t* c, int t, const std::string& id)
+        : ctx(c), type(t), persistent_id(id) {
+        sock = new zmq::socket_t(*c, t);
+    }
+    ~ZmqSocketData(){
+        if(lease){
+            lease->revoke();
+        }
+#ifdef ZMQ_EVENT_MONITOR_STOPPED
+        if(monitor){
+            monitor->stop();
+            delete monitor;
+        }
+#endif
+        delete coalescer;
+        zero_copy->release();
+        delete topics;
+        sock->close();
+        delete sock;
+    }
+
+    zmq::socket_t* sock;
+    zmq::context_t* ctx;
+    int type;
+    std::string persistent_id;  // empty unless the socket is pooled
+    std::set<std::string> connected;
+    std::set<std::string> bound;
+    ZeroCopyTracker* zero_copy = ZeroCopyTracker::create();
+    ZmqStats stats;
+
+    // set while a recvAsync/sendAsync owns the socket; a recvAsync keeps it
+    // until the request has taken the received message
+    std::atomic<bool> async_pending{false};
+
+    // the recvAsync whose message is not taken yet, request thread only
+    std::shared_ptr<ZmqAsyncSlot> async_recv;
+
+    // set while a native thread owns the socket, request thread only
+    ZmqSocketLease* lease = nullptr;
+
+    // set while send() goes through the writer thread, request thread only
+    ZmqSendQueue* send_queue = nullptr;
+
+    // small message coalescing, used by whichever thread sends
+    ZmqCoalescer* coalescer = nullptr;
+    // the last frame sent had ZMQ_SNDMORE set
+    bool send_more = false;
+    // envelopes unwrapped on receive, a mask of ZmqDecode
+    int decode = 0;
+    // rest of a received batch, request thread only
+    ZmqUnbatcher unbatcher;
+    // the last frame received had ZMQ_RCVMORE set
+    bool recv_more = false;
+
+    // subscriptions made with subscribe(), request thread only
+    ZmqTopicTrie* topics = nullptr;
+
+    // frames of at least this size are compressed, -1 for none
+    int64_t compress_threshold = -1;
+    int compress_acceleration = 1;
+
+    // payloads of at least this size go through shared memory, -1 for none
+    int64_t shm_threshold = -1;
+    int64_t shm_ttl = 0;
+
+#ifdef ZMQ_EVENT_MONITOR_STOPPED
+    ZmqSocketMonitor* monitor = nullptr;
+#endif
+
+    // last worker thread that checked the socket out, and when it came back
+    std::thread::id owner;
+    std::chrono::steady_clock::time_point last_used;
+};
+
+// Process-wide pool of persistent sockets keyed by (context, type,
+// persistent_id). A socket is checked out by exactly one request at a time,
+// so it is never used by two threads at once; idle sockets are closed after
+// kIdleTimeout. Which endpoints a socket has is only known once the request
+// connects it, so ZmqSocketResource matches them afterwards with
+// acquireConnected().
+class PersistentSocketPool {
+public:
+    static ZmqSocketData* acquire(zmq::context_t* ctx, int type, const std::string& id, bool& reused){
+        ZmqSocketData* data = take(Key(ctx, type, id), [](ZmqSocketData*){ return true; });
+        reused = data != nullptr;
+        if(reused){
+            s_reused.fetch_add(1, std::memory_order_relaxed);
+        }else{
+            data = new ZmqSocketData(ctx, type, id);
+            s_created.fetch_add(1, std::memory_order_relaxed);
+        }
+        data->owner = std::this_thread::get_id();
+        return data;
+    }
+
+    // an idle socket of the key that has all of these endpoints, nullptr if
+    // there is none
+    static ZmqSocketData* acquireConnected(zmq::context_t* ctx, int type, const std::string& id,
+                                           const std::set<std::string>& connected,
+                                           const std::set<std::string>& bound){
+        auto has = [](const std::set<std::string>& all, const std::set<std::string>& some){
+            return std::includes(all.begin(), all.end(), some.begin(), some.end());
+        };
+        ZmqSocketData* data = take(Key(ctx, type, id), [&](ZmqSocketData* d){
+            return d->lease == nullptr && has(d->connected, connected) && has(d->bound, bound);
+        });
+        if(data){
+            s_reused.fetch_add(1, std::memory_order_relaxed);
+            data->owner = std::this_thread::get_id();
+        }
+        return data;
+    }
+
+    static void release(ZmqSocketData* data){
+        std::vector<ZmqSocketData*> evicted;
+        {
+            std::lock_guard<std::mutex> lock(s_mutex);
+            data->last_used = std::chrono::steady_clock::now();
+            s_idle[Key(data->ctx, data->type, data->persistent_id)].push_back(data);
+            evictIdle(evicted);
+        }
+        closeAll(evicted);
+    }
+
+    static void stats(Array& arr){
+        int64_t idle = 0;
+        {
+            std::lock_guard<std::mutex> lock(s_mutex);
+            for(auto& entry : s_idle){
+                idle += entry.second.size();
+            }
+        }
+        arr.set(String("sockets_idle"), idle);
+        arr.set(String("sockets_created"), (int64_t)s_created.load(std::memory_order_relaxed));
+        arr.set(String("sockets_reused"), (int64_t)s_reused.load(std::memory_order_relaxed));
+        arr.set(String("sockets_evicted"), (int64_t)s_evicted.load(std::memory_order_relaxed));
+    }
+
+private:
+    typedef std::tuple<zmq::context_t*, int, std::string> Key;
+
+    static ZmqSocketData* take(const Key& key, const std::function<bool(ZmqSocketData*)>& accept){
+        std::vector<ZmqSocketData*> evicted;
+        ZmqSocketData* data = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(s_mutex);
+            evictIdle(evicted);
+            auto it = s_idle.find(key);
+            if(it != s_idle.end()){
+                std::vector<ZmqSocketData*>& list = it->second;
+                // prefer the socket this worker thread used last time
+                auto pick = list.end();
+                for(auto i = list.begin(); i != list.end(); ++i){
+                    if(!accept(*i)){
+                        continue;
+                    }
+                    pick = i;
+                    if((*i)->owner == std::this_thread::get_id()){
+                        break;
+                    }
+                }
+                if(pick != list.end()){
+                    data = *pick;
+                    list.erase(pick);
+                }
+            }
+        }
+        closeAll(evicted);
+        return data;
+    }
+
+    // must hold s_mutex; sockets are closed by the caller outside the lock
+    static void evictIdle(std::vector<ZmqSocketData*>& evicted){
+        auto deadline = std::chrono::steady_clock::now() - kIdleTimeout;
+        for(auto it = s_idle.begin(); it != s_idle.end(); ){
+            std::vector<ZmqSocketData*>& list = it->second;
+            for(auto i = list.begin(); i != list.end(); ){
+                if((*i)->last_used < deadline){
+                    evicted.push_back(*i);
+                    i = list.erase(i);
+                }else{
+                    ++i;
+                }
+            }
+            if(list.empty()){
+                it = s_idle.erase(it);
+            }else{
+                ++it;
+            }
+        }
+    }
+
+    static void closeAll(std::vector<ZmqSocketData*>& evicted){
+        for(auto data : evicted){
+            delete data;
+        }
+        s_evicted.fetch_add(evicted.size(), std::memory_order_relaxed);
+    }
+
+    static const std::chrono::seconds kIdleTimeout;
+    static std::mutex s_mutex;
+    static std::map<Key, std::vector<ZmqSocketData*>> s_idle;
+    static std::atomic<uint64_t> s_created;
+    static std::atomic<uint64_t> s_reused;
+    static std::atomic<uint64_t> s_evicted;
+};
+
+const std::chrono::seconds PersistentSocketPool::kIdleTimeout(300);
+std::mutex PersistentSocketPool::s_mutex;
+std::map<PersistentSocketPool::Key, std::vector<ZmqSocketData*>> PersistentSocketPool::s_idle;
+std::atomic<uint64_t> PersistentSocketPool::s_created(0);
+std::atomic<uint64_t> PersistentSocketPool::s_reused(0);
+std::atomic<uint64_t> PersistentSocketPool::s_evicted(0);
+
+static void zmq_async_cancel(ZmqSocketData* data);
+static bool zmq_coalescer_flush(ZmqSocketData* data, int flags);
+
+// how long closing a socket waits for libzmq to send the zero-copy payloads
+// still queued, at most, whatever the linger period
+static const int64_t kZeroCopyDrainTimeout = 100;
+
+// A native thread holding the lease, or a recvAsync/sendAsync until it
+// completes, owns the socket; the request's own calls on it fail meanwhile
+// rather than race that thread.
+static inline bool zmq_socket_busy(ZmqSocketData* data)
+{
+    return data->lease != nullptr || data->async_pending.load(std::memory_order_acquire);
+}
+
+// Shared memory handles name objects on this host, so sockets that send or
+// accept them are kept to endpoints whose peers are on it too.
+static bool zmq_local_endpoint(const std::string& dsn)
+{
+    return dsn.compare(0, 6, "ipc://") == 0 || dsn.compare(0, 9, "inproc://") == 0;
+}
+
+static bool zmq_shm_enabled(ZmqSocketData* data)
+{
+    return data->shm_threshold >= 0 || (data->decode & kZmqDecodeShared);
+}
+
+static bool zmq_local_endpoints(ZmqSocketData* data)
+{
+    for(auto& dsn : data->connected){
+        if(!zmq_local_endpoint(dsn)){
+            return false;
+        }
+    }
+    for(auto& dsn : data->bound){
+        if(!zmq_local_endpoint(dsn)){
+            return false;
+        }
+    }
+    return true;
+}
+
+// Subscribes a SUB socket through its topic trie; false if the prefix was
+// subscribed already. libzmq counts duplicate subscriptions, the trie does
+// not.
+static bool zmq_subscribe(ZmqSocketData* data, const std::string& topic)
+{
+    if(data->topics == nullptr){
+        data->topics = new ZmqTopicTrie();
+    }
+    if(!data->topics->insert(topic)){
+        return false;
+    }
+    try{
+        data->sock->setsockopt(ZMQ_SUBSCRIBE, topic.data(), topic.size());
+    }catch(std::exception& e){
+        data->topics->erase(topic);
+        throw;
+    }
+    return true;
+}
+
+class ZmqSocketResource : public SweepableResourceData {
+public:
+    DECLARE_RESOURCE_ALLOCATION(ZmqSocketResource)
+    CLASSNAME_IS("zmq_socket")
+    virtual const String& o_getClassNameHook() const { return classnameof(); }
+
+    explicit ZmqSocketResource(ZmqContextResource* context, int type, const String& persistent_id){
+        reused = false;
+        dirty = false;
+        pooled = context->isPersistent() && !persistent_id.empty();
+        if(pooled){
+            data = PersistentSocketPool::acquire(context->getContext(), type, persistent_id.toCppString(), reused);
+        }else{
+            data = new ZmqSocketData(context->getContext(), type, std::string());
+        }
+        settled = !reused;
+        // a pooled socket keeps the I/O thread it was given
+        uint64_t affinity = reused ? 0 : context->nextAffinity();
+        if(affinity){
+            data->sock->setsockopt(ZMQ_AFFINITY, &affinity, sizeof(uint64_t));
+        }
+    }
+    virtual ~ZmqSocketResource() { 
+        close(false); 
+    }
+    void close(bool sweeping) {
+        if(data == nullptr){
+            return;
+        }
+        if(data->async_pending.load(std::memory_order_acquire)){
+            zmq_async_cancel(data);
+            if(data->async_recv){
+                // nobody took the message, the awaitable now yields false
+                data->async_recv->data = nullptr;
+                data->async_recv.reset();
+            }
+            data->async_pending.store(false, std::memory_order_release);
+        }
+        // without a writer thread nobody would flush the batch later
+        if(data->coalescer && !data->lease){
+            try{
+                zmq_coalescer_flush(data, ZMQ_DONTWAIT);
+            }catch(std::exception& e){
+            }
+        }
+        // a send queue keeps draining while a persistent socket is pooled
+        if(data->lease && !(pooled && data->lease->outlivesRequest())){
+            data->lease->revoke();
+        }
+        // zero-copy sends reference request memory, so libzmq has to be done
+        // with them before the strings go away. Only plain sockets lend
+        // strings, and they are closed here anyway: what is not sent after a
+        // short wait is dropped.
+        bool drained = true;
+        if(!data->zero_copy->idle()){
+            int linger = -1;
+            size_t size = sizeof(int);
+            zmq_getsockopt(*data->sock, ZMQ_LINGER, &linger, &size);
+            int64_t timeout = linger >= 0 ? std::min<int64_t>(linger, kZeroCopyDrainTimeout)
+                                          : kZeroCopyDrainTimeout;
+            drained = data->zero_copy->wait(timeout);
+        }
+        if(!drained){
+            if(data->lease){
+                data->lease->revoke();
+            }
+            int linger = 0;
+            zmq_setsockopt(*data->sock, ZMQ_LINGER, &linger, sizeof(int));
+            data->sock->close();
+            // letting go of the dropped payloads is up to the I/O thread
+            // alone, not the peer, and the strings must outlive it
+            data->zero_copy->wait(-1);
+        }
+        data->zero_copy->collect(!sweeping);
+
+        // persistent sockets go back to the pool with their connections open
+        bool reusable = pooled && drained;
+        if(reusable && (!saved.empty() || dirty || data->topics)){
+            // a send queue that outlives the request would still own it
+            if(data->lease){
+                data->lease->revoke();
+            }
+            reusable = restore();
+        }
+        if(reusable){
+            PersistentSocketPool::release(data);
+        }else{
+            delete data;
+        }
+        data = nullptr;
+    }
+
+    // The socket for sending, receiving or handing to another resource.
+    // The first such use ends the setup of a reused socket.
+    ZmqSocketData* getData() {
+        settle();
+        return data;
+    }
+    // The socket for connect, bind, options and subscriptions.
+    ZmqSocketData* getDataForSetup() { return data; }
+    bool isReused() { return reused; }
+
+    // A reused socket comes with the endpoints of earlier checkouts. The
+    // request only gets the ones it asks for again: connecting to an
+    // endpoint the socket already has costs nothing, and for one it does
+    // not have an idle socket of the same persistent_id that has all of
+    // them is taken instead, if there is one. When setup ends, endpoints
+    // nobody asked for are dropped so that no message reaches another
+    // caller's peers; a request that asks for none keeps them all, as when
+    // the socket was set up by the on_new_socket callback. Returns true if
+    // the socket already has the endpoint.
+    bool adopt(bool bind, const std::string& dsn){
+        if(settled){
+            return false;
+        }
+        (bind ? want_bind : want_connect).insert(dsn);
+        if(!has(bind, dsn)){
+            exchange();
+        }
+        return has(bind, dsn);
+    }
+
+    void forget(bool bind, const std::string& dsn){
+        (bind ? want_bind : want_connect).erase(dsn);
+    }
+
+    // Sets an option. A reused socket keeps the options of the request that
+    // created it; what later requests change is put back when the socket
+    // returns to the pool, and one whose write-only options were changed is
+    // closed instead.
+    void setOption(int key, const std::string& value, bool readable){
+        if(reused){
+            if(!readable){
+                dirty = true;
+            }else if(saved.find(key) == saved.end()){
+                char buffer[256];
+                size_t size = sizeof(buffer);
+                data->sock->getsockopt(key, buffer, &size);
+                saved[key] = std::string(buffer, size);
+            }
+        }
+        data->sock->setsockopt(key, value.data(), value.size());
+        if(!settled){
+            applied.push_back(Option{key, value, readable});
+        }
+    }
+
+private:
+    struct Option {
+        int key;
+        std::string value;
+        bool readable;
+    };
+
+    bool has(bool bind, const std::string& dsn){
+        const std::set<std::string>& endpoints = bind ? data->bound : data->connected;
+        return endpoints.find(dsn) != endpoints.end();
+    }
+
+    // Trades the socket for an idle one with every endpoint asked for so
+    // far, bringing along the options and subscriptions made since checkout.
+    void exchange(){
+        if(data->lease){
+            return;
+        }
+        ZmqSocketData* other = PersistentSocketPool::acquireConnected(
+            data->ctx, data->type, data->persistent_id, want_connect, want_bind);
+        if(other == nullptr){
+            return;
+        }
+        std::vector<Option> options;
+        options.swap(applied);
+        std::vector<std::string> topics;
+        if(data->topics){
+            topics = data->topics->list();
+        }
+        if(restore()){
+            PersistentSocketPool::release(data);
+        }else{
+            delete data;
+        }
+        data = other;
+        dirty = false;
+        for(auto& opt : options){
+            setOption(opt.key, opt.value, opt.readable);
+        }
+        for(auto& topic : topics){
+            zmq_subscribe(data, topic);
+        }
+    }
+
+    void settle(){
+        if(settled){
+            return;
+        }
+        settled = true;
+        applied.clear();
+        if(want_connect.empty() && want_bind.empty()){
+            return;
+        }
+        std::vector<std::string> stale_connect, stale_bind;
+        std::set_difference(data->connected.begin(), data->connected.end(),
+                            want_connect.begin(), want_connect.end(), std::back_inserter(stale_connect));
+        std::set_difference(data->bound.begin(), data->bound.end(),
+                            want_bind.begin(), want_bind.end(), std::back_inserter(stale_bind));
+        if(stale_connect.empty() && stale_bind.empty()){
+            return;
+        }
+        if(data->lease){
+            data->lease->revoke();
+        }
+        for(auto& dsn : stale_connect){
+            try{
+                data->sock->disconnect(dsn.c_str());
+            }catch(std::exception& e){
+            }
+            data->connected.erase(dsn);
+        }
+        for(auto& dsn : stale_bind){
+            try{
+                data->sock->unbind(dsn.c_str());
+            }catch(std::exception& e){
+            }
+            data->bound.erase(dsn);
+        }
+    }
+
+    // Undoes the options the request changed and drops its subscriptions,
+    // whose handlers die with the request. False if the socket cannot be
+    // pooled again.
+    bool restore(){
+        try{
+            for(auto& opt : saved){
+                data->sock->setsockopt(opt.first, opt.second.data(), opt.second.size());
+            }
+            saved.clear();
+            if(data->topics){
+                for(auto& topic : data->topics->list()){
+                    data->sock->setsockopt(ZMQ_UNSUBSCRIBE, topic.data(), topic.size());
+                }
+                delete data->topics;
+                data->topics = nullptr;
+            }
+        }catch(std::exception& e){
+            return false;
+        }
+        return !dirty;
+    }
+
+    ZmqSocketData* data;
+    bool pooled;
+    bool reused;
+    // setup of a reused socket is still going on
+    bool settled;
+    // a write-only option was changed on a reused socket
+    bool dirty;
+    std::set<std::string> want_connect;
+    std::set<std::string> want_bind;
+    // values from before the request changed them
+    std::map<int, std::string> saved;
+    // options set during setup, for exchange()
+    std::vector<Option> applied;
+};
+
+void ZmqSocketResource::sweep() {
+    close(true);
+}
+
+// The poll set is kept as a contiguous zmq_pollitem_t array that is handed
+// to zmq_poll as is. Every socket gets a small stable slot number; slots map
+// to array positions and removal swaps the last item into the hole, so
+// add/remove are O(1) and polling allocates nothing.
+class ZmqPollResource : public SweepableResourceData {
+public:
+    DECLARE_RESOURCE_ALLOCATION(ZmqPollResource)
+    CLASSNAME_IS("zmq_poll")
+    virtual const String& o_getClassNameHook() const { return classnameof(); }
+
+    // returns the slot of the socket, adding it if needed
+    int addPollItem(ZmqSocketData* data, int type){
+        void* handle = *data->sock;
+        auto it = index.find(handle);
+        if(it != index.end()){
+            items[positions[it->second]].events = type;
+            return it->second;
+        }
+
+        int slot;
+        if(free_slots.empty()){
+            slot = positions.size();
+            positions.push_back(0);
+        }else{
+            slot = free_slots.back();
+            free_slots.pop_back();
+        }
+
+        zmq_pollitem_t item;
+        memset(&item, 0, sizeof(item));
+        item.socket = handle;
+        item.events = type;
+        positions[slot] = items.size();
+        items.push_back(item);
+        owners.push_back(data);
+        slots.push_back(slot);
+        index[handle] = slot;
+        return slot;
+    }
+
+    // returns the slot the socket had, -1 if it was not in the set
+    int removePollItem(zmq::socket_t* sock){
+        auto it = index.find((void*)*sock);
+        if(it == index.end()){
+            return -1;
+        }
+        int slot = it->second;
+        size_t pos = positions[slot];
+        size_t last = items.size() - 1;
+        if(pos != last){
+            items[pos] = items[last];
+            owners[pos] = owners[last];
+            slots[pos] = slots[last];
+            positions[slots[pos]] = pos;
+        }
+        items.pop_back();
+        owners.pop_back();
+        slots.pop_back();
+        index.erase(it);
+        free_slots.push_back(slot);
+        return slot;
+    }
+
+    void clear(){
+        items.clear();
+        owners.clear();
+        slots.clear();
+        positions.clear();
+        free_slots.clear();
+        index.clear();
+    }
+
+    zmq_pollitem_t* getItems() { return items.data(); }
+    ZmqSocketData* getOwner(size_t pos) { return owners[pos]; }
+    size_t size() { return items.size(); }
+    int getSlot(size_t pos) { return slots[pos]; }
+
+private:
+    std::vector<zmq_pollitem_t> items;
+    std::vector<ZmqSocketData*> owners;  // array position -> socket
+    std::vector<int> slots;         // array position -> slot
+    std::vector<size_t> positions;  // slot -> array position
+    std::vector<int> free_slots;
+    std::unordered_map<void*, int> index;
+};
+
+void ZmqPollResource::sweep() {
+    clear();
+}
+
+// Reads the options array of ZMQContext; false on unknown keys or values
+static bool zmq_context_options(const Array& arr, ZmqContextOptions& options)
+{
+    for(ArrayIter iter(arr); iter; ++iter){
+        String key = iter.first().toString();
+        Variant value = iter.second();
+        if(key == "cpus"){
+            if(!value.isArray()){
+                return false;
+            }
+            for(ArrayIter cpu(value.toArray()); cpu; ++cpu){
+                if(!cpu.second().isInteger() || cpu.second().toInt64() < 0){
+                    return false;
+                }
+                options.cpus.push_back(cpu.second().toInt32());
+            }
+            std::sort(options.cpus.begin(), options.cpus.end());
+            options.cpus.erase(std::unique(options.cpus.begin(), options.cpus.end()), options.cpus.end());
+        }else if(key == "sched_policy"){
+            options.sched_policy = value.toInt32();
+        }else if(key == "thread_priority"){
+            options.priority = value.toInt32();
+        }else if(key == "auto_affinity"){
+            options.auto_affinity = value.toBoolean();
+        }else{
+            return false;
+        }
+    }
+    return true;
+}
+
+Variant php_zmq_context_create(int64_t io_threads, bool is_persistent, int64_t max_sockets, const Array& options)
+{
+    try{
+        ZmqContextOptions opts;
+        opts.io_threads = io_threads;
+        opts.max_sockets = max_sockets;
+        if(!zmq_context_options(options, opts)){
+            return false;
+        }
+        ZmqContextEntry* entry = is_persistent ? PersistentContextRegistry::acquire(opts)
+                                               : ZmqContextEntry::create(opts);
+        if(entry == nullptr){
+            return false;
+        }
+        return NEWOBJ(ZmqContextResource)(entry, is_persistent);
+    }catch(std::exception& e){
+        return false;
+    }
+}
+
+Array php_zmq_persistent_stats()
+{
+    Array stats = Array::Create();
+    PersistentContextRegistry::stats(stats);
+    PersistentSocketPool::stats(stats);
+    return stats;
+}
+
+int64_t php_zmq_context_get_opt(const Resource& context, int64_t option)
+{
+    auto ctx = context.getTyped<ZmqContextResource>()->getContext();
+    return ctx->get_opt(option);
+}
+
+int64_t php_zmq_context_set_opt(const Resource& context, int64_t option, int64_t value)
+{ 
+   try{
+       return context.getTyped<ZmqContextResource>()->setOpt(option, value);
+   }catch(std::exception& e){
+       return -1;
+   }
+}
+
+int64_t php_zmq_socket_connect(const Resource& socket, const String& dsn)
+{
+   try{
+        auto res = socket.getTyped<ZmqSocketResource>();
+        auto setup = res->getDataForSetup();
+        if(zmq_socket_busy(setup) ||
+           (zmq_shm_enabled(setup) && !zmq_local_endpoint(dsn.toCppString()))){
+            return -1;
+        }
+        if(res->adopt(false, dsn.toCppString())){
+            return 0;
+        }
+        auto data = res->getDataForSetup();
+        data->sock->connect(dsn.c_str());
+        data->connected.insert(dsn.toCppString());
+        return 0;
+   }catch(std::exception& e){
+       return -1;
+   }
+}
+
+Variant php_zmq_socket_create(const Resource& context, int64_t type, const String& persistent_id)
+{
+    auto ctx = context.getTyped<ZmqContextResource>();
+    try{
+        return NEWOBJ(ZmqSocketResource)(ctx, type, persistent_id);
+    }catch(std::exception& e){
+       return false;
+    }
+}
+
+bool php_zmq_socket_is_reused(const Resource& socket)
+{
+    return socket.getTyped<ZmqSocketResource>()->isReused();
+}
+
+Array php_zmq_socket_get_endpoints(const Resource& socket)
+{
+    auto data = socket.getTyped<ZmqSocketResource>()->getDataForSetup();
+    Array connected = Array::Create();
+    Array bound = Array::Create();
+    for(auto& dsn : data->connected){
+        connected.set(String(dsn), 1);
+    }
+    for(auto& dsn : data->bound){
+        bound.set(String(dsn), 1);
+    }
+    Array endpoints = Array::Create();
+    endpoints.set(String("connect"), connected);
+    endpoints.set(String("bind"), bound);
+    return endpoints;
+}
+
+int64_t php_zmq_socket_disconnect(const Resource& socket, const String& dsn)
+{
+   try{
+        auto res = socket.getTyped<ZmqSocketResource>();
+        auto data = res->getDataForSetup();
+       if(zmq_socket_busy(data)){
+           return -1;
+       }
+       data->sock->disconnect(dsn.c_str());
+       data->connected.erase(dsn.toCppString());
+       res->forget(false, dsn.toCppString());
+       return 0;
+   }catch(std::exception& e){
+       return -1;
+   }
+}
+
+int64_t php_zmq_socket_bind(const Resource& socket, const String& dsn)
+{
+   try{
+    auto res = socket.getTyped<ZmqSocketResource>();
+       auto setup = res->getDataForSetup();
+       if(zmq_socket_busy(setup) ||
+          (zmq_shm_enabled(setup) && !zmq_local_endpoint(dsn.toCppString()))){
+           return -1;
+       }
+       if(res->adopt(true, dsn.toCppString())){
+           return 0;
+       }
+       auto data = res->getDataForSetup();
+       data->sock->bind(dsn.c_str());
+       data->bound.insert(dsn.toCppString());
+       return 0;
+   }catch(std::exception& e){
+       return -1;
+   }
+}
+
+int64_t php_zmq_socket_unbind(const Resource& socket, const String& dsn)
+{
+   try{
+    auto res = socket.getTyped<ZmqSocketResource>();
+    auto data = res->getDataForSetup();
+       if(zmq_socket_busy(data)){
+           return -1;
+       }
+       data->sock->unbind(dsn.c_str());
+       data->bound.erase(dsn.toCppString());
+       res->forget(true, dsn.toCppString());
+       return 0;
+   }catch(std::exception& e){
+       return -1;
+   }
+}
+
+// below this size copying the payload is cheaper than lending the string
+static const int64_t kZeroCopyMinSize = 16 * 1024;
+
+// Sends one message and accounts for it in the socket and thread stats;
+// throws zmq::error_t, returns false on EAGAIN.
+static bool zmq_send_message(ZmqSocketData* data, zmq::message_t& msg, int flags)
+{
+    size_t size = msg.size();
+    uint64_t start = zmq_now_us();
+    bool rc;
+    try{
+        rc = data->sock->send(msg, flags);
+    }catch(std::exception& e){
+        data->stats.failed();
+        ZmqThreadStats::local().failed();
+        throw;
+    }
+    if(rc){
+        data->send_more = (flags & ZMQ_SNDMORE) != 0;
+        uint64_t wait = zmq_now_us() - start;
+        data->stats.sent(size, wait);
+        ZmqThreadStats::local().sent(size, wait);
+    }else{
+        data->stats.wouldBlock(flags);
+        ZmqThreadStats::local().wouldBlock(flags);
+    }
+    return rc;
+}
+
+// Receive counterpart of zmq_send_message().
+static bool zmq_recv_message(ZmqSocketData* data, zmq::message_t* msg, int flags)
+{
+    uint64_t start = zmq_now_us();
+    bool rc;
+    try{
+        rc = data->sock->recv(msg, flags);
+    }catch(std::exception& e){
+        data->stats.failed();
+        ZmqThreadStats::local().failed();
+        throw;
+    }
+    if(rc){
+        uint64_t wait = zmq_now_us() - start;
+        data->stats.received(msg->size(), wait);
+        ZmqThreadStats::local().received(msg->size(), wait);
+    }else{
+        data->stats.wouldBlock(flags);
+        ZmqThreadStats::local().wouldBlock(flags);
+    }
+    return rc;
+}
+
+#ifdef ZMQ_HAVE_LZ4
+// LZ4 state and output buffer of the calling thread, reused for every frame
+struct ZmqCompressScratch {
+    ZmqCompressScratch() : state(LZ4_sizeofState()) {}
+    std::vector<char> state;
+    std::vector<char> out;
+};
+#endif
+
+// Compresses a payload into out: the envelope, the original size as a
+// varint, then the LZ4 block. False if the socket does not compress, the
+// payload is under the threshold or it does not shrink; it is then sent as
+// is, which the receiver tells apart by the missing envelope.
+static bool zmq_compress(ZmqSocketData* data, const void* src, size_t size, zmq::message_t& out)
+{
+#ifdef ZMQ_HAVE_LZ4
+    if(data->compress_threshold < 0 || size < (size_t)data->compress_threshold || size > LZ4_MAX_INPUT_SIZE){
+        return false;
+    }
+    static thread_local ZmqCompressScratch scratch;
+    int bound = LZ4_compressBound(size);
+    if(scratch.out.size() < (size_t)bound){
+        scratch.out.resize(bound);
+    }
+    int compressed = LZ4_compress_fast_extState(scratch.state.data(), static_cast<const char*>(src),
+                                                scratch.out.data(), size, bound,
+                                                data->compress_acceleration);
+    std::string header;
+    zmq_envelope_put(header, kZmqEnvelopeCompressed);
+    zmq_varint_put(header, size);
+    if(compressed <= 0 || header.size() + compressed >= size){
+        return false;
+    }
+    out.rebuild(header.size() + compressed);
+    memcpy(out.data(), header.data(), header.size());
+    memcpy(static_cast<char*>(out.data()) + header.size(), scratch.out.data(), compressed);
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+// Inverse of zmq_compress(), straight into the PHP string. False if the
+// frame is not a valid compressed frame.
+static bool zmq_decompress(const zmq::message_t& msg, String& out)
+{
+#ifdef ZMQ_HAVE_LZ4
+    if(zmq_envelope_tag(msg.data(), msg.size()) != kZmqEnvelopeCompressed){
+        return false;
+    }
+    const unsigned char* p = static_cast<const unsigned char*>(msg.data()) + kZmqEnvelopeSize;
+    const unsigned char* end = static_cast<const unsigned char*>(msg.data()) + msg.size();
+    uint64_t size;
+    if(!zmq_varint_get(p, end, size)){
+        return false;
+    }
+    // LZ4 expands at most 255 times, anything more is not our frame
+    size_t compressed = end - p;
+    if(size > LZ4_MAX_INPUT_SIZE || size > compressed * 255 + 16){
+        return false;
+    }
+    String str(size, ReserveString);
+    int rc = LZ4_decompress_safe(reinterpret_cast<const char*>(p), str.bufferSlice().ptr, compressed, size);
+    if(rc < 0 || (uint64_t)rc != size){
+        return false;
+    }
+    str.setSize(size);
+    out = str;
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Large payloads for peers on the same host can skip the socket: they are
+// written to a POSIX shared memory object and only a handle frame travels,
+// made of the envelope, the payload size as a varint and the object name.
+// The receiver copies the payload out of the object; the last of the
+// readers counted in the object's header unlinks it. Objects nobody claimed
+// within the TTL, because the message was dropped or the peer went away,
+// are unlinked by the sending process.
+static const char kZmqShmPrefix[] = "/hhvm-zmq-";
+static const uint32_t kZmqShmMagic = 0x5a4d5348;
+
+struct ZmqShmHeader {
+    uint32_t magic;
+    std::atomic<uint32_t> refs;
+    uint64_t size;
+};
+
+class ZmqShmRegistry {
+public:
+    // Writes the payload to a new object and returns its name, empty if
+    // shared memory is not available.
+    static std::string write(const void* src, size_t size, int64_t ttl_ms){
+        reclaim(zmq_now_us());
+
+        char name[64];
+        snprintf(name, sizeof(name), "%s%d-%llu", kZmqShmPrefix, (int)getpid(),
+                 (unsigned long long)s_counter.fetch_add(1, std::memory_order_relaxed));
+        int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+        if(fd < 0){
+            return std::string();
+        }
+        size_t total = sizeof(ZmqShmHeader) + size;
+        void* map = ftruncate(fd, total) == 0
+            ? mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if(map == MAP_FAILED){
+            shm_unlink(name);
+            return std::string();
+        }
+        auto header = new (map) ZmqShmHeader();
+        header->magic = kZmqShmMagic;
+        header->refs.store(1, std::memory_order_relaxed);
+        header->size = size;
+        memcpy(static_cast<char*>(map) + sizeof(ZmqShmHeader), src, size);
+        munmap(map, total);
+
+        std::lock_guard<std::mutex> lock(s_mutex);
+        s_pending.push_back(std::make_pair(zmq_now_us() + ttl_ms * 1000, std::string(name)));
+        return name;
+    }
+
+    // Copies the payload of the object into out and releases the reader's
+    // reference. False if the object is gone or is not ours.
+    static bool read(const std::string& name, uint64_t size, String& out){
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if(fd < 0){
+            return false;
+        }
+        struct stat st;
+        size_t total = sizeof(ZmqShmHeader) + size;
+        void* map = fstat(fd, &st) == 0 && (uint64_t)st.st_size == total
+            ? mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if(map == MAP_FAILED){
+            return false;
+        }
+        auto header = static_cast<ZmqShmHeader*>(map);
+        if(header->magic != kZmqShmMagic || header->size != size){
+            munmap(map, total);
+            return false;
+        }
+        String str(size, ReserveString);
+        memcpy(str.bufferSlice().ptr, static_cast<char*>(map) + sizeof(ZmqShmHeader), size);
+        str.setSize(size);
+        if(header->refs.fetch_sub(1, std::memory_order_acq_rel) == 1){
+            shm_unlink(name.c_str());
+        }
+        munmap(map, total);
+        out = str;
+        return true;
+    }
+
+    // unlinks the objects whose TTL is over; claimed ones are gone already
+    static void reclaim(uint64_t now){
+        std::lock_guard<std::mutex> lock(s_mutex);
+        while(!s_pending.empty() && s_pending.front().first <= now){
+            shm_unlink(s_pending.front().second.c_str());
+            s_pending.pop_front();
+        }
+    }
+
+private:
+    static std::mutex s_mutex;
+    // unlink deadline and name, in the order the objects were created
+    static std::deque<std::pair<uint64_t, std::string>> s_pending;
+    static std::atomic<uint64_t> s_counter;
+};
+
+std::mutex ZmqShmRegistry::s_mutex;
+std::deque<std::pair<uint64_t, std::string>> ZmqShmRegistry::s_pending;
+std::atomic<uint64_t> ZmqShmRegistry::s_counter(0);
+
+// Puts the handle frame of an offloaded payload into out. False if the
+// socket does not offload, the payload is under the threshold or shared
+// memory failed; the payload is then sent in the frame.
+static bool zmq_offload(ZmqSocketData* data, const void* src, size_t size, zmq::message_t& out)
+{
+    if(data->shm_threshold < 0 || size < (size_t)data->shm_threshold){
+        return false;
+    }
+    std::string name = ZmqShmRegistry::write(src, size, data->shm_ttl);
+    if(name.empty()){
+        return false;
+    }
+    std::string handle;
+    zmq_envelope_put(handle, kZmqEnvelopeShared);
+    zmq_varint_put(handle, size);
+    handle.append(name);
+    out.rebuild(handle.size());
+    memcpy(out.data(), handle.data(), handle.size());
+    return true;
+}
+
+// Inverse of zmq_offload(). False if the frame is not a handle frame or the
+// payload cannot be read, e.g. because its TTL is over; the frame is then
+// delivered as it came.
+static bool zmq_fetch(const zmq::message_t& msg, String& out)
+{
+    if(zmq_envelope_tag(msg.data(), msg.size()) != kZmqEnvelopeShared){
+        return false;
+    }
+    const unsigned char* p = static_cast<const unsigned char*>(msg.data()) + kZmqEnvelopeSize;
+    const unsigned char* end = static_cast<const unsigned char*>(msg.data()) + msg.size();
+    uint64_t size;
+    if(!zmq_varint_get(p, end, size)){
+        return false;
+    }
+    // only objects made by the extension are opened
+    std::string name(reinterpret_cast<const char*>(p), end - p);
+    if(name.compare(0, sizeof(kZmqShmPrefix) - 1, kZmqShmPrefix) != 0 ||
+       name.find('/', 1) != std::string::npos || name.size() > 64){
+        return false;
+    }
+    return ZmqShmRegistry::read(name, size, out);
+}
+
+// Replaces the payload of a frame by its shared memory handle or its
+// compressed form, when the socket is set up for either.
+static void zmq_encode_frame(ZmqSocketData* data, zmq::message_t& msg)
+{
+    zmq::message_t encoded;
+    if(zmq_offload(data, msg.data(), msg.size(), encoded) ||
+       zmq_compress(data, msg.data(), msg.size(), encoded)){
+        msg.move(&encoded);
+    }
+}
+
+// Sends one frame; throws zmq::error_t, returns false on EAGAIN.
+static bool zmq_send_string(ZmqSocketData* data, const String& message, int flags)
+{
+    zmq::message_t encoded;
+    if(zmq_offload(data, message.data(), message.length(), encoded) ||
+       zmq_compress(data, message.data(), message.length(), encoded)){
+        return zmq_send_message(data, encoded, flags);
+    }
+
+    // large payloads are handed to libzmq without copying, the string is
+    // pinned until libzmq calls back; pooled sockets outlive the request
+    // memory, so they copy
+    if(message.length() >= kZeroCopyMinSize && data->persistent_id.empty()){
+        StringData* str = message.get();
+        auto node = data->zero_copy->lend(str);
+        zmq::message_t msg((void*)str->data(), str->size(), ZeroCopyTracker::freeFn, node);
+        return zmq_send_message(data, msg, flags);
+    }
+
+    zmq::message_t msg(message.length());
+    memcpy(msg.data(), message.c_str(), message.length());
+    return zmq_send_message(data, msg, flags);
+}
+
+// flush limit when a send queue is revoked and the socket lingers forever
+static const int64_t kSendQueueFlushTimeout = 1000;
+// how often a writer stuck at SNDHWM looks at the flush deadline
+static const int kSendQueuePollInterval = 100;
+
+// Fire-and-forget sending. While the queue is enabled send() copies the
+// message into a bounded MPSC queue and returns at once; a native writer
+// thread owns the socket and drains the queue, so a peer at SNDHWM no
+// longer blocks the request. The queue is Vyukov's bounded array queue:
+// producers claim cells with a CAS on the tail, the writer (and drop-oldest
+// producers making room) with a CAS on the head.
+//
+// The queue stays with a persistent socket across requests. Revoking it
+// flushes what is left for up to the socket's linger period and deletes it.
+class ZmqSendQueue : public ZmqSocketLease {
+public:
+    enum Overflow { DropNewest = 0, DropOldest = 1, Block = 2 };
+
+    struct Item {
+        ~Item(){
+            for(auto frame : frames){
+                delete frame;
+            }
+        }
+        std::vector<zmq::message_t*> frames;
+    };
+
+    ZmqSendQueue(ZmqSocketData* d, size_t capacity, Overflow o, int64_t send_timeout, int64_t linger)
+        : data(d), overflow(o), send_timeout(send_timeout), linger(linger) {
+        size_t size = 1;
+        while(size < capacity){
+            size <<= 1;
+        }
+        mask = size - 1;
+        cells = new Cell[size];
+        for(size_t i = 0; i < size; i++){
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    virtual ~ZmqSendQueue() {
+        Item* item;
+        while(tryPop(item)){
+            delete item;
+        }
+        delete[] cells;
+    }
+
+    void start(){
+        data->lease = this;
+        data->send_queue = this;
+        thread = std::thread(&ZmqSendQueue::run, this);
+    }
+
+    // Takes ownership of the item. False only if Block mode could not make
+    // room in time; dropped messages are counted, not reported.
+    bool push(Item* item, int flags){
+        while(!tryPush(item)){
+            if(overflow == DropNewest){
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                delete item;
+                return true;
+            }
+            if(overflow == DropOldest){
+                Item* oldest;
+                if(tryPop(oldest)){
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    delete oldest;
+                }
+                continue;
+            }
+            if((flags & ZMQ_DONTWAIT) || !waitForRoom()){
+                delete item;
+                return false;
+            }
+        }
+        enqueued.fetch_add(1, std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(writer_idle.load(std::memory_order_relaxed)){
+            std::lock_guard<std::mutex> lock(mutex);
+            wake_cond.notify_one();
+        }
+        return true;
+    }
+
+    Array stats() const {
+        uint64_t in = enqueued.load(std::memory_order_relaxed);
+        uint64_t out = sent.load(std::memory_order_relaxed);
+        uint64_t lost = failed.load(std::memory_order_relaxed);
+        Array arr = Array::Create();
+        arr.set(String("capacity"), (int64_t)(mask + 1));
+        arr.set(String("queued"), (int64_t)(tail.load(std::memory_order_relaxed) - head.load(std::memory_order_relaxed)));
+        arr.set(String("enqueued"), (int64_t)in);
+        arr.set(String("sent"), (int64_t)out);
+        arr.set(String("dropped"), (int64_t)dropped.load(std::memory_order_relaxed));
+        arr.set(String("failed"), (int64_t)lost);
+        arr.set(String("blocked"), (int64_t)blocked.load(std::memory_order_relaxed));
+        return arr;
+    }
+
+    virtual void revoke() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            flush_deadline = std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(linger >= 0 ? linger : kSendQueueFlushTimeout);
+            stopping.store(true, std::memory_order_release);
+            wake_cond.notify_one();
+        }
+        thread.join();
+        data->lease = nullptr;
+        data->send_queue = nullptr;
+        delete this;
+    }
+
+    virtual bool outlivesRequest() const { return true; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        Item* item;
+    };
+
+    bool tryPush(Item* item){
+        Cell* cell;
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while(true){
+            cell = &cells[pos & mask];
+            intptr_t dif = (intptr_t)cell->seq.load(std::memory_order_acquire) - (intptr_t)pos;
+            if(dif == 0){
+                if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                    break;
+                }
+            }else if(dif < 0){
+                return false;
+            }else{
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->item = item;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(Item*& item){
+        Cell* cell;
+        size_t pos = head.load(std::memory_order_relaxed);
+        while(true){
+            cell = &cells[pos & mask];
+            intptr_t dif = (intptr_t)cell->seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+            if(dif == 0){
+                if(head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                    break;
+                }
+            }else if(dif < 0){
+                return false;
+            }else{
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        item = cell->item;
+        cell->seq.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        size_t pos = head.load(std::memory_order_relaxed);
+        return cells[pos & mask].seq.load(std::memory_order_acquire) != pos + 1;
+    }
+
+    bool full() const {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        return cells[pos & mask].seq.load(std::memory_order_acquire) != pos;
+    }
+
+    // Block mode: waits for the writer to free a cell, up to SNDTIMEO
+    bool waitForRoom(){
+        blocked.fetch_add(1, std::memory_order_relaxed);
+        std::unique_lock<std::mutex> lock(mutex);
+        waiters.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto ready = [this]{ return !full() || stopping.load(std::memory_order_acquire); };
+        bool room = true;
+        if(send_timeout < 0){
+            room_cond.wait(lock, ready);
+        }else{
+            room = room_cond.wait_for(lock, std::chrono::milliseconds(send_timeout), ready);
+        }
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+        return room && !stopping.load(std::memory_order_acquire);
+    }
+
+    bool flushExpired() const {
+        return stopping.load(std::memory_order_acquire) &&
+               std::chrono::steady_clock::now() >= flush_deadline;
+    }
+
+    // sends the frames of one message; false if it had to be given up
+    bool deliver(zmq::message_t** frames, size_t count){
+        for(size_t i = 0; i < count; i++){
+            int flags = ZMQ_DONTWAIT | (i + 1 < count ? ZMQ_SNDMORE : 0);
+            // libzmq queues the frames atomically, only the first one can
+            // find the pipe full
+            while(!zmq_send_message(data, *frames[i], flags)){
+                if(flushExpired()){
+                    return false;
+                }
+                zmq_pollitem_t pollitem = { (void*)*data->sock, 0, ZMQ_POLLOUT, 0 };
+                zmq_poll(&pollitem, 1, kSendQueuePollInterval);
+            }
+        }
+        return true;
+    }
+
+    // delivers a frame that carries 'messages' queued messages
+    void send(zmq::message_t** frames, size_t count, uint64_t messages){
+        bool delivered = false;
+        if(!terminated && !flushExpired()){
+            try{
+                for(size_t i = 0; i < count; i++){
+                    zmq_encode_frame(data, *frames[i]);
+                }
+                delivered = deliver(frames, count);
+            }catch(zmq::error_t& e){
+                // the context is gone, nothing can be sent anymore
+                terminated = e.num() == ETERM;
+            }catch(std::exception& e){
+            }
+        }
+        if(delivered){
+            sent.fetch_add(messages, std::memory_order_relaxed);
+        }else if(flushExpired()){
+            dropped.fetch_add(messages, std::memory_order_relaxed);
+        }else{
+            failed.fetch_add(messages, std::memory_order_relaxed);
+        }
+    }
+
+    void flushBatch(){
+        ZmqCoalescer* coalescer = data->coalescer;
+        if(coalescer == nullptr || coalescer->pending() == 0){
+            return;
+        }
+        zmq::message_t msg;
+        coalescer->build(msg);
+        zmq::message_t* frame = &msg;
+        send(&frame, 1, coalescer->pending());
+        coalescer->clear();
+    }
+
+    void run(){
+        Item* item;
+        while(true){
+            ZmqCoalescer* coalescer = data->coalescer;
+            if(tryPop(item)){
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if(waiters.load(std::memory_order_relaxed) > 0){
+                    std::lock_guard<std::mutex> lock(mutex);
+                    room_cond.notify_all();
+                }
+
+                if(coalescer && item->frames.size() == 1 && coalescer->fits(item->frames[0]->size())){
+                    zmq::message_t* frame = item->frames[0];
+                    if(coalescer->overflows(frame->size())){
+                        flushBatch();
+                    }
+                    coalescer->add(frame->data(), frame->size(), zmq_now_us());
+                    if(coalescer->due(zmq_now_us())){
+                        flushBatch();
+                    }
+                }else{
+                    // what is buffered goes first to keep the order
+                    flushBatch();
+                    send(item->frames.data(), item->frames.size(), 1);
+                }
+                delete item;
+                continue;
+            }
+
+            // the queue is empty: a batch goes out once its interval is up
+            bool batched = coalescer && coalescer->pending() > 0;
+            if(batched && (stopping.load(std::memory_order_acquire) || coalescer->due(zmq_now_us()))){
+                flushBatch();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            if(stopping.load(std::memory_order_acquire)){
+                if(batched){
+                    continue;
+                }
+                break;
+            }
+            writer_idle.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto ready = [this]{
+                return !empty() || stopping.load(std::memory_order_acquire);
+            };
+            if(batched){
+                uint64_t now = zmq_now_us();
+                uint64_t left = coalescer->deadline() > now ? coalescer->deadline() - now : 0;
+                wake_cond.wait_for(lock, std::chrono::microseconds(left), ready);
+            }else{
+                wake_cond.wait(lock, ready);
+            }
+            writer_idle.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    ZmqSocketData* data;
+    Overflow overflow;
+    int64_t send_timeout;
+    int64_t linger;
+
+    Cell* cells;
+    size_t mask;
+    // producers and the writer touch different ends
+    char pad0[64];
+    std::atomic<size_t> tail{0};
+    char pad1[64];
+    std::atomic<size_t> head{0};
+    char pad2[64];
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake_cond;
+    std::condition_variable room_cond;
+    std::atomic<bool> writer_idle{false};
+    std::atomic<int> waiters{0};
+    std::atomic<bool> stopping{false};
+    std::chrono::steady_clock::time_point flush_deadline;
+    // writer thread only
+    bool terminated = false;
+
+    std::atomic<uint64_t> enqueued{0};
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> failed{0};
+    std::atomic<uint64_t> blocked{0};
+};
+
+static bool zmq_coalescer_flush(ZmqSocketData* data, int flags)
+{
+    ZmqCoalescer* coalescer = data->coalescer;
+    if(coalescer == nullptr || coalescer->pending() == 0){
+        return true;
+    }
+    zmq::message_t msg;
+    coalescer->build(msg);
+    zmq_encode_frame(data, msg);
+    // a batch is a message of its own, never the head of the caller's
+    if(!zmq_send_message(data, msg, flags & ~ZMQ_SNDMORE)){
+        return false;
+    }
+    coalescer->clear();
+    return true;
+}
+
+// Frames of a multipart message are sent as they are: a batch is a single
+// frame and would split the message. The batch is flushed before the first
+// frame, so it stays empty until the last one is out.
+static bool zmq_coalescable(ZmqSocketData* data, size_t size, int flags)
+{
+    return data->coalescer && !(flags & ZMQ_SNDMORE) && !data->send_more &&
+           data->coalescer->fits(size);
+}
+
+// Request thread side of coalescing: the batch is flushed when it is full,
+// or by the first send, poll or close after the interval is up. The message
+// must be zmq_coalescable().
+static bool zmq_coalesce(ZmqSocketData* data, const void* payload, size_t size, int flags)
+{
+    ZmqCoalescer* coalescer = data->coalescer;
+    if(coalescer->overflows(size) && !zmq_coalescer_flush(data, flags)){
+        return false;
+    }
+    uint64_t now = zmq_now_us();
+    coalescer->add(payload, size, now);
+    if(coalescer->due(now)){
+        // on EAGAIN the batch stays buffered for the next attempt
+        zmq_coalescer_flush(data, flags);
+    }
+    return true;
+}
+
+static bool zmq_send_coalesced(ZmqSocketData* data, const String& message, int flags)
+{
+    if(!zmq_coalescable(data, message.length(), flags)){
+        // what is buffered goes first to keep the order
+        return zmq_coalescer_flush(data, flags) && zmq_send_string(data, message, flags);
+    }
+    return zmq_coalesce(data, message.data(), message.length(), flags);
+}
+
+// copies one frame for the writer thread
+static zmq::message_t* zmq_queue_frame(const String& message)
+{
+    zmq::message_t* msg = new zmq::message_t(message.length());
+    memcpy(msg->data(), message.data(), message.length());
+    return msg;
+}
+
+int64_t php_zmq_socket_send(const Resource& socket, const String& message, int64_t flags)
+{
+   try{
+        auto data = socket.getTyped<ZmqSocketResource>()->getData();
+        if(data->send_queue){
+            auto item = new ZmqSendQueue::Item();
+            item->frames.push_back(zmq_queue_frame(message));
+            return data->send_queue->push(item, flags) ? 0 : -1;
+        }
+        if(zmq_socket_busy(data)){
+            return -1;
+        }
+        data->zero_copy->collect(true);
+        bool rc = data->coalescer ? zmq_send_coalesced(data, message, flags)
+                                  : zmq_send_string(data, message, flags);
+        return rc ? 0 : -1;
+   }catch(std::exception& e){
+       return -1;
+   }
+}
+
+int64_t php_zmq_socket_send_multi(const Resource& socket, const Array& message, int64_t flags)
+{
+   try{
+        auto data = socket.getTyped<ZmqSocketResource>()->getData();
+        data->zero_copy->collect(true);
+        ssize_t remaining = message.size();
+        if(remaining == 0){
+            return -1;
+        }
+        if(data->send_queue){
+            auto item = new ZmqSendQueue::Item();
+            for(ArrayIter it(message); it; ++it){
+                item->frames.push_back(zmq_queue_frame(it.second().toString()));
+            }
+            return data->send_queue->push(item, flags) ? 0 : -1;
+        }
+        if(zmq_socket_busy(data) || !zmq_coalescer_flush(data, flags)){
+            return -1;
+        }
+        // libzmq delivers the frames atomically, so only the first one can
+        // fail with EAGAIN
+        for(ArrayIter it(message); it; ++it){
+            int frame_flags = --remaining > 0 ? (flags | ZMQ_SNDMORE) : flags;
+            if(!zmq_send_string(data, it.second().toString(), frame_flags)){
+                return -1;
+            }
+        }
+        return 0;
+   }catch(std::exception& e){
+       return -1;
+   }
+}
+
+// Builds the result string straight from the message buffer: one copy into
+// a string of exactly msg.size() bytes, whatever the size of the frame.
+static String zmq_message_to_string(zmq::message_t& msg)
+{
+    size_t size = msg.size();
+    String str(size, ReserveString);
+    memcpy(str.bufferSlice().ptr, msg.data(), size);
+    str.setSize(size);
+    return str;
+}
+
+// The string for PHP of a received frame. If the socket decodes them,
+// offloaded payloads are read from shared memory, compressed frames are
+// inflated and a batch, which is always a whole message, is split with the
+// rest of it buffered on the socket.
+static String zmq_unwrap_message(ZmqSocketData* data, zmq::message_t& msg)
+{
+    bool whole = !msg.more() && !data->recv_more && (data->decode & kZmqDecodeBatch);
+    data->recv_more = msg.more();
+
+    String str;
+    if(((data->decode & kZmqDecodeShared) && zmq_fetch(msg, str)) ||
+       ((data->decode & kZmqDecodeCompressed) && zmq_decompress(msg, str))){
+        if(whole && zmq_envelope_tag(str.data(), str.size()) == kZmqEnvelopeBatch){
+            zmq::message_t batch(str.size());
+            memcpy(batch.data(), str.data(), str.size());
+            if(data->unbatcher.take(batch)){
+                return data->unbatcher.next();
+            }
+        }
+        return str;
+    }
+    if(whole && data->unbatcher.take(msg)){
+        return data->unbatcher.next();
+    }
+    return zmq_message_to_string(msg);
+}
+
+int64_t php_zmq_socket_recv(const Resource& socket, VRefParam message, int64_t flags)
+{
+   try{
+        zmq::message_t msg;
+        auto data = socket.getTyped<ZmqSocketResource>()->getData();
+        if(zmq_socket_busy(data)){
+            return -1;
+        }
+        if(data->unbatcher.pending()){
+            message = data->unbatcher.next();
+            return 0;
+        }
+        bool rc = zmq_recv_message(data, &msg, flags);
+        if(rc){
+            message = zmq_unwrap_message(data, msg);
+        }
+        return rc ? 0 : -1;
+   }catch(std::exception& e){
+       return -1;
+   }
+}
+
+int64_t php_zmq_socket_send_batch(const Resource& socket, const Array& messages, int64_t flags)
+{
+    auto data = socket.getTyped<ZmqSocketResource>()->getData();
+    int64_t sent = 0;
+    if(data->send_queue == nullptr && zmq_socket_busy(data)){
+        return -1;
+    }
+    try{
+        data->zero_copy->collect(true);
+        for(ArrayIter it(messages); it; ++it){
+            if(data->send_queue){
+                auto item = new ZmqSendQueue::Item();
+                item->frames.push_back(zmq_queue_frame(it.second().toString()));
+                if(!data->send_queue->push(item, flags)){
+                    break;
+                }
+            }else if(data->coalescer){
+                if(!zmq_send_coalesced(data, it.second().toString(), flags)){
+                    break;
+                }
+            }else if(!zmq_send_string(data, it.second().toString(), flags)){
+                break;
+            }
+            sent++;
+        }
+        return sent;
+    }catch(std::exception& e){
+        // report the messages that did go out, the next call surfaces the error
+        return sent > 0 ? sent : -1;
+    }
+}
+
+// max_bytes 0 flushes the batch and turns coalescing off
+int64_t php_zmq_socket_coalesce(const Resource& socket, int64_t max_bytes, int64_t interval_us)
+{
+    try{
+        auto data = socket.getTyped<ZmqSocketResource>()->getData();
+        if(zmq_socket_busy(data) || max_bytes < 0 || interval_us < 0){
+            return -1;
+        }
+        if(data->type != ZMQ_PUB && data->type != ZMQ_XPUB && data->type != ZMQ_PUSH){
+            return -1;
+        }
+        if(!zmq_coalescer_flush(data, 0)){
+            return -1;
+        }
+        delete data->coalescer;
+        data->coalescer = nullptr;
+        if(max_bytes > 0){
+            data->coalescer = new ZmqCoalescer(max_bytes, interval_us);
+        }
+        return 0;
+    }catch(std::exception& e){
+        return -1;
+    }
+}
+
+// a negative threshold turns compression off
+int64_t php_zmq_socket_compress(const Resource& socket, int64_t threshold, int64_t acceleration)
+{
+    auto data = socket.getTyped<ZmqSocketResource>()->getData();
+    if(zmq_socket_busy(data) || acceleration < 1){
+        return -1;
+    }
+#ifndef ZMQ_HAVE_LZ4
+    if(threshold >= 0){
+        return -1;
+    }
+#endif
+    data->compress_threshold = threshold < 0 ? -1 : threshold;
+    data->compress_acceleration = acceleration;
+    return 0;
+}
+
+// Envelopes from untrusted peers are delivered as they are unless the
+// socket asks for them.
+int64_t php_zmq_socket_decode(const Resource& socket, int64_t envelopes)
+{
+    auto data = socket.getTyped<ZmqSocketResource>()->getData();
+    if(zmq_socket_busy(data) || (envelopes & ~(int64_t)kZmqDecodeAll) != 0){
+        return -1;
+    }
+#ifndef ZMQ_HAVE_LZ4
+    if(envelopes & kZmqDecodeCompressed){
+        return -1;
+    }
+#endif
+    if((envelopes & kZmqDecodeShared) && !zmq_local_endpoints(data)){
+        return -1;
+    }
+    data->decode = envelopes;
+    return 0;
+}
+
+// A negative threshold turns the offload off. Every message goes to one
+// reader, so fan-out sockets cannot offload, and the reader must be on this
+// host, so all endpoints must be ipc or inproc.
+int64_t php_zmq_socket_shm(const Resource& socket, int64_t threshold, int64_t ttl)
+{
+    auto data = socket.getTyped<ZmqSocketResource>()->getData();
+    if(zmq_socket_busy(data) || data->type == ZMQ_PUB || data->type == ZMQ_XPUB || ttl <= 0){
+        return -1;
+    }
+    if(threshold >= 0 && !zmq_local_endpoints(data)){
+        return -1;
+    }
+    data->shm_threshold = threshold < 0 ? -1 : threshold;
+    data->shm_ttl = ttl;
+    return 0;
+}
+
+int64_t php_zmq_socket_flush(const Resource& socket, int64_t flags)
+{
+    try{
+        auto data = socket.getTyped<ZmqSocketResource>()->getData();
+        if(data->send_queue){
+            // the writer thread flushes on its own timer
+            return 0;
+        }
+        if(zmq_socket_busy(data)){
+            return -1;
+        }
+        return zmq_coalescer_flush(data, flags) ? 0 : -1;
+    }catch(std::exception& e){
+        return -1;
+    }
+}
+
+int64_t php_zmq_socket_send_queue_enable(const Resource& socket, int64_t capacity, int64_t overflow)
+{
+    try{
+        auto data = socket.getTyped<ZmqSocketResource>()->getData();
+        if(capacity < 1 || overflow < ZmqSendQueue::DropNewest || overflow > ZmqSendQueue::Block){
+            return -1;
+        }
+        if(zmq_socket_busy(data)){
+            return -1;
+        }
+        // read once here, the writer thread owns the socket afterwards
+        int send_timeout = -1;
+        int linger = -1;
+        size_t size = sizeof(int);
+        data->sock->getsockopt(ZMQ_SNDTIMEO, &send_timeout, &size);
+        size = sizeof(int);
+        data->sock->getsockopt(ZMQ_LINGER, &linger, &size);
+        auto queue = new ZmqSendQueue(data, capacity, (ZmqSendQueue::Overflow)overflow, send_timeout, linger);
+        queue->start();
+        return 0;
+    }catch(std::exception& e){
+        return -1;
+    }
+}
+
+int64_t php_zmq_socket_send_queue_disable(const Resource& socket)
+{
+    auto data = socket.getTyped<ZmqSocketResource>()->getData();
+    if(data->send_queue == nullptr){
+        return -1;
+    }
+    data->send_queue->revoke();
+    return 0;
+}
+
+Variant php_zmq_socket_send_queue_stats(const Resource& socket)
+{
+    auto data = socket.getTyped<ZmqSocketResource>()->getData();
+    if(data->send_queue == nullptr){
+        return false;
+    }
+    return data->send_queue->stats();
+}
+
+Variant php_zmq_socket_recv_multi(const Resource& socket, int64_t flags)
+{
+   try{
+        auto data = socket.getTyped<ZmqSocketResource>()->getData();
+        if(zmq_socket_busy(data)){
+            return false;
+        }
+        Array frames = Array::Create();
+        if(data->unbatcher.pending()){
+            frames.append(data->unbatcher.next());
+            return frames;
+        }
+        zmq::message_t msg;
+        if(!zmq_recv_message(data, &msg, flags)){
+            return false;
+        }
+        frames.append(zmq_unwrap_message(data, msg));
+        // the remaining frames of a multipart message are already queued
+        while(msg.more()){
+            msg.rebuild();
+            zmq_recv_message(data, &msg, 0);
+            frames.append(zmq_unwrap_message(data, msg));
+        }
+        return frames;
+   }catch(std::exception& e){
+       return false;
+   }
+}
+
+Variant php_zmq_socket_recv_batch(const Resource& socket, int64_t max, int64_t timeout)
+{
+   try{
+        auto data = socket.getTyped<ZmqSocketResource>()->getData();
+        if(zmq_socket_busy(data)){
+            return false;
+        }
+        Array messages = Array::Create();
+        if(max <= 0){
+            return messages;
+        }
+
+        // the rest of a batch is already here and needs no wait
+        while(messages.size() < max && data->unbatcher.pending()){
+            messages.append(data->unbatcher.next());
+        }
+        if(messages.size() == max){
+            return messages;
+        }
+
+        // wait for the first message, then take whatever is already queued
+        if(messages.empty()){
+            zmq_pollitem_t item;
+            memset(&item, 0, sizeof(item));
+            item.socket = *data->sock;
+            item.events = ZMQ_POLLIN;
+            uint64_t start = zmq_now_us();
+            int rc = zmq::poll(&item, 1, timeout);
+            ZmqThreadStats::local().poll_wait.record(zmq_now_us() - start);
+            if(rc == 0){
+                data->stats.wouldBlock(0);
+                ZmqThreadStats::local().wouldBlock(0);
+                return messages;
+            }
+        }
+
+        // the empty queue that ends the drain is expected, not an EAGAIN
+        zmq::message_t msg;
+        while(messages.size() < max && data->sock->recv(&msg, ZMQ_DONTWAIT)){
+            data->stats.received(msg.size(), 0);
+            ZmqThreadStats::local().received(msg.size(), 0);
+            if(msg.more()){
+                // a multipart message is one entry, the array of its frames
+                Array frames = Array::Create();
+                frames.append(zmq_unwrap_message(data, msg));
+                while(msg.more()){
+                    msg.rebuild();
+                    zmq_recv_message(data, &msg, 0);
+                    frames.append(zmq_unwrap_message(data, msg));
+                }
+                messages.append(frames);
+                msg.rebuild();
+                continue;
+            }
+            messages.append(zmq_unwrap_message(data, msg));
+            while(messages.size() < max && data->unbatcher.pending()){
+                messages.append(data->unbatcher.next());
+            }
+            msg.rebuild();
+        }
+        return messages;
+   }catch(std::exception& e){
+       return false;
+   }
+}
+
+// MessagePack encoding of PHP values for sendArray/recvArray. The encoder
+// walks the value twice, once to size the zmq::message_t and once to write
+// into it, so the message is the only buffer. Lists become MessagePack
+// arrays, other arrays maps; objects and resources cannot be encoded.
+static const int kMsgPackMaxDepth = 64;
+
+struct MsgPackCounter {
+    size_t size = 0;
+    void put(const void* src, size_t n) { size += n; }
+    void byte(uint8_t b) { size++; }
+};
+
+struct MsgPackWriter {
+    explicit MsgPackWriter(void* p) : pos(static_cast<char*>(p)) {}
+    void put(const void* src, size_t n) { memcpy(pos, src, n); pos += n; }
+    void byte(uint8_t b) { *pos++ = (char)b; }
+    char* pos;
+};
+
+template<class Sink>
+class MsgPackEncoder {
+public:
+    explicit MsgPackEncoder(Sink& s) : sink(s) {}
+
+    bool encode(const Variant& value, int depth){
+        if(value.isNull()){
+            sink.byte(0xc0);
+        }else if(value.isBoolean()){
+            sink.byte(value.toBoolean() ? 0xc3 : 0xc2);
+        }else if(value.isInteger()){
+            encodeInt(value.toInt64());
+        }else if(value.isDouble()){
+            double d = value.toDouble();
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            sink.byte(0xcb);
+            bigEndian(bits, 8);
+        }else if(value.isString()){
+            String str = value.toString();
+            encodeString(str.data(), str.size());
+        }else if(value.isArray() && depth < kMsgPackMaxDepth){
+            return encodeArray(value.toArray(), depth + 1);
+        }else{
+            return false;
+        }
+        return true;
+    }
+
+private:
+    void bigEndian(uint64_t value, int bytes){
+        for(int i = bytes - 1; i >= 0; i--){
+            sink.byte((uint8_t)(value >> (i * 8)));
+        }
+    }
+
+    // the smallest encoding that holds the value
+    void encodeInt(int64_t value){
+        if(value >= 0){
+            if(value < 0x80){
+                sink.byte((uint8_t)value);
+            }else if(value <= 0xff){
+                sink.byte(0xcc);
+                bigEndian(value, 1);
+            }else if(value <= 0xffff){
+                sink.byte(0xcd);
+                bigEndian(value, 2);
+            }else if(value <= 0xffffffffLL){
+                sink.byte(0xce);
+                bigEndian(value, 4);
+            }else{
+                sink.byte(0xcf);
+                bigEndian(value, 8);
+            }
+        }else{
+            if(value >= -32){
+                sink.byte((uint8_t)value);
+            }else if(value >= INT8_MIN){
+                sink.byte(0xd0);
+                bigEndian(value, 1);
+            }else if(value >= INT16_MIN){
+                sink.byte(0xd1);
+                bigEndian(value, 2);
+            }else if(value >= INT32_MIN){
+                sink.byte(0xd2);
+                bigEndian(value, 4);
+            }else{
+                sink.byte(0xd3);
+                bigEndian(value, 8);
+            }
+        }
+    }
+
+    void encodeString(const char* str, size_t size){
+        if(size < 32){
+            sink.byte(0xa0 | size);
+        }else if(size <= 0xff){
+            sink.byte(0xd9);
+            bigEndian(size, 1);
+        }else if(size <= 0xffff){
+            sink.byte(0xda);
+            bigEndian(size, 2);
+        }else{
+            sink.byte(0xdb);
+            bigEndian(size, 4);
+        }
+        sink.put(str, size);
+    }
+
+    void header(size_t size, uint8_t fix, uint8_t code16, uint8_t code32){
+        if(size < 16){
+            sink.byte(fix | size);
+        }else if(size <= 0xffff){
+            sink.byte(code16);
+            bigEndian(size, 2);
+        }else{
+            sink.byte(code32);
+            bigEndian(size, 4);
+        }
+    }
+
+    bool encodeArray(const Array& arr, int depth){
+        bool list = true;
+        int64_t next = 0;
+        for(ArrayIter it(arr); it; ++it){
+            Variant key = it.first();
+            if(!key.isInteger() || key.toInt64() != next++){
+                list = false;
+                break;
+            }
+        }
+
+        if(list){
+            header(arr.size(), 0x90, 0xdc, 0xdd);
+        }else{
+            header(arr.size(), 0x80, 0xde, 0xdf);
+        }
+        for(ArrayIter it(arr); it; ++it){
+            if(!list){
+                Variant key = it.first();
+                if(key.isInteger()){
+                    encodeInt(key.toInt64());
+                }else{
+                    String str = key.toString();
+                    encodeString(str.data(), str.size());
+                }
+            }
+            if(!encode(it.secondRef(), depth)){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    Sink& sink;
+};
+
+// Decodes one MessagePack value that spans the whole input. Strings and
+// binaries become PHP strings, maps need integer or string keys; extension
+// types are rejected.
+class MsgPackDecoder {
+public:
+    MsgPackDecoder(const void* data, size_t size)
+        : pos(static_cast<const uint8_t*>(data)), end(pos + size) {}
+
+    bool decode(Variant& out){
+        return value(out, 0) && pos == end;
+    }
+
+private:
+    bool need(uint64_t n) const { return (uint64_t)(end - pos) >= n; }
+
+    uint64_t bigEndian(int bytes){
+        uint64_t value = 0;
+        for(int i = 0; i < bytes; i++){
+            value = (value << 8) | *pos++;
+        }
+        return value;
+    }
+
+    bool value(Variant& out, int depth){
+        if(!need(1)){
+            return false;
+        }
+        uint8_t code = *pos++;
+        if(code <= 0x7f){
+            out = (int64_t)code;
+            return true;
+        }
+        if(code >= 0xe0){
+            out = (int64_t)(int8_t)code;
+            return true;
+        }
+        if((code & 0xe0) == 0xa0){
+            return str(out, code & 0x1f);
+        }
+        if((code & 0xf0) == 0x90){
+            return list(out, code & 0x0f, depth);
+        }
+        if((code & 0xf0) == 0x80){
+            return map(out, code & 0x0f, depth);
+        }
+
+        int bytes;
+        switch(code){
+        case 0xc0:
+            out = null_variant;
+            return true;
+        case 0xc2:
+        case 0xc3:
+            out = code == 0xc3;
+            return true;
+        case 0xcc: case 0xcd: case 0xce: case 0xcf: {
+            bytes = 1 << (code - 0xcc);
+            if(!need(bytes)){
+                return false;
+            }
+            uint64_t value = bigEndian(bytes);
+            // PHP has no unsigned 64-bit integers
+            if(value > (uint64_t)INT64_MAX){
+                out = (double)value;
+            }else{
+                out = (int64_t)value;
+            }
+            return true;
+        }
+        case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+            bytes = 1 << (code - 0xd0);
+            if(!need(bytes)){
+                return false;
+            }
+            uint64_t value = bigEndian(bytes);
+            if(bytes < 8 && (value >> (bytes * 8 - 1))){
+                value |= ~0ULL << (bytes * 8);
+            }
+            out = (int64_t)value;
+            return true;
+        }
+        case 0xca: {
+            if(!need(4)){
+                return false;
+            }
+            uint32_t bits = bigEndian(4);
+            float f;
+            memcpy(&f, &bits, sizeof(f));
+            out = (double)f;
+            return true;
+        }
+        case 0xcb: {
+            if(!need(8)){
+                return false;
+            }
+            uint64_t bits = bigEndian(8);
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            out = d;
+            return true;
+        }
+        case 0xd9: case 0xc4: bytes = 1; break;
+        case 0xda: case 0xc5: bytes = 2; break;
+        case 0xdb: case 0xc6: bytes = 4; break;
+        case 0xdc:
+            return need(2) && list(out, bigEndian(2), depth);
+        case 0xdd:
+            return need(4) && list(out, bigEndian(4), depth);
+        case 0xde:
+            return need(2) && map(out, bigEndian(2), depth);
+        case 0xdf:
+            return need(4) && map(out, bigEndian(4), depth);
+        default:
+            return false;
+        }
+        return need(bytes) && str(out, bigEndian(bytes));
+    }
+
+    bool str(Variant& out, uint64_t size){
+        if(!need(size)){
+            return false;
+        }
+        out = String(reinterpret_cast<const char*>(pos), size, CopyString);
+        pos += size;
+        return true;
+    }
+
+    // every element takes at least one byte, which bounds the count
+    bool list(Variant& out, uint64_t count, int depth){
+        if(depth >= kMsgPackMaxDepth || !need(count)){
+            return false;
+        }
+        Array arr = Array::Create();
+        for(uint64_t i = 0; i < count; i++){
+            Variant element;
+            if(!value(element, depth + 1)){
+                return false;
+            }
+            arr.append(element);
+        }
+        out = arr;
+        return true;
+    }
+
+    bool map(Variant& out, uint64_t count, int depth){
+        if(depth >= kMsgPackMaxDepth || !need(count * 2)){
+            return false;
+        }
+        Array arr = Array::Create();
+        for(uint64_t i = 0; i < count; i++){
+            Variant key;
+            Variant element;
+            if(!value(key, depth + 1) || !value(element, depth + 1)){
+                return false;
+            }
+            if(key.isInteger()){
+                arr.set(key.toInt64(), element);
+            }else if(key.isString()){
+                arr.set(key.toString(), element);
+            }else{
+                return false;
+            }
+        }
+        out = arr;
+        return true;
+    }
+
+    const uint8_t* pos;
+    const uint8_t* end;
+};
+
+// false unless the payload is one encoded array
+static Variant zmq_decode_array(const void* payload, size_t size)
+{
+    Variant value;
+    MsgPackDecoder decoder(payload, size);
+    if(!decoder.decode(value) || !value.isArray()){
+        return false;
+    }
+    return value;
+}
+
+int64_t php_zmq_socket_send_array(const Resource& socket, const Array& value, int64_t flags)
+{
+   try{
+        auto data = socket.getTyped<ZmqSocketResource>()->getData();
+        MsgPackCounter counter;
+        if(!MsgPackEncoder<MsgPackCounter>(counter).encode(value, 0)){
+            return -1;
+        }
+        zmq::message_t msg(counter.size);
+        MsgPackWriter writer(msg.data());
+        MsgPackEncoder<MsgPackWriter>(writer).encode(value, 0);
+
+        if(data->send_queue){
+            auto item = new ZmqSendQueue::Item();
+            item->frames.push_back(new zmq::message_t());
+            item->frames[0]->move(&msg);
+            return data->send_queue->push(item, flags) ? 0 : -1;
+        }
+        if(zmq_socket_busy(data)){
+            return -1;
+        }
+        data->zero_copy->collect(true);
+        if(zmq_coalescable(data, msg.size(), flags)){
+            return zmq_coalesce(data, msg.data(), msg.size(), flags) ? 0 : -1;
+        }
+        if(!zmq_coalescer_flush(data, flags)){
+            return -1;
+        }
+        zmq_encode_frame(data, msg);
+        return zmq_send_message(data, msg, flags) ? 0 : -1;
+   }catch(std::exception& e){
+       return -1;
+   }
+}
+
+Variant php_zmq_socket_recv_array(const Resource& socket, int64_t flags)
+{
+   try{
+        auto data = socket.getTyped<ZmqSocketResource>()->getData();
+        if(zmq_socket_busy(data)){
+            return false;
+        }
+        if(data->unbatcher.pending()){
+            String str = data->unbatcher.next();
+            return zmq_decode_array(str.data(), str.size());
+        }
+        zmq::message_t msg;
+        if(!zmq_recv_message(data, &msg, flags)){
+            return false;
+        }
+        // an encoded array never starts like an envelope, so plain frames
+        // are decoded straight from the message
+        if(zmq_envelope_tag(msg.data(), msg.size()) != 0){
+            String str = zmq_unwrap_message(data, msg);
+            return zmq_decode_array(str.data(), str.size());
+        }
+        data->recv_more = msg.more();
+        return zmq_decode_array(msg.data(), msg.size());
+   }catch(std::exception& e){
+       return false;
+   }
+}
+
+int64_t php_zmq_socket_subscribe(const Resource& socket, const String& prefix)
+{
+   try{
+        auto data = socket.getTyped<ZmqSocketResource>()->getDataForSetup();
+        if(data->type != ZMQ_SUB || zmq_socket_busy(data)){
+            return -1;
+        }
+        zmq_subscribe(data, prefix.toCppString());
+        return 0;
+   }catch(std::exception& e){
+       return -1;
+   }
+}
+
+int64_t php_zmq_socket_unsubscribe(const Resource& socket, const String& prefix)
+{
+   try{
+        auto data = socket.getTyped<ZmqSocketResource>()->getDataForSetup();
+        std::string topic = prefix.toCppString();
+        if(zmq_socket_busy(data) || data->topics == nullptr || !data->topics->erase(topic)){
+            return -1;
+        }
+        data->sock->setsockopt(ZMQ_UNSUBSCRIBE, topic.data(), topic.size());
+        return 0;
+   }catch(std::exception& e){
+       return -1;
+   }
+}
+
+Variant php_zmq_socket_subscriptions(const Resource& socket)
+{
+    auto data = socket.getTyped<ZmqSocketResource>()->getDataForSetup();
+    if(data->topics == nullptr){
+        return Array::Create();
+    }
+    return data->topics->toArray();
+}
+
+// One received message tagged with the subscription its first frame
+// matched, null if it matched none made with subscribe().
+static Array zmq_tag_message(ZmqSocketData* data, const Array& frames)
+{
+    Array tagged = Array::Create();
+    int id = -1;
+    if(data->topics){
+        String topic = frames[0].toString();
+        id = data->topics->match(topic.data(), topic.size());
+    }
+    tagged.set(String("subscription"), id >= 0 ? Variant(String(data->topics->prefix(id))) : null_variant);
+    tagged.set(String("frames"), frames);
+    return tagged;
+}
+
+// Like recv_batch, for whole messages that are tagged by zmq_tag_message.
+Variant php_zmq_socket_recv_tagged(const Resource& socket, int64_t max, int64_t timeout)
+{
+   try{
+        auto data = socket.getTyped<ZmqSocketResource>()->getData();
+        if(zmq_socket_busy(data)){
+            return false;
+        }
+        Array messages = Array::Create();
+        if(max <= 0){
+            return messages;
+        }
+
+        while(messages.size() < max && data->unbatcher.pending()){
+            Array frames = Array::Create();
+            frames.append(data->unbatcher.next());
+            messages.append(zmq_tag_message(data, frames));
+        }
+        if(messages.size() == max){
+            return messages;
+        }
+
+        if(messages.empty()){
+            zmq_pollitem_t item;
+            memset(&item, 0, sizeof(item));
+            item.socket = *data->sock;
+            item.events = ZMQ_POLLIN;
+            uint64_t start = zmq_now_us();
+            int rc = zmq::poll(&item, 1, timeout);
+            ZmqThreadStats::local().poll_wait.record(zmq_now_us() - start);
+            if(rc == 0){
+                data->stats.wouldBlock(0);
+                ZmqThreadStats::local().wouldBlock(0);
+                return messages;
+            }
+        }
+
+        zmq::message_t msg;
+        while(messages.size() < max && data->sock->recv(&msg, ZMQ_DONTWAIT)){
+            data->stats.received(msg.size(), 0);
+            ZmqThreadStats::local().received(msg.size(), 0);
+            Array frames = Array::Create();
+            frames.append(zmq_unwrap_message(data, msg));
+            // the remaining frames of a multipart message are already queued
+            while(msg.more()){
+                msg.rebuild();
+                zmq_recv_message(data, &msg, 0);
+                frames.append(zmq_unwrap_message(data, msg));
+            }
+            messages.append(zmq_tag_message(data, frames));
+            while(messages.size() < max && data->unbatcher.pending()){
+                Array rest = Array::Create();
+                rest.append(data->unbatcher.next());
+                messages.append(zmq_tag_message(data, rest));
+            }
+            msg.rebuild();
+        }
+        return messages;
+   }catch(std::exception& e){
+       return false;
+   }
+}
+
+// Async socket operations. recvAsync/sendAsync hand the socket to a single
+// process-wide loop thread that waits on the sockets' ZMQ_FD with epoll and
+// completes the operation when ZMQ_EVENTS allows it, so the request thread
+// can await other I/O meanwhile. The socket must not be used by the request
+// until the awaitable is done.
+class ZmqAsyncEvent : public AsioExternalThreadEvent {
+public:
+    enum Op { Recv, Send };
+    enum Status { Pending, Done, Failed, TimedOut };
+
+    ZmqAsyncEvent(ZmqSocketData* d, Op o, int64_t timeout_ms)
+        : data(d), op(o), status(Pending), unwrapped(false) {
+        has_deadline = timeout_ms >= 0;
+        if(has_deadline){
+            deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        }
+    }
+
+    // tries the operation without blocking, false means it would block
+    bool attempt(){
+        try{
+            size_t size = msg.size();
+            bool rc = op == Recv ? data->sock->recv(&msg, ZMQ_DONTWAIT)
+                                 : data->sock->send(msg, ZMQ_DONTWAIT);
+            if(!rc){
+                return false;
+            }
+            // the wait is spent in the awaitable, not blocked in libzmq
+            if(op == Recv){
+                data->stats.received(msg.size(), 0);
+                ZmqThreadStats::local().received(msg.size(), 0);
+            }else{
+                data->send_more = false;
+                data->stats.sent(size, 0);
+                ZmqThreadStats::local().sent(size, 0);
+            }
+            status = Done;
+        }catch(std::exception& e){
+            data->stats.failed();
+            ZmqThreadStats::local().failed();
+            status = Failed;
+        }
+        return true;
+    }
+
+    void finish(Status s){
+        if(status == Pending){
+            status = s;
+        }
+        // a received frame may still need the socket's unbatcher, so a recv
+        // hands the socket back only once unserialize() has taken it
+        if(op == Send){
+            data->async_pending.store(false, std::memory_order_release);
+        }
+        markAsFinished();
+    }
+
+    ZmqSocketData* data;
+    Op op;
+    Status status;
+    zmq::message_t msg;
+    // msg is already a single message taken out of a batch
+    bool unwrapped;
+    // set for a recv that owns the socket, see ZmqAsyncSlot
+    std::shared_ptr<ZmqAsyncSlot> slot;
+    bool has_deadline;
+    std::chrono::steady_clock::time_point deadline;
+
+protected:
+    void unserialize(Cell& result){
+        ZmqSocketData* owner = slot ? slot->data : nullptr;
+        if(owner){
+            owner->async_recv.reset();
+            owner->async_pending.store(false, std::memory_order_release);
+        }
+        if(status != Done){
+            cellDup(*Variant(false).asCell(), result);
+        }else if(op == Recv){
+            // without an owner the socket was closed before the result was taken
+            Variant ret = unwrapped ? Variant(zmq_message_to_string(msg))
+                        : owner ? Variant(zmq_unwrap_message(owner, msg))
+                                : Variant(false);
+            cellDup(*ret.asCell(), result);
+        }else{
+            cellDup(*Variant(true).asCell(), result);
+        }
+    }
+};
+
+class ZmqAsyncLoop {
+public:
+    static ZmqAsyncLoop& get(){
+        static ZmqAsyncLoop loop;
+        return loop;
+    }
+
+    void submit(ZmqAsyncEvent* event){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            incoming.push_back(event);
+        }
+        wake();
+    }
+
+    // drops the pending operation of the socket and waits for the loop to
+    // let go of it; the event is still finished so HHVM can reclaim it
+    void cancel(ZmqSocketData* data){
+        std::unique_lock<std::mutex> lock(mutex);
+        cancels.push_back(data);
+        uint64_t target = ++cancel_requested;
+        wake();
+        cancel_cond.wait(lock, [&]{ return cancel_done >= target; });
+    }
+
+private:
+    ZmqAsyncLoop() : cancel_requested(0), cancel_done(0) {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+        std::thread(&ZmqAsyncLoop::run, this).detach();
+    }
+
+    void wake(){
+        uint64_t one = 1;
+        ssize_t rc = write(wakefd, &one, sizeof(one));
+        (void)rc;
+    }
+
+    static int socketFd(ZmqSocketData* data){
+        int fd = -1;
+        size_t size = sizeof(fd);
+        zmq_getsockopt(*data->sock, ZMQ_FD, &fd, &size);
+        return fd;
+    }
+
+    void unwatch(ZmqAsyncEvent* event){
+        epoll_ctl(epfd, EPOLL_CTL_DEL, socketFd(event->data), nullptr);
+        pending.erase(event->data);
+    }
+
+    // ZMQ_FD is edge triggered, so every wakeup retries the operation until
+    // it completes or would block again
+    void progress(ZmqAsyncEvent* event){
+        if(event->attempt()){
+            unwatch(event);
+            event->finish(ZmqAsyncEvent::Done);
+        }
+    }
+
+    void run(){
+        std::vector<struct epoll_event> events(64);
+        while(true){
+            int timeout = -1;
+            auto now = std::chrono::steady_clock::now();
+            for(auto& entry : pending){
+                if(entry.second->has_deadline){
+                    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(entry.second->deadline - now).count();
+                    left = left < 0 ? 0 : left;
+                    timeout = timeout < 0 ? left : std::min<int64_t>(timeout, left);
+                }
+            }
+
+            int n = epoll_wait(epfd, events.data(), events.size(), timeout);
+            for(int i = 0; i < n; i++){
+                if(events[i].data.ptr == nullptr){
+                    uint64_t count;
+                    ssize_t rc = read(wakefd, &count, sizeof(count));
+                    (void)rc;
+                    continue;
+                }
+                auto it = pending.find(static_cast<ZmqSocketData*>(events[i].data.ptr));
+                if(it != pending.end()){
+                    progress(it->second);
+                }
+            }
+
+            takeIncoming();
+            expire();
+        }
+    }
+
+    void takeIncoming(){
+        std::vector<ZmqAsyncEvent*> added;
+        std::vector<ZmqSocketData*> cancelled;
+        uint64_t requested;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            added.swap(incoming);
+            cancelled.swap(cancels);
+            requested = cancel_requested;
+        }
+
+        for(auto event : added){
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.ptr = event->data;
+            pending[event->data] = event;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, socketFd(event->data), &ev);
+            progress(event);
+        }
+
+        if(!cancelled.empty()){
+            for(auto data : cancelled){
+                auto it = pending.find(data);
+                if(it != pending.end()){
+                    ZmqAsyncEvent* event = it->second;
+                    unwatch(event);
+                    event->finish(ZmqAsyncEvent::Failed);
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            cancel_done = requested;
+            cancel_cond.notify_all();
+        }
+    }
+
+    void expire(){
+        auto now = std::chrono::steady_clock::now();
+        std::vector<ZmqAsyncEvent*> expired;
+        for(auto& entry : pending){
+            if(entry.second->has_deadline && entry.second->deadline <= now){
+                expired.push_back(entry.second);
+            }
+        }
+        for(auto event : expired){
+            unwatch(event);
+            event->finish(ZmqAsyncEvent::TimedOut);
+        }
+    }
+
+    int epfd;
+    int wakefd;
+    std::mutex mutex;
+    std::condition_variable cancel_cond;
+    std::vector<ZmqAsyncEvent*> incoming;
+    std::vector<ZmqSocketData*> cancels;
+    uint64_t cancel_requested;
+    uint64_t cancel_done;
+
+    // loop thread only
+    std::unordered_map<ZmqSocketData*, ZmqAsyncEvent*> pending;
+};
+
+static void zmq_async_cancel(ZmqSocketData* data)
+{
+    ZmqAsyncLoop::get().cancel(data);
+}
+
+// finishes an operation that never reached the loop thread with false
+static Object zmq_async_fail(ZmqAsyncEvent* event)
+{
+    Object wait_handle(event->getWaitHandle());
+    event->markAsFinished();
+    return wait_handle;
+}
+
+static Object zmq_async_start(ZmqSocketData* data, ZmqAsyncEvent* event)
+{
+    bool expected = false;
+    if(data->lease ||
+       !data->async_pending.compare_exchange_strong(expected, true, std::memory_order_acq_rel)){
+        // another async operation or a native thread owns the socket
+        return zmq_async_fail(event);
+    }
+    if(event->op == ZmqAsyncEvent::Recv){
+        event->slot = std::make_shared<ZmqAsyncSlot>();
+        event->slot->data = data;
+        data->async_recv = event->slot;
+    }
+    Object wait_handle(event->getWaitHandle());
+    ZmqAsyncLoop::get().submit(event);
+    return wait_handle;
+}
+
+Object php_zmq_socket_recv_async(const Resource& socket, int64_t timeout)
+{
+    auto data = socket.getTyped<ZmqSocketResource>()->getData();
+    auto event = new ZmqAsyncEvent(data, ZmqAsyncEvent::Recv, timeout);
+    if(data->unbatcher.pending() && !zmq_socket_busy(data)){
+        // the rest of a batch completes at once
+        String str = data->unbatcher.next();
+        event->msg.rebuild(str.size());
+        memcpy(event->msg.data(), str.data(), str.size());
+        event->unwrapped = true;
+        event->status = ZmqAsyncEvent::Done;
+        Object wait_handle(event->getWaitHandle());
+        event->markAsFinished();
+        return wait_handle;
+    }
+    return zmq_async_start(data, event);
+}
+
+Object php_zmq_socket_send_async(const Resource& socket, const String& message, int64_t timeout)
+{
+    auto data = socket.getTyped<ZmqSocketResource>()->getData();
+    auto event = new ZmqAsyncEvent(data, ZmqAsyncEvent::Send, timeout);
+    // checked before encoding, an offloaded payload would never be sent
+    if(zmq_socket_busy(data)){
+        return zmq_async_fail(event);
+    }
+    // a pending batch goes first to keep the order; if it cannot go out
+    // now the message would overtake it, so the send fails instead
+    bool flushed;
+    try{
+        flushed = zmq_coalescer_flush(data, ZMQ_DONTWAIT);
+    }catch(std::exception& e){
+        flushed = false;
+    }
+    if(!flushed){
+        return zmq_async_fail(event);
+    }
+    // the loop thread cannot touch request memory, so the payload is copied
+    if(!zmq_offload(data, message.data(), message.length(), event->msg) &&
+       !zmq_compress(data, message.data(), message.length(), event->msg)){
+        event->msg.rebuild(message.length());
+        memcpy(event->msg.data(), message.data(), message.length());
+    }
+    return zmq_async_start(data, event);
+}
+
+#ifdef ZMQ_HAS_PROXY_STEERABLE
+// Runs zmq::proxy_steerable between a frontend, a backend and an optional
+// capture socket on a native thread. The request thread steers it through an
+// inproc PAIR connected to the proxy's control socket.
+class ZmqDeviceResource : public SweepableResourceData, public ZmqSocketLease {
+public:
+    DECLARE_RESOURCE_ALLOCATION(ZmqDeviceResource)
+    CLASSNAME_IS("zmq_device")
+    virtual const String& o_getClassNameHook() const { return classnameof(); }
+
+    // how long statistics() waits for the proxy to reply, in milliseconds
+    static const int kCommandTimeout = 1000;
+
+    explicit ZmqDeviceResource(ZmqSocketData* f, ZmqSocketData* b, ZmqSocketData* c)
+        : frontend(f), backend(b), capture(c), control(nullptr), commander(nullptr),
+          running(false) {}
+
+    virtual ~ZmqDeviceResource() {
+        stop();
+    }
+
+    // false if one of the sockets is already owned by another thread
+    bool start(){
+        if(running || zmq_socket_busy(frontend) || zmq_socket_busy(backend) ||
+           (capture && zmq_socket_busy(capture))){
+            return false;
+        }
+
+        char endpoint[64];
+        snprintf(endpoint, sizeof(endpoint), "inproc://hhvm-zmq-device-%p", (void*)this);
+        control = new zmq::socket_t(*frontend->ctx, ZMQ_PAIR);
+        commander = new zmq::socket_t(*frontend->ctx, ZMQ_PAIR);
+        control->bind(endpoint);
+        commander->connect(endpoint);
+        int timeout = kCommandTimeout;
+        commander->setsockopt(ZMQ_RCVTIMEO, &timeout, sizeof(int));
+
+        frontend->lease = this;
+        backend->lease = this;
+        if(capture){
+            capture->lease = this;
+        }
+        running = true;
+        thread = std::thread([this]{
+            try{
+                zmq::proxy_steerable(*frontend->sock, *backend->sock,
+                                     capture ? (void*)*capture->sock : nullptr, *control);
+            }catch(std::exception& e){
+                // terminated with the context
+            }
+        });
+        return true;
+    }
+
+    bool command(const char* cmd){
+        if(!running){
+            return false;
+        }
+        return commander->send(cmd, strlen(cmd)) == strlen(cmd);
+    }
+
+#if ZMQ_VERSION >= ZMQ_MAKE_VERSION(4, 3, 0)
+    // the proxy replies with eight uint64 frames: messages and bytes in/out
+    // of the frontend, then of the backend
+    bool statistics(Array& stats){
+        static const char* names[] = {
+            "frontend_messages_in", "frontend_bytes_in",
+            "frontend_messages_out", "frontend_bytes_out",
+            "backend_messages_in", "backend_bytes_in",
+            "backend_messages_out", "backend_bytes_out",
+        };
+        if(!running){
+            return false;
+        }
+        // the replies to a request that timed out would be taken for these
+        zmq::message_t stale;
+        while(commander->recv(&stale, ZMQ_DONTWAIT)){
+            stale.rebuild();
+        }
+        if(!command("STATISTICS")){
+            return false;
+        }
+        for(int i = 0; i < 8; i++){
+            zmq::message_t msg;
+            if(!commander->recv(&msg)){
+                return false;
+            }
+            uint64_t value = 0;
+            memcpy(&value, msg.data(), std::min(msg.size(), sizeof(value)));
+            stats.set(String(names[i]), (int64_t)value);
+        }
+        return true;
+    }
+#endif
+
+    void stop(){
+        if(!running){
+            return;
+        }
+        command("TERMINATE");
+        thread.join();
+        running = false;
+
+        frontend->lease = nullptr;
+        backend->lease = nullptr;
+        if(capture){
+            capture->lease = nullptr;
+        }
+        delete commander;
+        delete control;
+        commander = nullptr;
+        control = nullptr;
+    }
+
+    virtual void revoke() { stop(); }
+
+private:
+    ZmqSocketData* frontend;
+    ZmqSocketData* backend;
+    ZmqSocketData* capture;
+    zmq::socket_t* control;
+    zmq::socket_t* commander;
+    std::thread thread;
+    bool running;
+};
+
+void ZmqDeviceResource::sweep() {
+    stop();
+}
+#endif
+
+Variant php_zmq_device_create(const Resource& frontend, const Resource& backend, const Variant& capture)
+{
+#ifdef ZMQ_HAS_PROXY_STEERABLE
+    auto f = frontend.getTyped<ZmqSocketResource>()->getData();
+    auto b = backend.getTyped<ZmqSocketResource>()->getData();
+    ZmqSocketData* c = nullptr;
+    if(capture.isResource()){
+        c = capture.toResource().getTyped<ZmqSocketResource>()->getData();
+    }
+    return NEWOBJ(ZmqDeviceResource)(f, b, c);
+#else
+    return false;
+#endif
+}
+
+int64_t php_zmq_device_start(const Resource& device)
+{
+#ifdef ZMQ_HAS_PROXY_STEERABLE
+    try{
+        return device.getTyped<ZmqDeviceResource>()->start() ? 0 : -1;
+    }catch(std::exception& e){
+        return -1;
+    }
+#else
+    return -1;
+#endif
+}
+
+int64_t php_zmq_device_command(const Resource& device, const String& command)
+{
+#ifdef ZMQ_HAS_PROXY_STEERABLE
+    try{
+        auto dev = device.getTyped<ZmqDeviceResource>();
+        if(command == "TERMINATE"){
+            dev->stop();
+            return 0;
+        }
+        return dev->command(command.c_str()) ? 0 : -1;
+    }catch(std::exception& e){
+        return -1;
+    }
+#else
+    return -1;
+#endif
+}
+
+Variant php_zmq_device_statistics(const Resource& device)
+{
+#if defined(ZMQ_HAS_PROXY_STEERABLE) && ZMQ_VERSION >= ZMQ_MAKE_VERSION(4, 3, 0)
+    try{
+        Array stats = Array::Create();
+        if(!device.getTyped<ZmqDeviceResource>()->statistics(stats)){
+            return false;
+        }
+        return stats;
+    }catch(std::exception& e){
+        return false;
+    }
+#else
+    return false;
+#endif
+}
+
+// The load balancing broker. Clients talk to a ROUTER frontend, workers to a
+// ROUTER backend, and a native thread hands every request to the worker that
+// has been ready the longest. A worker says it is ready with a one-frame
+// message such as "READY"; every reply ([client envelope][""][body...] as a
+// REQ worker sees it) makes it ready again. Requests wait in a bounded queue
+// while no worker is ready; when the queue is full the frontend is not read
+// and clients block on their high water mark.
+class ZmqBrokerResource : public SweepableResourceData, public ZmqSocketLease {
+public:
+    DECLARE_RESOURCE_ALLOCATION(ZmqBrokerResource)
+    CLASSNAME_IS("zmq_broker")
+    virtual const String& o_getClassNameHook() const { return classnameof(); }
+
+    // a worker that asked for nothing and sent nothing for this long, in
+    // microseconds, is forgotten; it is registered again when it comes back
+    static const uint64_t kWorkerTimeout = 60 * 1000000;
+    // how often the broker thread looks for such workers, in milliseconds
+    static const long kPruneInterval = 1000;
+
+    explicit ZmqBrokerResource(ZmqSocketData* f, ZmqSocketData* b, size_t max_queue)
+        : frontend(f), backend(b), max_queue(max_queue), control(nullptr), commander(nullptr),
+          running(false), requests(0), dispatched(0), replies(0), unroutable(0) {}
+
+    virtual ~ZmqBrokerResource() {
+        stop();
+    }
+
+    // false if one of the sockets is already owned by another thread
+    bool start(){
+        if(running || zmq_socket_busy(frontend) || zmq_socket_busy(backend)){
+            return false;
+        }
+        // a request for a worker that went away fails instead of vanishing
+        int v = 1;
+        backend->sock->setsockopt(ZMQ_ROUTER_MANDATORY, &v, sizeof(int));
+
+        char endpoint[64];
+        snprintf(endpoint, sizeof(endpoint), "inproc://hhvm-zmq-broker-%p", (void*)this);
+        control = new zmq::socket_t(*frontend->ctx, ZMQ_PAIR);
+        commander = new zmq::socket_t(*frontend->ctx, ZMQ_PAIR);
+        control->bind(endpoint);
+        commander->connect(endpoint);
+
+        frontend->lease = this;
+        backend->lease = this;
+        running = true;
+        thread = std::thread([this]{
+            try{
+                run();
+            }catch(std::exception& e){
+                // terminated with the context
+            }
+        });
+        return true;
+    }
+
+    void stop(){
+        if(!running){
+            return;
+        }
+        commander->send("TERMINATE", 9);
+        thread.join();
+        running = false;
+
+        frontend->lease = nullptr;
+        backend->lease = nullptr;
+        delete commander;
+        delete control;
+        commander = nullptr;
+        control = nullptr;
+        clear();
+    }
+
+    virtual void revoke() { stop(); }
+
+    Array stats(){
+        std::lock_guard<std::mutex> lock(mutex);
+        Array workers_stats = Array::Create();
+        int64_t ready_workers = 0;
+        for(auto& entry : workers){
+            const Worker& w = entry.second;
+            Array worker = Array::Create();
+            worker.set(String("ready"), (int64_t)w.credits);
+            worker.set(String("inflight"), (int64_t)w.inflight);
+            worker.set(String("handled"), (int64_t)w.handled);
+            workers_stats.set(String(entry.first), worker);
+            if(w.credits > 0){
+                ready_workers++;
+            }
+        }
+        Array stats = Array::Create();
+        stats.set(String("requests"), (int64_t)requests);
+        stats.set(String("dispatched"), (int64_t)dispatched);
+        stats.set(String("replies"), (int64_t)replies);
+        stats.set(String("unroutable"), (int64_t)unroutable);
+        stats.set(String("queue_depth"), (int64_t)queue.size());
+        stats.set(String("max_queue"), (int64_t)max_queue);
+        stats.set(String("ready_workers"), ready_workers);
+        stats.set(String("workers"), workers_stats);
+        return stats;
+    }
+
+private:
+    typedef std::vector<zmq::message_t*> Frames;
+
+    struct Worker {
+        std::string id;
+        uint64_t credits = 0;   // entries in the ready queue
+        uint64_t inflight = 0;
+        uint64_t handled = 0;
+        uint64_t last_seen = 0;
+    };
+
+    static void release(Frames& frames){
+        for(auto frame : frames){
+            delete frame;
+        }
+        frames.clear();
+    }
+
+    static bool receive(zmq::socket_t* sock, Frames& frames){
+        std::unique_ptr<zmq::message_t> msg(new zmq::message_t());
+        if(!sock->recv(msg.get(), ZMQ_DONTWAIT)){
+            return false;
+        }
+        bool more = msg->more();
+        frames.push_back(msg.release());
+        while(more){
+            zmq::message_t* part = new zmq::message_t();
+            frames.push_back(part);
+            sock->recv(part, 0);
+            more = part->more();
+        }
+        return true;
+    }
+
+    // sends frames[from..], which are emptied
+    static void forward(zmq::socket_t* sock, Frames& frames, size_t from, int flags){
+        for(size_t i = from; i < frames.size(); i++){
+            sock->send(*frames[i], i + 1 < frames.size() ? (flags | ZMQ_SNDMORE) : flags);
+        }
+    }
+
+    void run(){
+        zmq_pollitem_t items[3];
+        memset(items, 0, sizeof(items));
+        items[0].socket = *control;
+        items[1].socket = *backend->sock;
+        items[2].socket = *frontend->sock;
+        for(auto& item : items){
+            item.events = ZMQ_POLLIN;
+        }
+
+        uint64_t pruned = zmq_now_us();
+        while(true){
+            bool room;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                room = queue.size() < max_queue;
+            }
+            zmq::poll(items, room ? 3 : 2, kPruneInterval);
+            if(items[0].revents & ZMQ_POLLIN){
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            uint64_t now = zmq_now_us();
+            if(now - pruned >= (uint64_t)kPruneInterval * 1000){
+                prune(now);
+                pruned = now;
+            }
+            if(items[1].revents & ZMQ_POLLIN){
+                while(fromWorker()){}
+            }
+            if(room && (items[2].revents & ZMQ_POLLIN)){
+                while(queue.size() < max_queue && fromClient()){}
+            }
+            dispatch();
+        }
+    }
+
+    bool fromWorker(){
+        Frames frames;
+        if(!receive(backend->sock, frames)){
+            return false;
+        }
+        std::string id(static_cast<char*>(frames[0]->data()), frames[0]->size());
+        auto it = workers.find(id);
+        if(it == workers.end()){
+            it = workers.emplace(id, Worker()).first;
+            it->second.id = id;
+        }
+        Worker& w = it->second;
+        w.last_seen = zmq_now_us();
+        size_t body = frames.size() > 1 && frames[1]->size() == 0 ? 2 : 1;
+        if(frames.size() > body + 1){
+            if(w.inflight > 0){
+                w.inflight--;
+            }
+            w.handled++;
+            replies++;
+            try{
+                forward(frontend->sock, frames, body, ZMQ_DONTWAIT);
+            }catch(std::exception& e){
+                // the client is gone
+            }
+        }
+        release(frames);
+        w.credits++;
+        ready.push_back(&w);
+        return true;
+    }
+
+    bool fromClient(){
+        Frames frames;
+        if(!receive(frontend->sock, frames)){
+            return false;
+        }
+        queue.push_back(Frames());
+        queue.back().swap(frames);
+        requests++;
+        return true;
+    }
+
+    // pairs queued requests with the least recently used ready workers
+    void dispatch(){
+        // workers whose pipe is full keep their place for the next round
+        std::vector<Worker*> full;
+        while(!queue.empty() && !ready.empty()){
+            Worker* w = ready.front();
+            ready.pop_front();
+
+            bool sent;
+            try{
+                zmq::message_t head(w->id.size());
+                memcpy(head.data(), w->id.data(), w->id.size());
+                sent = backend->sock->send(head, ZMQ_SNDMORE | ZMQ_DONTWAIT);
+            }catch(zmq::error_t& e){
+                if(e.num() != EHOSTUNREACH){
+                    throw;
+                }
+                // the worker went away, its other credits go with it
+                evict(w);
+                unroutable++;
+                continue;
+            }
+            if(!sent){
+                full.push_back(w);
+                continue;
+            }
+            w->credits--;
+            zmq::message_t delimiter;
+            backend->sock->send(delimiter, ZMQ_SNDMORE);
+            forward(backend->sock, queue.front(), 0, 0);
+            release(queue.front());
+            queue.pop_front();
+            w->inflight++;
+            dispatched++;
+        }
+        ready.insert(ready.begin(), full.begin(), full.end());
+    }
+
+    void evict(Worker* w){
+        ready.erase(std::remove(ready.begin(), ready.end(), w), ready.end());
+        std::string id = w->id;
+        workers.erase(id);
+    }
+
+    // Drops the workers that are not waiting for a request and have been
+    // silent for kWorkerTimeout: their requests are lost and a reply, if
+    // one ever comes, registers them again. Waiting workers stay, a dead
+    // one is evicted when a request is routed to it.
+    void prune(uint64_t now){
+        for(auto it = workers.begin(); it != workers.end(); ){
+            Worker& w = it->second;
+            if(w.credits == 0 && now - w.last_seen >= kWorkerTimeout){
+                it = workers.erase(it);
+            }else{
+                ++it;
+            }
+        }
+    }
+
+    void clear(){
+        for(auto& frames : queue){
+            release(frames);
+        }
+        queue.clear();
+        ready.clear();
+    }
+
+    ZmqSocketData* frontend;
+    ZmqSocketData* backend;
+    size_t max_queue;
+    zmq::socket_t* control;
+    zmq::socket_t* commander;
+    std::thread thread;
+    bool running;
+
+    // all of the below belongs to the broker thread, stats() reads it
+    std::mutex mutex;
+    std::unordered_map<std::string, Worker> workers;
+    std::deque<Worker*> ready;  // one entry per credit, oldest first
+    std::deque<Frames> queue;
+    uint64_t requests, dispatched, replies, unroutable;
+};
+
+void ZmqBrokerResource::sweep() {
+    stop();
+}
+
+Variant php_zmq_broker_create(const Resource& frontend, const Resource& backend, int64_t max_queue)
+{
+    auto f = frontend.getTyped<ZmqSocketResource>()->getData();
+    auto b = backend.getTyped<ZmqSocketResource>()->getData();
+    if(f->type != ZMQ_ROUTER || b->type != ZMQ_ROUTER || max_queue <= 0){
+        return false;
+    }
+    return NEWOBJ(ZmqBrokerResource)(f, b, max_queue);
+}
+
+int64_t php_zmq_broker_start(const Resource& broker)
+{
+    try{
+        return broker.getTyped<ZmqBrokerResource>()->start() ? 0 : -1;
+    }catch(std::exception& e){
+        return -1;
+    }
+}
+
+int64_t php_zmq_broker_stop(const Resource& broker)
+{
+    try{
+        broker.getTyped<ZmqBrokerResource>()->stop();
+        return 0;
+    }catch(std::exception& e){
+        return -1;
+    }
+}
+
+Variant php_zmq_broker_stats(const Resource& broker)
+{
+    return broker.getTyped<ZmqBrokerResource>()->stats();
+}
+
+// Pipelined request/reply over a DEALER socket. Every call is sent as
+// [correlation id][empty delimiter][payload...]; REP and ROUTER servers echo
+// the frames before the delimiter, so any number of calls can be in flight
+// and their replies may come back in any order. A call without a reply is
+// sent again after the attempt timeout until its retries or its deadline run
+// out. Everything happens on the request thread, in call() and poll().
+class ZmqRpcClientResource : public SweepableResourceData {
+public:
+    DECLARE_RESOURCE_ALLOCATION(ZmqRpcClientResource)
+    CLASSNAME_IS("zmq_rpc_client")
+    virtual const String& o_getClassNameHook() const { return classnameof(); }
+
+    // how often a call that hit SNDHWM is offered to the socket again
+    static const uint64_t kRetryInterval = 10000;
+
+    ZmqRpcClientResource(ZmqSocketData* data, const Array& endpoints, int64_t attempt_timeout,
+                         int64_t retries, bool failover, int64_t failover_after)
+        : data(data), attempt_timeout(attempt_timeout * 1000), retries(retries),
+          failover(failover), failover_after(std::max<int64_t>(failover_after, 1)),
+          current(0), misses(0), sent(0), resent(0), replies(0), timeouts(0),
+          late_replies(0), failovers(0) {
+        for(ArrayIter iter(endpoints); iter; ++iter){
+            this->endpoints.push_back(iter.second().toString().toCppString());
+        }
+        // replies to an older client on the same persistent socket must not
+        // match new calls
+        std::random_device rd;
+        next_id = (((uint64_t)rd() << 32) | rd()) & 0x3fffffffffffffffULL;
+    }
+
+    virtual ~ZmqRpcClientResource() {
+        clear();
+    }
+
+    // the socket was handed to another thread after the client was created
+    bool busy() const {
+        return zmq_socket_busy(data);
+    }
+
+    // In failover mode only the current endpoint is connected. Otherwise the
+    // DEALER spreads calls over all of them, and with delayed attach nothing
+    // is queued for a server that is not there. A pooled socket may come
+    // with other endpoints, which would get calls too, so they are dropped.
+    void connect(){
+        std::set<std::string> wanted;
+        if(failover){
+            wanted.insert(endpoints[current]);
+        }else{
+            int v = 1;
+            data->sock->setsockopt(ZMQ_DELAY_ATTACH_ON_CONNECT, &v, sizeof(int));
+            wanted.insert(endpoints.begin(), endpoints.end());
+        }
+        std::vector<std::string> stale;
+        for(auto& endpoint : data->connected){
+            if(!wanted.count(endpoint)){
+                stale.push_back(endpoint);
+            }
+        }
+        for(auto& endpoint : stale){
+            detach(endpoint);
+        }
+        for(auto& endpoint : wanted){
+            attach(endpoint);
+        }
+    }
+
+    // returns the id of the call
+    int64_t call(const Array& request, int64_t timeout){
+        uint64_t now = zmq_now_us();
+        uint64_t id = next_id++;
+        Call& c = calls[id];
+        for(ArrayIter iter(request); iter; ++iter){
+            String frame = iter.second().toString();
+            std::unique_ptr<zmq::message_t> msg(new zmq::message_t(frame.size()));
+            memcpy(msg->data(), frame.data(), frame.size());
+            zmq_encode_frame(data, *msg);
+            c.frames.push_back(std::move(msg));
+        }
+        c.deadline = now + timeout * 1000;
+        c.retries_left = retries;
+        c.sent = false;
+        dispatch(id, c, now);
+        return id;
+    }
+
+    // Replies that arrived within the timeout as id => frames, and false for
+    // the calls whose deadline passed. Returns as soon as there is a result.
+    Array poll(int64_t timeout){
+        Array results = Array::Create();
+        uint64_t until = timeout < 0 ? UINT64_MAX : zmq_now_us() + timeout * 1000;
+        while(true){
+            expire(zmq_now_us(), results);
+            receive(results);
+            if(!results.empty() || calls.empty()){
+                return results;
+            }
+            uint64_t now = zmq_now_us();
+            if(now >= until){
+                return results;
+            }
+            uint64_t wake = std::min(until, timers.top().first);
+            zmq_pollitem_t item;
+            memset(&item, 0, sizeof(item));
+            item.socket = *data->sock;
+            item.events = ZMQ_POLLIN;
+            zmq::poll(&item, 1, wake > now ? (long)((wake - now + 999) / 1000) : 0);
+        }
+    }
+
+    Array stats(){
+        Array stats = Array::Create();
+        stats.set(String("sent"), (int64_t)sent);
+        stats.set(String("retries"), (int64_t)resent);
+        stats.set(String("replies"), (int64_t)replies);
+        stats.set(String("timeouts"), (int64_t)timeouts);
+        stats.set(String("late_replies"), (int64_t)late_replies);
+        stats.set(String("failovers"), (int64_t)failovers);
+        stats.set(String("inflight"), (int64_t)calls.size());
+        if(failover){
+            stats.set(String("endpoint"), String(endpoints[current]));
+        }
+        return stats;
+    }
+
+    void clear(){
+        calls.clear();
+        timers = Timers();
+    }
+
+private:
+    struct Call {
+        std::vector<std::unique_ptr<zmq::message_t>> frames;
+        uint64_t deadline;
+        uint64_t next_check;  // timer entries with another time are stale
+        int64_t retries_left;
+        bool sent;
+    };
+    typedef std::pair<uint64_t, uint64_t> Timer;  // time, call id
+    typedef std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> Timers;
+
+    // a second connect to the same endpoint would open a second pipe
+    void attach(const std::string& endpoint){
+        if(data->connected.count(endpoint)){
+            return;
+        }
+        data->sock->connect(endpoint.c_str());
+        data->connected.insert(endpoint);
+    }
+
+    void detach(const std::string& endpoint){
+        try{
+            data->sock->disconnect(endpoint.c_str());
+        }catch(std::exception& e){
+        }
+        data->connected.erase(endpoint);
+    }
+
+    // The whole call goes out or nothing: once the first frame is accepted
+    // libzmq takes the rest of the message as well.
+    bool transmit(uint64_t id, Call& c){
+        zmq::message_t head(sizeof(id));
+        memcpy(head.data(), &id, sizeof(id));
+        if(!zmq_send_message(data, head, ZMQ_SNDMORE | ZMQ_DONTWAIT)){
+            return false;
+        }
+        zmq::message_t delimiter;
+        zmq_send_message(data, delimiter, ZMQ_SNDMORE);
+        for(size_t i = 0; i < c.frames.size(); i++){
+            zmq::message_t msg;
+            msg.copy(c.frames[i].get());
+            zmq_send_message(data, msg, i + 1 < c.frames.size() ? ZMQ_SNDMORE : 0);
+        }
+        return true;
+    }
+
+    void dispatch(uint64_t id, Call& c, uint64_t now){
+        bool first = !c.sent;
+        if(transmit(id, c)){
+            c.sent = true;
+            first ? sent++ : resent++;
+            c.next_check = std::min(now + attempt_timeout, c.deadline);
+        }else{
+            c.next_check = std::min(now + kRetryInterval, c.deadline);
+        }
+        timers.push(Timer(c.next_check, id));
+    }
+
+    void expire(uint64_t now, Array& results){
+        while(!timers.empty() && timers.top().first <= now){
+            Timer timer = timers.top();
+            timers.pop();
+            auto it = calls.find(timer.second);
+            if(it == calls.end() || it->second.next_check != timer.first){
+                continue;
+            }
+            Call& c = it->second;
+            if(now >= c.deadline){
+                results.set((int64_t)timer.second, false);
+                calls.erase(it);
+                timeouts++;
+                continue;
+            }
+            if(c.sent){
+                // the attempt went unanswered
+                if(failover && ++misses >= failover_after){
+                    next();
+                }
+                if(c.retries_left <= 0){
+                    c.next_check = c.deadline;
+                    timers.push(Timer(c.next_check, timer.second));
+                    continue;
+                }
+                c.retries_left--;
+            }
+            dispatch(timer.second, c, now);
+        }
+    }
+
+    void next(){
+        misses = 0;
+        if(endpoints.size() < 2){
+            return;
         }
+        detach(endpoints[current]);
+        current = (current + 1) % endpoints.size();
+        attach(endpoints[current]);
+        failovers++;
     }
 
-    void clear(){
-        std::vector<PollItem*>::iterator it;
-        for(it = items.begin(); it != items.end(); ){
-            delete *it;
-            it = items.erase(it);
+    void receive(Array& results){
+        zmq::message_t head;
+        while(zmq_recv_message(data, &head, ZMQ_DONTWAIT)){
+            bool more = head.more();
+            bool valid = more && head.size() == sizeof(uint64_t);
+            if(valid){
+                zmq::message_t delimiter;
+                zmq_recv_message(data, &delimiter, 0);
+                more = delimiter.more();
+                valid = more && delimiter.size() == 0;
+            }
+            uint64_t id = 0;
+            if(valid){
+                memcpy(&id, head.data(), sizeof(id));
+            }
+            auto it = valid ? calls.find(id) : calls.end();
+            if(it == calls.end()){
+                // a reply to a call that timed out, or not a reply at all
+                while(more){
+                    zmq::message_t msg;
+                    zmq_recv_message(data, &msg, 0);
+                    more = msg.more();
+                }
+                late_replies++;
+                head.rebuild();
+                continue;
+            }
+
+            Array frames = Array::Create();
+            data->recv_more = true;
+            while(more){
+                zmq::message_t msg;
+                zmq_recv_message(data, &msg, 0);
+                more = msg.more();
+                frames.append(zmq_unwrap_message(data, msg));
+            }
+            results.set((int64_t)id, frames);
+            calls.erase(it);
+            replies++;
+            misses = 0;
+            head.rebuild();
         }
     }
 
-private:
-    std::vector<PollItem*> items;
+    ZmqSocketData* data;
+    std::vector<std::string> endpoints;
+    uint64_t attempt_timeout;  // microseconds
+    int64_t retries;
+    bool failover;
+    int64_t failover_after;
+    size_t current;
+    int64_t misses;
+    uint64_t next_id;
+    std::unordered_map<uint64_t, Call> calls;
+    Timers timers;
+    uint64_t sent, resent, replies, timeouts, late_replies, failovers;
 };
 
-void ZmqPollResource::sweep() {
+void ZmqRpcClientResource::sweep() {
     clear();
 }
 
-Variant php_zmq_context_create(int64_t io_threads)
+Variant php_zmq_rpc_create(const Resource& socket, const Array& endpoints, int64_t attempt_timeout,
+                           int64_t retries, bool failover, int64_t failover_after)
 {
     try{
-        return NEWOBJ(ZmqContextResource)(io_threads);
+        auto data = socket.getTyped<ZmqSocketResource>()->getData();
+        if(data->type != ZMQ_DEALER || zmq_socket_busy(data) || endpoints.empty() || attempt_timeout <= 0){
+            return false;
+        }
+        if(zmq_shm_enabled(data)){
+            for(ArrayIter iter(endpoints); iter; ++iter){
+                if(!zmq_local_endpoint(iter.second().toString().toCppString())){
+                    return false;
+                }
+            }
+        }
+        auto rpc = NEWOBJ(ZmqRpcClientResource)(data, endpoints, attempt_timeout, retries,
+                                                failover, failover_after);
+        Resource res(rpc);
+        rpc->connect();
+        return res;
     }catch(std::exception& e){
         return false;
     }
 }
 
-int64_t php_zmq_context_get_opt(const Resource& context, int64_t option)
+Variant php_zmq_rpc_call(const Resource& rpc, const Variant& request, int64_t timeout)
 {
-    auto ctx = context.getTyped<ZmqContextResource>()->getContext();
-    return ctx->get_opt(option);
+    try{
+        Array frames;
+        if(request.isArray()){
+            frames = request.toArray();
+        }else{
+            frames = Array::Create();
+            frames.append(request.toString());
+        }
+        auto client = rpc.getTyped<ZmqRpcClientResource>();
+        if(frames.empty() || timeout <= 0 || client->busy()){
+            return false;
+        }
+        return client->call(frames, timeout);
+    }catch(std::exception& e){
+        return false;
+    }
 }
 
-int64_t php_zmq_context_set_opt(const Resource& context, int64_t option, int64_t value)
-{ 
-   try{
-        auto ctx = context.getTyped<ZmqContextResource>()->getContext();
-       return ctx->set_opt(option, value);
-   }catch(std::exception& e){
-       return -1;
-   }
+Variant php_zmq_rpc_poll(const Resource& rpc, int64_t timeout)
+{
+    try{
+        auto client = rpc.getTyped<ZmqRpcClientResource>();
+        if(client->busy()){
+            return false;
+        }
+        return client->poll(timeout);
+    }catch(std::exception& e){
+        return false;
+    }
 }
 
-int64_t php_zmq_socket_connect(const Resource& socket, const String& dsn)
+Variant php_zmq_rpc_stats(const Resource& rpc)
 {
-   try{
-        auto sock = socket.getTyped<ZmqSocketResource>()->getSocket();
-        sock->connect(dsn.c_str());
-        return 0;
-   }catch(std::exception& e){
-       return -1;
-   }
+    return rpc.getTyped<ZmqRpcClientResource>()->stats();
 }
 
-Variant php_zmq_socket_create(const Resource& context, int64_t type)
+int64_t php_zmq_socket_monitor_enable(const Resource& socket, int64_t events)
 {
-    auto ctx = context.getTyped<ZmqContextResource>()->getContext();
+#ifdef ZMQ_EVENT_MONITOR_STOPPED
     try{
-        return NEWOBJ(ZmqSocketResource)(ctx, type);
+        // attaching is setup, it must not settle a pooled socket
+        auto data = socket.getTyped<ZmqSocketResource>()->getDataForSetup();
+        if(zmq_socket_busy(data)){
+            return -1;
+        }
+        if(data->monitor){
+            return 0;
+        }
+        auto monitor = new ZmqSocketMonitor();
+        try{
+            monitor->start(data->sock, events);
+        }catch(std::exception& e){
+            delete monitor;
+            return -1;
+        }
+        data->monitor = monitor;
+        return 0;
     }catch(std::exception& e){
-       return false;
+        return -1;
     }
+#else
+    return -1;
+#endif
 }
 
-int64_t php_zmq_socket_disconnect(const Resource& socket, const String& dsn)
+int64_t php_zmq_socket_monitor_disable(const Resource& socket)
 {
-   try{
-        auto sock = socket.getTyped<ZmqSocketResource>()->getSocket();
-       sock->disconnect(dsn.c_str());
-       return 0;
-   }catch(std::exception& e){
-       return -1;
-   }
+#ifdef ZMQ_EVENT_MONITOR_STOPPED
+    auto data = socket.getTyped<ZmqSocketResource>()->getData();
+    // the monitor's socket is torn down through the monitored one
+    if(zmq_socket_busy(data)){
+        return -1;
+    }
+    if(data->monitor){
+        data->monitor->stop();
+        delete data->monitor;
+        data->monitor = nullptr;
+    }
+    return 0;
+#else
+    return -1;
+#endif
 }
 
-int64_t php_zmq_socket_bind(const Resource& socket, const String& dsn)
+// Drains up to max events (all of them when max <= 0) without blocking.
+Variant php_zmq_socket_monitor_events(const Resource& socket, int64_t max)
 {
-   try{
-    auto sock = socket.getTyped<ZmqSocketResource>()->getSocket();
-       sock->bind(dsn.c_str());
-       return 0;
-   }catch(std::exception& e){
-       return -1;
-   }
+#ifdef ZMQ_EVENT_MONITOR_STOPPED
+    auto data = socket.getTyped<ZmqSocketResource>()->getData();
+    if(!data->monitor){
+        return false;
+    }
+    Array events = Array::Create();
+    ZmqSocketMonitor::Event event;
+    while((max <= 0 || events.size() < max) && data->monitor->pop(event)){
+        Array entry = Array::Create();
+        entry.set(String("event"), event.event);
+        entry.set(String("address"), String(event.address));
+        entry.set(String("time"), event.time_us / 1000000.0);
+        events.append(entry);
+    }
+    return events;
+#else
+    return false;
+#endif
 }
 
-int64_t php_zmq_socket_unbind(const Resource& socket, const String& dsn)
+Variant php_zmq_socket_monitor_counters(const Resource& socket)
 {
-   try{
-    auto sock = socket.getTyped<ZmqSocketResource>()->getSocket();
-       sock->unbind(dsn.c_str());
-       return 0;
-   }catch(std::exception& e){
-       return -1;
-   }
+#ifdef ZMQ_EVENT_MONITOR_STOPPED
+    auto data = socket.getTyped<ZmqSocketResource>()->getData();
+    if(!data->monitor){
+        return false;
+    }
+    Array counters = Array::Create();
+    data->monitor->stats(counters);
+    return counters;
+#else
+    return false;
+#endif
 }
 
-int64_t php_zmq_socket_send(const Resource& socket, const String& message, int64_t flags)
+Array php_zmq_socket_stats(const Resource& socket)
 {
-   try{
-        zmq::message_t msg(message.length());
-        memcpy(msg.data(), message.c_str(), message.length());
-        auto sock = socket.getTyped<ZmqSocketResource>()->getSocket();
-        bool rc = sock->send(msg, flags);
-        return rc ? 0 : -1;
-   }catch(std::exception& e){
-       return -1;
-   }
+    return socket.getTyped<ZmqSocketResource>()->getDataForSetup()->stats.toArray(false);
 }
 
-int64_t php_zmq_socket_recv(const Resource& socket, VRefParam message, int64_t flags)
+Array php_zmq_stats()
 {
-   try{
-        zmq::message_t msg;
-        auto sock = socket.getTyped<ZmqSocketResource>()->getSocket();
-        bool rc = sock->recv(&msg, flags);
-        int size = msg.size();
-        char m[size + 1];
-        memcpy(m, msg.data(), size);
-        m[size] = 0;
-        message = String(m, size + 1, CopyString);
-        return rc ? 0 : -1;
-   }catch(std::exception& e){
-       return -1;
-   }
+    ZmqStats sum;
+    ZmqThreadStats::collect(sum);
+    Array stats = sum.toArray(true);
+    stats.set(String("persistent"), php_zmq_persistent_stats());
+    return stats;
 }
 
 Variant php_zmq_poll_create()
@@ -243,83 +4702,74 @@ Variant php_zmq_poll_create()
     return NEWOBJ(ZmqPollResource);
 }
 
-int64_t php_zmq_poll_add(const Resource& poll, const Resource& socket, const String& id, int64_t type)
+int64_t php_zmq_poll_add(const Resource& poll, const Resource& socket, int64_t type)
 {
     auto pollRes = poll.getTyped<ZmqPollResource>();
-    auto sock = socket.getTyped<ZmqSocketResource>()->getSocket();
-    pollRes->addPollItem(sock, id, type);
-    return 0;
+    auto data = socket.getTyped<ZmqSocketResource>()->getData();
+    return pollRes->addPollItem(data, type);
 }
 
-int64_t php_zmq_poll_poll(const Resource& poll, int64_t timeout, VRefParam readSocketsId, VRefParam writeSocketsId, VRefParam errorSocketsId)
+// Fills ready with slot => bit-mask of ZMQ_POLLIN/ZMQ_POLLOUT/ZMQ_POLLERR for
+// every socket that has events pending.
+int64_t php_zmq_poll_poll(const Resource& poll, int64_t timeout, VRefParam ready)
 {
-    Array r_arr;
-   Array w_arr;
-   Array e_arr;
-
-  if (readSocketsId.isReferenced()) {
-    r_arr = Array::Create();
-  }
-
-  if(writeSocketsId.isReferenced()){
-    w_arr = Array::Create();
-  }
-
-  if(errorSocketsId.isReferenced()){
-    e_arr = Array::Create();
-  }
-
-  SCOPE_EXIT {
-   if (readSocketsId.isReferenced()) readSocketsId = r_arr; 
-   if (writeSocketsId.isReferenced()) writeSocketsId = w_arr; 
-   if (errorSocketsId.isReferenced()) errorSocketsId = e_arr; 
-};
+    Array events = Array::Create();
+    SCOPE_EXIT {
+        ready = events;
+    };
 
     auto pollRes = poll.getTyped<ZmqPollResource>();
-    std::vector<PollItem*> items = pollRes->getPollItems();
-    int size = items.size();
-   
-
-    zmq_pollitem_t *items_t = (zmq_pollitem_t*) malloc(sizeof(struct zmq_pollitem_t) * size);
-
-   int i;
-   for(i = 0; i < items.size(); i++){
-       memset(&items_t[i], 0, sizeof(struct zmq_pollitem_t));
-       items_t[i].socket = *items[i]->getSock();
-       items_t[i].events = items[i]->getType();
-   }
+    zmq_pollitem_t* items = pollRes->getItems();
+    size_t size = pollRes->size();
 
    try{
-       int rc = zmq::poll(items_t, items.size(), timeout);
-       if (rc > 0) {
-           for (i = 0; i < items.size(); i++) {
-               if (items_t[i].revents & ZMQ_POLLIN) {
-                   r_arr.append(items[i]->getId());
-               }
+       // batches go out before waiting, and the rest of a received batch is
+       // readable without asking libzmq
+       bool buffered = false;
+       for (size_t i = 0; i < size; i++) {
+           if (zmq_socket_busy(pollRes->getOwner(i))) {
+               return -1;
+           }
+       }
+       for (size_t i = 0; i < size; i++) {
+           ZmqSocketData* data = pollRes->getOwner(i);
+           if (data->coalescer) {
+               zmq_coalescer_flush(data, ZMQ_DONTWAIT);
+           }
+           buffered = buffered || ((items[i].events & ZMQ_POLLIN) && data->unbatcher.pending());
+       }
 
-               if (items_t[i].revents & ZMQ_POLLOUT) {
-                   w_arr.append(items[i]->getId());
+       uint64_t start = zmq_now_us();
+       int rc = zmq::poll(items, size, buffered ? 0 : timeout);
+       ZmqThreadStats::local().poll_wait.record(zmq_now_us() - start);
+       if (buffered) {
+           rc = 0;
+           for (size_t i = 0; i < size; i++) {
+               if ((items[i].events & ZMQ_POLLIN) && pollRes->getOwner(i)->unbatcher.pending()) {
+                   items[i].revents |= ZMQ_POLLIN;
                }
-
-               if (items_t[i].revents & ZMQ_POLLERR) {
-                   e_arr.append(items[i]->getId());
+               rc += items[i].revents != 0;
+           }
+       }
+       if (rc > 0) {
+           for (size_t i = 0; i < size; i++) {
+               if (items[i].revents != 0) {
+                   events.set(pollRes->getSlot(i), items[i].revents);
                }
            }
        }
-       free(items_t);
 
        return rc;
    }catch(std::exception& e){
-    printf("%s\n", e.what());
        return -1;
    }
 }
 
-int64_t php_zmq_poll_remove(const Resource& poll, const String& id)
+int64_t php_zmq_poll_remove(const Resource& poll, const Resource& socket)
 {
     auto pollRes = poll.getTyped<ZmqPollResource>();
-    pollRes->removePollItem(id);
-    return 0;
+    auto sock = socket.getTyped<ZmqSocketResource>()->getDataForSetup()->sock;
+    return pollRes->removePollItem(sock);
 }
 
 int64_t php_zmq_poll_clear(const Resource& poll)
@@ -329,433 +4779,217 @@ int64_t php_zmq_poll_clear(const Resource& poll)
     return 0;
 }
 
-int64_t php_zmq_socket_set_opt(const Resource& socket, int64_t key, const Variant& value)
+// Socket options the extension knows, with the type libzmq expects for
+// them. Options that libzmq does not have are left out at compile time.
+enum ZmqSockOptType {
+    kZmqOptInt,
+    kZmqOptInt64,
+    kZmqOptUint64,
+    kZmqOptString,
+};
+
+enum ZmqSockOptAccess {
+    kZmqOptRead = 1,
+    kZmqOptWrite = 2,
+    kZmqOptReadWrite = 3,
+};
+
+struct ZmqSockOpt {
+    int key;
+    ZmqSockOptType type;
+    int access;
+};
+
+static const ZmqSockOpt kZmqSockOpts[] = {
+    { ZMQ_AFFINITY, kZmqOptUint64, kZmqOptReadWrite },
+    { ZMQ_IDENTITY, kZmqOptString, kZmqOptReadWrite },
+    { ZMQ_SUBSCRIBE, kZmqOptString, kZmqOptWrite },
+    { ZMQ_UNSUBSCRIBE, kZmqOptString, kZmqOptWrite },
+    { ZMQ_RATE, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_RECOVERY_IVL, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_SNDBUF, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_RCVBUF, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_RCVMORE, kZmqOptInt, kZmqOptRead },
+    { ZMQ_LINGER, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_RECONNECT_IVL, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_BACKLOG, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_RECONNECT_IVL_MAX, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_MAXMSGSIZE, kZmqOptInt64, kZmqOptReadWrite },
+    { ZMQ_SNDHWM, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_RCVHWM, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_MULTICAST_HOPS, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_RCVTIMEO, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_SNDTIMEO, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_IPV4ONLY, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_ROUTER_MANDATORY, kZmqOptInt, kZmqOptWrite },
+    { ZMQ_TCP_KEEPALIVE, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_TCP_KEEPALIVE_CNT, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_TCP_KEEPALIVE_IDLE, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_TCP_KEEPALIVE_INTVL, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_TCP_ACCEPT_FILTER, kZmqOptString, kZmqOptWrite },
+    // ZMQ_IMMEDIATE in libzmq 4
+    { ZMQ_DELAY_ATTACH_ON_CONNECT, kZmqOptInt, kZmqOptReadWrite },
+    { ZMQ_XPUB_VERBOSE, kZmqOptInt, kZmqOptWrite },
+#ifdef ZMQ_CONFLATE
+    { ZMQ_CONFLATE, kZmqOptInt, kZmqOptWrite },
+#endif
+#ifdef ZMQ_ROUTER_HANDOVER
+    { ZMQ_ROUTER_HANDOVER, kZmqOptInt, kZmqOptWrite },
+#endif
+#ifdef ZMQ_HEARTBEAT_IVL
+    { ZMQ_HEARTBEAT_IVL, kZmqOptInt, kZmqOptWrite },
+    { ZMQ_HEARTBEAT_TTL, kZmqOptInt, kZmqOptWrite },
+    { ZMQ_HEARTBEAT_TIMEOUT, kZmqOptInt, kZmqOptWrite },
+#endif
+#ifdef ZMQ_TCP_MAXRT
+    { ZMQ_TCP_MAXRT, kZmqOptInt, kZmqOptReadWrite },
+#endif
+};
+
+// the descriptor of the option, nullptr if it cannot be used that way
+static const ZmqSockOpt* zmq_find_sockopt(int64_t key, int access)
 {
-    try{
-        auto sock = socket.getTyped<ZmqSocketResource>()->getSocket();
+    for(auto& opt : kZmqSockOpts){
+        if(opt.key == key){
+            return (opt.access & access) ? &opt : nullptr;
+        }
+    }
+    return nullptr;
+}
 
-        switch(key){
-            case ZMQ_SNDHWM:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_SNDHWM, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_RCVHWM:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_RCVHWM, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_AFFINITY:
-            {
-                uint64_t v = value.toInt64();
-                sock->setsockopt(ZMQ_AFFINITY, &v, sizeof(uint64_t));
-                }
-            break;
-            case ZMQ_SUBSCRIBE:
-            {
-                String v = value.toString();
-                sock->setsockopt(ZMQ_SUBSCRIBE, v.c_str(), v.length());
-                }
-            break;
-            case ZMQ_UNSUBSCRIBE:
-            {
-                String v = value.toString();
-                sock->setsockopt(ZMQ_UNSUBSCRIBE, v.c_str(), v.length());
-                }
-            break;
-            case ZMQ_IDENTITY:
-            {
-                String v = value.toString();
-                sock->setsockopt(ZMQ_IDENTITY, v.c_str(), v.length());
-                }
-            break;
-            case ZMQ_RATE:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_RATE, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_RECOVERY_IVL:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_RECOVERY_IVL, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_SNDBUF:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_SNDBUF, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_RCVBUF:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_RCVBUF, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_LINGER:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_LINGER, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_RECONNECT_IVL:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_RECONNECT_IVL, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_RECONNECT_IVL_MAX:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_RECONNECT_IVL_MAX, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_BACKLOG:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_BACKLOG, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_MAXMSGSIZE:
-            {
-                int64_t v = value.toInt64();
-                sock->setsockopt(ZMQ_MAXMSGSIZE, &v, sizeof(int64_t));
-                }
-            break;
-            case ZMQ_MULTICAST_HOPS:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_MULTICAST_HOPS, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_RCVTIMEO:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_RCVTIMEO, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_SNDTIMEO:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_SNDTIMEO, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_IPV4ONLY:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_IPV4ONLY, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_DELAY_ATTACH_ON_CONNECT:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_DELAY_ATTACH_ON_CONNECT, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_ROUTER_MANDATORY:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_ROUTER_MANDATORY, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_XPUB_VERBOSE:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_XPUB_VERBOSE, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_TCP_KEEPALIVE:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_TCP_KEEPALIVE, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_TCP_KEEPALIVE_IDLE:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_TCP_KEEPALIVE_IDLE, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_TCP_KEEPALIVE_CNT:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_TCP_KEEPALIVE_CNT, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_TCP_KEEPALIVE_INTVL:
-            {
-                int v = value.toInt32();
-                sock->setsockopt(ZMQ_TCP_KEEPALIVE_INTVL, &v, sizeof(int));
-                }
-            break;
-            case ZMQ_TCP_ACCEPT_FILTER:
-            {
-                String v = value.toString();
-                sock->setsockopt(ZMQ_TCP_ACCEPT_FILTER, v.c_str(), v.length());
-                }
-            break;
-            case ZMQ_RCVMORE:
-            {
-                int64_t v = value.toInt64();
-                sock->setsockopt(ZMQ_RCVMORE, &v, sizeof(int64_t));
-            }
-            break;
-            default:
-                break;
+// the value as the bytes libzmq expects for the option
+static std::string zmq_sockopt_value(const ZmqSockOpt& opt, const Variant& value)
+{
+    switch(opt.type){
+        case kZmqOptInt:
+        {
+            int v = value.toInt32();
+            return std::string(reinterpret_cast<const char*>(&v), sizeof(int));
         }
-           
-           return 0;
-       }catch(std::exception& e){
-           return -1;
-       }
+        case kZmqOptInt64:
+        {
+            int64_t v = value.toInt64();
+            return std::string(reinterpret_cast<const char*>(&v), sizeof(int64_t));
+        }
+        case kZmqOptUint64:
+        {
+            uint64_t v = value.toInt64();
+            return std::string(reinterpret_cast<const char*>(&v), sizeof(uint64_t));
+        }
+        case kZmqOptString:
+            return value.toString().toCppString();
+    }
+    return std::string();
 }
 
-Variant php_zmq_socket_get_opt(const Resource& socket, int64_t key)
+static void zmq_set_sockopt(ZmqSocketResource* res, const ZmqSockOpt& opt, const Variant& value)
 {
-    try{
-        auto sock = socket.getTyped<ZmqSocketResource>()->getSocket();
+    res->setOption(opt.key, zmq_sockopt_value(opt, value), opt.access & kZmqOptRead);
+}
 
-        switch(key){
-            case ZMQ_SNDHWM:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_SNDHWM, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_RCVHWM:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_RCVHWM, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_AFFINITY:
-            {
-                uint64_t v;
-                size_t size = sizeof(uint64_t);
-                sock->getsockopt(ZMQ_AFFINITY, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_SUBSCRIBE:
-            {
-                char v[255];
-                size_t size = 255;
-                sock->getsockopt(ZMQ_SUBSCRIBE, v, &size);
-                return String(v, size, CopyString);
-                }
-            break;
-            case ZMQ_UNSUBSCRIBE:
-            {
-                char v[255];
-                size_t size = 255;
-                sock->getsockopt(ZMQ_UNSUBSCRIBE, v, &size);
-                return String(v, size, CopyString);
-                }
-            break;
-            case ZMQ_IDENTITY:
-            {
-                char v[255];
-                size_t size = 255;
-                sock->getsockopt(ZMQ_IDENTITY, v, &size);
-                return String(v, size, CopyString);
-                }
-            break;
-            case ZMQ_RATE:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_RATE, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_RECOVERY_IVL:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_RECOVERY_IVL, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_SNDBUF:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_SNDBUF, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_RCVBUF:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_RCVBUF, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_LINGER:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_LINGER, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_RECONNECT_IVL:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_RECONNECT_IVL, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_RECONNECT_IVL_MAX:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_RECONNECT_IVL_MAX, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_BACKLOG:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_BACKLOG, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_MAXMSGSIZE:
-            {
-                int64_t v;
-                size_t size = sizeof(int64_t);
-                sock->getsockopt(ZMQ_MAXMSGSIZE, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_MULTICAST_HOPS:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_MULTICAST_HOPS, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_RCVTIMEO:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_RCVTIMEO, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_SNDTIMEO:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_SNDTIMEO, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_IPV4ONLY:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_IPV4ONLY, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_DELAY_ATTACH_ON_CONNECT:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_DELAY_ATTACH_ON_CONNECT, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_ROUTER_MANDATORY:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_ROUTER_MANDATORY, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_XPUB_VERBOSE:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_XPUB_VERBOSE, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_TCP_KEEPALIVE:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_TCP_KEEPALIVE, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_TCP_KEEPALIVE_IDLE:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_TCP_KEEPALIVE_IDLE, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_TCP_KEEPALIVE_CNT:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_TCP_KEEPALIVE_CNT, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_TCP_KEEPALIVE_INTVL:
-            {
-                int v;
-                size_t size = sizeof(int);
-                sock->getsockopt(ZMQ_TCP_KEEPALIVE_INTVL, &v, &size);
-                return v;
-                }
-            break;
-            case ZMQ_TCP_ACCEPT_FILTER:
-            {
-                char v[255];
-                size_t size = 255;
-                sock->getsockopt(ZMQ_TCP_ACCEPT_FILTER, v, &size);
-                return String(v, size, CopyString);
-                }
-            break;
-            case ZMQ_RCVMORE:
-            {
-                int64_t v;
-                size_t size = sizeof(int64_t);
-                sock->getsockopt(ZMQ_RCVMORE, &v, &size);
-                return v;
-            }
-            break;
-            default:
-                return 0;
-                break;
+static Variant zmq_get_sockopt(zmq::socket_t* sock, const ZmqSockOpt& opt)
+{
+    switch(opt.type){
+        case kZmqOptInt:
+        {
+            int v = 0;
+            size_t size = sizeof(int);
+            sock->getsockopt(opt.key, &v, &size);
+            return v;
+        }
+        case kZmqOptInt64:
+        {
+            int64_t v = 0;
+            size_t size = sizeof(int64_t);
+            sock->getsockopt(opt.key, &v, &size);
+            return v;
+        }
+        case kZmqOptUint64:
+        {
+            uint64_t v = 0;
+            size_t size = sizeof(uint64_t);
+            sock->getsockopt(opt.key, &v, &size);
+            return v;
+        }
+        case kZmqOptString:
+        {
+            char v[255];
+            size_t size = sizeof(v);
+            sock->getsockopt(opt.key, v, &size);
+            return String(v, size, CopyString);
+        }
+    }
+    return false;
+}
+
+int64_t php_zmq_socket_set_opt(const Resource& socket, int64_t key, const Variant& value)
+{
+    try{
+        auto res = socket.getTyped<ZmqSocketResource>();
+        auto opt = zmq_find_sockopt(key, kZmqOptWrite);
+        if(opt == nullptr || zmq_socket_busy(res->getDataForSetup())){
+            return -1;
+        }
+        zmq_set_sockopt(res, *opt, value);
+        return 0;
+    }catch(std::exception& e){
+        return -1;
+    }
+}
+
+// Applies key => value options in one call. Every key is checked before
+// anything is set; on failure the offending key is stored in failed.
+int64_t php_zmq_socket_set_opts(const Resource& socket, const Array& options, VRefParam failed)
+{
+    auto res = socket.getTyped<ZmqSocketResource>();
+    std::vector<std::pair<const ZmqSockOpt*, Variant>> opts;
+    opts.reserve(options.size());
+    for(ArrayIter iter(options); iter; ++iter){
+        Variant key = iter.first();
+        auto opt = key.isInteger() ? zmq_find_sockopt(key.toInt64(), kZmqOptWrite) : nullptr;
+        if(opt == nullptr){
+            failed = key;
+            return -1;
         }
-       }catch(std::exception& e){
-           return -1;
-       }
-       return 0;
+        opts.push_back(std::make_pair(opt, iter.second()));
+    }
+    if(!opts.empty() && zmq_socket_busy(res->getDataForSetup())){
+        failed = (int64_t)opts[0].first->key;
+        return -1;
+    }
+    for(auto& opt : opts){
+        try{
+            zmq_set_sockopt(res, *opt.first, opt.second);
+        }catch(std::exception& e){
+            failed = (int64_t)opt.first->key;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+Variant php_zmq_socket_get_opt(const Resource& socket, int64_t key)
+{
+    try{
+        auto data = socket.getTyped<ZmqSocketResource>()->getDataForSetup();
+        auto opt = zmq_find_sockopt(key, kZmqOptRead);
+        if(opt == nullptr || zmq_socket_busy(data)){
+            return false;
+        }
+        return zmq_get_sockopt(data->sock, *opt);
+    }catch(std::exception& e){
+        return -1;
+    }
+}
+
+static Variant HHVM_FUNCTION(zmq_context_create, int64_t io_threads, bool is_persistent, int64_t max_sockets, const Array& options)
+{
+    return php_zmq_context_create(io_threads, is_persistent, max_sockets, options);
 }
 
-static Variant HHVM_FUNCTION(zmq_context_create, int64_t io_threads)
+static Array HHVM_FUNCTION(zmq_persistent_stats)
 {
-    return php_zmq_context_create(io_threads);
+    return php_zmq_persistent_stats();
 }
 
 static int64_t HHVM_FUNCTION(zmq_context_get_opt, const Resource& context, int64_t option)
@@ -773,9 +5007,19 @@ static int64_t HHVM_FUNCTION(zmq_socket_connect, const Resource& socket, const S
    return php_zmq_socket_connect(socket, dsn);
 }
 
-static Variant HHVM_FUNCTION(zmq_socket_create, const Resource& context, int64_t type)
+static Variant HHVM_FUNCTION(zmq_socket_create, const Resource& context, int64_t type, const String& persistent_id)
+{
+   return php_zmq_socket_create(context, type, persistent_id);
+}
+
+static bool HHVM_FUNCTION(zmq_socket_is_reused, const Resource& socket)
+{
+   return php_zmq_socket_is_reused(socket);
+}
+
+static Array HHVM_FUNCTION(zmq_socket_get_endpoints, const Resource& socket)
 {
-   return php_zmq_socket_create(context, type);
+   return php_zmq_socket_get_endpoints(socket);
 }
 
 static int64_t HHVM_FUNCTION(zmq_socket_disconnect, const Resource& socket, const String& dsn)
@@ -803,24 +5047,214 @@ static int64_t HHVM_FUNCTION(zmq_socket_recv, const Resource& socket, VRefParam
    return php_zmq_socket_recv(socket, message, flags);
 }
 
+static int64_t HHVM_FUNCTION(zmq_socket_send_multi, const Resource& socket, const Array& message, int64_t flags)
+{
+   return php_zmq_socket_send_multi(socket, message, flags);
+}
+
+static int64_t HHVM_FUNCTION(zmq_socket_send_batch, const Resource& socket, const Array& messages, int64_t flags)
+{
+   return php_zmq_socket_send_batch(socket, messages, flags);
+}
+
+static int64_t HHVM_FUNCTION(zmq_socket_coalesce, const Resource& socket, int64_t max_bytes, int64_t interval_us)
+{
+   return php_zmq_socket_coalesce(socket, max_bytes, interval_us);
+}
+
+static int64_t HHVM_FUNCTION(zmq_socket_shm, const Resource& socket, int64_t threshold, int64_t ttl)
+{
+   return php_zmq_socket_shm(socket, threshold, ttl);
+}
+
+static int64_t HHVM_FUNCTION(zmq_socket_compress, const Resource& socket, int64_t threshold, int64_t acceleration)
+{
+   return php_zmq_socket_compress(socket, threshold, acceleration);
+}
+
+static int64_t HHVM_FUNCTION(zmq_socket_decode, const Resource& socket, int64_t envelopes)
+{
+   return php_zmq_socket_decode(socket, envelopes);
+}
+
+static int64_t HHVM_FUNCTION(zmq_socket_flush, const Resource& socket, int64_t flags)
+{
+   return php_zmq_socket_flush(socket, flags);
+}
+
+static int64_t HHVM_FUNCTION(zmq_socket_send_queue_enable, const Resource& socket, int64_t capacity, int64_t overflow)
+{
+   return php_zmq_socket_send_queue_enable(socket, capacity, overflow);
+}
+
+static int64_t HHVM_FUNCTION(zmq_socket_send_queue_disable, const Resource& socket)
+{
+   return php_zmq_socket_send_queue_disable(socket);
+}
+
+static Variant HHVM_FUNCTION(zmq_socket_send_queue_stats, const Resource& socket)
+{
+   return php_zmq_socket_send_queue_stats(socket);
+}
+
+static int64_t HHVM_FUNCTION(zmq_socket_send_array, const Resource& socket, const Array& value, int64_t flags)
+{
+   return php_zmq_socket_send_array(socket, value, flags);
+}
+
+static Variant HHVM_FUNCTION(zmq_socket_recv_array, const Resource& socket, int64_t flags)
+{
+   return php_zmq_socket_recv_array(socket, flags);
+}
+
+static int64_t HHVM_FUNCTION(zmq_socket_subscribe, const Resource& socket, const String& prefix)
+{
+   return php_zmq_socket_subscribe(socket, prefix);
+}
+
+static int64_t HHVM_FUNCTION(zmq_socket_unsubscribe, const Resource& socket, const String& prefix)
+{
+   return php_zmq_socket_unsubscribe(socket, prefix);
+}
+
+static Variant HHVM_FUNCTION(zmq_socket_subscriptions, const Resource& socket)
+{
+   return php_zmq_socket_subscriptions(socket);
+}
+
+static Variant HHVM_FUNCTION(zmq_socket_recv_tagged, const Resource& socket, int64_t max, int64_t timeout)
+{
+   return php_zmq_socket_recv_tagged(socket, max, timeout);
+}
+
+static Variant HHVM_FUNCTION(zmq_socket_recv_multi, const Resource& socket, int64_t flags)
+{
+   return php_zmq_socket_recv_multi(socket, flags);
+}
+
+static Variant HHVM_FUNCTION(zmq_socket_recv_batch, const Resource& socket, int64_t max, int64_t timeout)
+{
+   return php_zmq_socket_recv_batch(socket, max, timeout);
+}
+
+static Object HHVM_FUNCTION(zmq_socket_recv_async, const Resource& socket, int64_t timeout)
+{
+   return php_zmq_socket_recv_async(socket, timeout);
+}
+
+static Object HHVM_FUNCTION(zmq_socket_send_async, const Resource& socket, const String& message, int64_t timeout)
+{
+   return php_zmq_socket_send_async(socket, message, timeout);
+}
+
+static Variant HHVM_FUNCTION(zmq_device_create, const Resource& frontend, const Resource& backend, const Variant& capture)
+{
+    return php_zmq_device_create(frontend, backend, capture);
+}
+
+static int64_t HHVM_FUNCTION(zmq_device_start, const Resource& device)
+{
+    return php_zmq_device_start(device);
+}
+
+static int64_t HHVM_FUNCTION(zmq_device_command, const Resource& device, const String& command)
+{
+    return php_zmq_device_command(device, command);
+}
+
+static Variant HHVM_FUNCTION(zmq_device_statistics, const Resource& device)
+{
+    return php_zmq_device_statistics(device);
+}
+
+static Variant HHVM_FUNCTION(zmq_broker_create, const Resource& frontend, const Resource& backend, int64_t max_queue)
+{
+    return php_zmq_broker_create(frontend, backend, max_queue);
+}
+
+static int64_t HHVM_FUNCTION(zmq_broker_start, const Resource& broker)
+{
+    return php_zmq_broker_start(broker);
+}
+
+static int64_t HHVM_FUNCTION(zmq_broker_stop, const Resource& broker)
+{
+    return php_zmq_broker_stop(broker);
+}
+
+static Variant HHVM_FUNCTION(zmq_broker_stats, const Resource& broker)
+{
+    return php_zmq_broker_stats(broker);
+}
+
+static Variant HHVM_FUNCTION(zmq_rpc_create, const Resource& socket, const Array& endpoints, int64_t attempt_timeout, int64_t retries, bool failover, int64_t failover_after)
+{
+    return php_zmq_rpc_create(socket, endpoints, attempt_timeout, retries, failover, failover_after);
+}
+
+static Variant HHVM_FUNCTION(zmq_rpc_call, const Resource& rpc, const Variant& request, int64_t timeout)
+{
+    return php_zmq_rpc_call(rpc, request, timeout);
+}
+
+static Variant HHVM_FUNCTION(zmq_rpc_poll, const Resource& rpc, int64_t timeout)
+{
+    return php_zmq_rpc_poll(rpc, timeout);
+}
+
+static Variant HHVM_FUNCTION(zmq_rpc_stats, const Resource& rpc)
+{
+    return php_zmq_rpc_stats(rpc);
+}
+
+static int64_t HHVM_FUNCTION(zmq_socket_monitor_enable, const Resource& socket, int64_t events)
+{
+    return php_zmq_socket_monitor_enable(socket, events);
+}
+
+static int64_t HHVM_FUNCTION(zmq_socket_monitor_disable, const Resource& socket)
+{
+    return php_zmq_socket_monitor_disable(socket);
+}
+
+static Variant HHVM_FUNCTION(zmq_socket_monitor_events, const Resource& socket, int64_t max)
+{
+    return php_zmq_socket_monitor_events(socket, max);
+}
+
+static Variant HHVM_FUNCTION(zmq_socket_monitor_counters, const Resource& socket)
+{
+    return php_zmq_socket_monitor_counters(socket);
+}
+
+static Array HHVM_FUNCTION(zmq_socket_stats, const Resource& socket)
+{
+    return php_zmq_socket_stats(socket);
+}
+
+static Array HHVM_FUNCTION(zmq_stats)
+{
+    return php_zmq_stats();
+}
+
 static Variant HHVM_FUNCTION(zmq_poll_create)
 {
     return php_zmq_poll_create();
 }
 
-static int64_t HHVM_FUNCTION(zmq_poll_add, const Resource& poll, const Resource& socket, const String& id, int64_t type)
+static int64_t HHVM_FUNCTION(zmq_poll_add, const Resource& poll, const Resource& socket, int64_t type)
 {
-    return php_zmq_poll_add(poll, socket, id, type);
+    return php_zmq_poll_add(poll, socket, type);
 }
 
-static int64_t HHVM_FUNCTION(zmq_poll_poll, const Resource& poll, int64_t timeout, VRefParam readSocketsId, VRefParam writeSocketsId, VRefParam errorSocketsId)
+static int64_t HHVM_FUNCTION(zmq_poll_poll, const Resource& poll, int64_t timeout, VRefParam ready)
 {
-   return php_zmq_poll_poll(poll, timeout, readSocketsId, writeSocketsId, errorSocketsId);
+   return php_zmq_poll_poll(poll, timeout, ready);
 }
 
-static int64_t HHVM_FUNCTION(zmq_poll_remove, const Resource& poll, const String& id)
+static int64_t HHVM_FUNCTION(zmq_poll_remove, const Resource& poll, const Resource& socket)
 {
-    return php_zmq_poll_remove(poll, id);
+    return php_zmq_poll_remove(poll, socket);
 }
 
 static int64_t HHVM_FUNCTION(zmq_poll_clear, const Resource& poll)
@@ -833,11 +5267,398 @@ static int64_t HHVM_FUNCTION(zmq_socket_set_opt, const Resource& socket, int64_t
     return php_zmq_socket_set_opt(socket, key, value);
 }
 
+static int64_t HHVM_FUNCTION(zmq_socket_set_opts, const Resource& socket, const Array& options, VRefParam failed)
+{
+    return php_zmq_socket_set_opts(socket, options, failed);
+}
+
 static Variant HHVM_FUNCTION(zmq_socket_get_opt, const Resource& socket, int64_t key)
 {
     return php_zmq_socket_get_opt(socket, key);
 }
 
+// Server mode: with Server.Type = zmq the page server is a ROUTER socket
+// bound to tcp://Server.IP:Server.Port instead of an HTTP listener. A
+// gateway sends [envelope...][""][method][url][headers][body], where the
+// headers frame holds "Name: value\r\n" lines and trailing frames may be
+// left out; the reply is [envelope...][""][status][headers][body].
+//
+// One native thread owns the ROUTER socket. Requests become transports that
+// the job queue hands to HHVM's request worker threads, as FastCGI does;
+// workers push their replies over inproc back to that thread, which is the
+// only one writing to the ROUTER. When the job queue is full the ROUTER is
+// not read, so the gateway sees backpressure through its high water mark.
+class ZmqServerTransport : public Transport {
+public:
+    ZmqServerTransport(std::vector<std::string>&& envelope, std::vector<std::string>&& request)
+        : envelope(std::move(envelope)), method(Method::Unknown), code(500), replied(false),
+          push(nullptr) {
+        clock_gettime(CLOCK_MONOTONIC, &queued);
+        if(request.size() > 0){
+            extended_method = request[0];
+            if(request[0] == "GET"){
+                method = Method::GET;
+            }else if(request[0] == "POST"){
+                method = Method::POST;
+            }else if(request[0] == "HEAD"){
+                method = Method::HEAD;
+            }
+        }
+        url = request.size() > 1 && !request[1].empty() ? request[1] : "/";
+        if(request.size() > 2){
+            parseHeaders(request[2]);
+        }
+        if(request.size() > 3){
+            body.swap(request[3]);
+        }
+    }
+
+    const timespec& getQueueTime() const { return queued; }
+    bool hasReplied() const { return replied; }
+    void setReplySocket(zmq::socket_t* sock) { push = sock; }
+
+    virtual const char* getUrl() { return url.c_str(); }
+    // the peer of a ROUTER socket is the gateway, not the client
+    virtual const char* getRemoteHost() { return ""; }
+    virtual uint16_t getRemotePort() { return 0; }
+
+    virtual const void* getPostData(int& size){
+        size = body.size();
+        return body.data();
+    }
+
+    virtual Method getMethod() { return method; }
+    virtual const char* getExtendedMethod() { return extended_method.c_str(); }
+
+    virtual std::string getHeader(const char* name){
+        auto it = headers.find(lower(name));
+        return it == headers.end() || it->second.empty() ? std::string() : it->second.front();
+    }
+
+    virtual void getHeaders(HeaderMap& out){
+        for(auto& header : headers){
+            out[header.first] = header.second;
+        }
+    }
+
+    virtual void addHeaderImpl(const char* name, const char* value){
+        reply_headers.push_back(std::make_pair(std::string(name), std::string(value)));
+    }
+
+    virtual void removeHeaderImpl(const char* name){
+        std::string key = lower(name);
+        reply_headers.erase(std::remove_if(reply_headers.begin(), reply_headers.end(),
+            [&](const std::pair<std::string, std::string>& h){ return lower(h.first) == key; }),
+            reply_headers.end());
+    }
+
+    // chunks are collected, the reply leaves as one message at the end
+    virtual void sendImpl(const void* data, int size, int code, bool chunked, bool eom){
+        this->code = code;
+        reply_body.append(static_cast<const char*>(data), size);
+    }
+
+    virtual void onSendEndImpl(){
+        if(replied || push == nullptr){
+            return;
+        }
+        replied = true;
+        std::string head;
+        for(auto& header : reply_headers){
+            head.append(header.first).append(": ").append(header.second).append("\r\n");
+        }
+        char status[16];
+        snprintf(status, sizeof(status), "%d", code);
+
+        for(auto& frame : envelope){
+            push->send(frame.data(), frame.size(), ZMQ_SNDMORE);
+        }
+        push->send(status, strlen(status), ZMQ_SNDMORE);
+        push->send(head.data(), head.size(), ZMQ_SNDMORE);
+        push->send(reply_body.data(), reply_body.size(), 0);
+    }
+
+private:
+    static std::string lower(const char* s){
+        std::string out(s);
+        std::transform(out.begin(), out.end(), out.begin(), ::tolower);
+        return out;
+    }
+    static std::string lower(const std::string& s) { return lower(s.c_str()); }
+
+    void parseHeaders(const std::string& block){
+        size_t pos = 0;
+        while(pos < block.size()){
+            size_t end = block.find('\n', pos);
+            if(end == std::string::npos){
+                end = block.size();
+            }
+            size_t colon = block.find(':', pos);
+            if(colon != std::string::npos && colon < end){
+                size_t value = block.find_first_not_of(' ', colon + 1);
+                size_t stop = end > pos && block[end - 1] == '\r' ? end - 1 : end;
+                headers[lower(block.substr(pos, colon - pos))].push_back(
+                    value < stop ? block.substr(value, stop - value) : std::string());
+            }
+            pos = end + 1;
+        }
+    }
+
+    std::vector<std::string> envelope;  // up to and including the delimiter
+    Method method;
+    std::string extended_method;
+    std::string url;
+    std::string body;
+    HeaderMap headers;  // lower case names
+    std::vector<std::pair<std::string, std::string>> reply_headers;
+    std::string reply_body;
+    int code;
+    bool replied;
+    zmq::socket_t* push;
+    timespec queued;
+};
+
+class ZmqServerWorker
+    : public JobQueueWorker<ZmqServerTransport*, Server*, true, false, JobQueueDropVMStack> {
+public:
+    virtual void onThreadEnter();
+    virtual void doJob(ZmqServerTransport* job);
+    virtual void onThreadExit();
+
+private:
+    std::unique_ptr<RequestHandler> handler;
+    zmq::socket_t* push = nullptr;
+};
+
+class ZmqServer : public Server {
+public:
+    // requests waiting for a worker, per worker thread, before the ROUTER
+    // stops being read
+    static const int kQueuePerThread = 4;
+
+    explicit ZmqServer(const ServerOptions& options)
+        : Server(options.m_address, options.m_port, options.m_numThreads),
+          ctx(1), threads(options.m_numThreads), accepting(false), stopped_accepting(false),
+          dispatcher(options.m_numThreads, RuntimeOption::ServerThreadRoundRobin,
+                     RuntimeOption::ServerThreadDropCacheTimeoutSeconds,
+                     RuntimeOption::ServerThreadDropStack, this,
+                     RuntimeOption::ServerThreadJobLIFOSwitchThreshold,
+                     RuntimeOption::ServerThreadJobMaxQueuingMilliSeconds) {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "tcp://%s:%d",
+                 options.m_address.empty() ? "*" : options.m_address.c_str(), options.m_port);
+        endpoint = buf;
+        snprintf(buf, sizeof(buf), "inproc://hhvm-zmq-server-%p", (void*)this);
+        replies_endpoint = buf;
+    }
+
+    zmq::context_t& getContext() { return ctx; }
+    const std::string& getRepliesEndpoint() const { return replies_endpoint; }
+
+    virtual void addWorkers(int count){
+        threads += count;
+        dispatcher.addWorkers(count);
+    }
+
+    virtual void start(){
+        router.reset(new zmq::socket_t(ctx, ZMQ_ROUTER));
+        replies.reset(new zmq::socket_t(ctx, ZMQ_PULL));
+        router->bind(endpoint.c_str());
+        replies->bind(replies_endpoint.c_str());
+        stopped_accepting = false;
+        accepting.store(true, std::memory_order_release);
+        dispatcher.start();
+        setStatus(RunStatus::RUNNING);
+        thread = std::thread(&ZmqServer::run, this);
+    }
+
+    virtual void waitForEnd(){
+        if(thread.joinable()){
+            thread.join();
+        }
+    }
+
+    // Stops reading requests, lets the workers finish the queued ones and
+    // sends their replies before the socket thread exits. The dispatcher is
+    // only stopped once the socket thread no longer enqueues jobs.
+    virtual void stop(){
+        if(getStatus() != RunStatus::RUNNING){
+            return;
+        }
+        setStatus(RunStatus::STOPPING);
+        zmq::socket_t control(ctx, ZMQ_PUSH);
+        control.connect(replies_endpoint.c_str());
+
+        accepting.store(false, std::memory_order_release);
+        control.send("w", 1);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this]{ return stopped_accepting; });
+        }
+        dispatcher.stop();
+
+        control.send("", 0);
+        waitForEnd();
+        control.close();
+        setStatus(RunStatus::STOPPED);
+    }
+
+    virtual int getActiveWorker() { return dispatcher.getActiveWorker(); }
+    virtual int getQueuedJobs() { return dispatcher.getQueuedJobs(); }
+    virtual int getLibEventConnectionCount() { return 0; }
+    virtual bool enableSSL(int port) { return false; }
+
+private:
+    void run(){
+        zmq_pollitem_t items[2];
+        memset(items, 0, sizeof(items));
+        items[0].socket = *replies;
+        items[0].events = ZMQ_POLLIN;
+        items[1].socket = *router;
+        items[1].events = ZMQ_POLLIN;
+
+        try{
+            while(true){
+                if(!accepting.load(std::memory_order_acquire)){
+                    stopAccepting();
+                }
+                bool accept = accepting.load(std::memory_order_acquire) &&
+                              dispatcher.getQueuedJobs() < threads * kQueuePerThread;
+                // a full queue is looked at again every 10ms
+                zmq::poll(items, accept ? 2 : 1, accept ? -1 : 10);
+                if((items[0].revents & ZMQ_POLLIN) && !forwardReplies()){
+                    break;
+                }
+                if(accept && (items[1].revents & ZMQ_POLLIN)){
+                    while(dispatcher.getQueuedJobs() < threads * kQueuePerThread && acceptRequest()){}
+                }
+            }
+        }catch(std::exception& e){
+            // terminated with the context
+        }
+        stopAccepting();
+        router.reset();
+        replies.reset();
+    }
+
+    // tells stop() that no more jobs will be enqueued
+    void stopAccepting(){
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!stopped_accepting){
+            stopped_accepting = true;
+            cond.notify_all();
+        }
+    }
+
+    // Replies have at least an envelope, a delimiter and a body, so a
+    // single frame comes from stop(): an empty one ends the loop, anything
+    // else only wakes it up. False once the stop message comes, after the
+    // replies queued with it.
+    bool forwardReplies(){
+        zmq::message_t msg;
+        while(replies->recv(&msg, ZMQ_DONTWAIT)){
+            if(!msg.more()){
+                if(msg.size() > 0){
+                    continue;
+                }
+                while(replies->recv(&msg, ZMQ_DONTWAIT)){
+                    forwardReply(msg);
+                }
+                return false;
+            }
+            forwardReply(msg);
+        }
+        return true;
+    }
+
+    void forwardReply(zmq::message_t& msg){
+        while(true){
+            bool more = msg.more();
+            // a gateway that went away loses its reply
+            router->send(msg, more ? (ZMQ_SNDMORE | ZMQ_DONTWAIT) : ZMQ_DONTWAIT);
+            if(!more){
+                return;
+            }
+            replies->recv(&msg, 0);
+        }
+    }
+
+    bool acceptRequest(){
+        zmq::message_t msg;
+        if(!router->recv(&msg, ZMQ_DONTWAIT)){
+            return false;
+        }
+        std::vector<std::string> envelope;
+        std::vector<std::string> request;
+        bool delimited = false;
+        while(true){
+            std::string frame(static_cast<char*>(msg.data()), msg.size());
+            if(delimited){
+                request.push_back(std::move(frame));
+            }else{
+                delimited = envelope.size() > 0 && frame.empty();
+                envelope.push_back(std::move(frame));
+            }
+            if(!msg.more()){
+                break;
+            }
+            router->recv(&msg, 0);
+        }
+        // without a delimiter the reply could not be routed
+        if(delimited){
+            dispatcher.enqueue(new ZmqServerTransport(std::move(envelope), std::move(request)));
+        }
+        return true;
+    }
+
+    zmq::context_t ctx;
+    std::string endpoint;
+    std::string replies_endpoint;
+    // grows with addWorkers() while the socket thread reads it
+    std::atomic<int> threads;
+    std::unique_ptr<zmq::socket_t> router;
+    std::unique_ptr<zmq::socket_t> replies;
+    std::atomic<bool> accepting;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool stopped_accepting;
+    std::thread thread;
+    JobQueueDispatcher<ZmqServerWorker> dispatcher;
+};
+
+void ZmqServerWorker::onThreadEnter(){
+    handler = m_context->createRequestHandler();
+    auto server = static_cast<ZmqServer*>(m_context);
+    push = new zmq::socket_t(server->getContext(), ZMQ_PUSH);
+    push->connect(server->getRepliesEndpoint().c_str());
+}
+
+void ZmqServerWorker::doJob(ZmqServerTransport* job){
+    job->setReplySocket(push);
+    job->onRequestStart(job->getQueueTime());
+    handler->setupRequest(job);
+    handler->handleRequest(job);
+    handler->teardownRequest(job);
+    // the gateway gets an answer whatever happened to the request
+    if(!job->hasReplied()){
+        job->sendString("Internal Server Error", 500);
+    }
+    delete job;
+}
+
+void ZmqServerWorker::onThreadExit(){
+    handler.reset();
+    delete push;
+    push = nullptr;
+}
+
+class ZmqServerFactory : public ServerFactory {
+public:
+    virtual ServerPtr createServer(const ServerOptions& options){
+        return std::make_shared<ZmqServer>(options);
+    }
+};
+
 class zmqExtension : public Extension {
 public:
     zmqExtension() : Extension("zmq") {}
@@ -846,23 +5667,74 @@ public:
         HHVM_FE(zmq_context_create);
         HHVM_FE(zmq_context_get_opt);
         HHVM_FE(zmq_context_set_opt);
+        HHVM_FE(zmq_persistent_stats);
         HHVM_FE(zmq_socket_connect);
         HHVM_FE(zmq_socket_create);
+        HHVM_FE(zmq_socket_is_reused);
+        HHVM_FE(zmq_socket_get_endpoints);
         HHVM_FE(zmq_socket_disconnect);
         HHVM_FE(zmq_socket_bind);
         HHVM_FE(zmq_socket_unbind);
         HHVM_FE(zmq_socket_send);
         HHVM_FE(zmq_socket_recv);
+        HHVM_FE(zmq_socket_send_multi);
+        HHVM_FE(zmq_socket_recv_multi);
+        HHVM_FE(zmq_socket_send_batch);
+        HHVM_FE(zmq_socket_send_array);
+        HHVM_FE(zmq_socket_recv_array);
+        HHVM_FE(zmq_socket_subscribe);
+        HHVM_FE(zmq_socket_unsubscribe);
+        HHVM_FE(zmq_socket_subscriptions);
+        HHVM_FE(zmq_socket_recv_tagged);
+        HHVM_FE(zmq_socket_coalesce);
+        HHVM_FE(zmq_socket_flush);
+        HHVM_FE(zmq_socket_compress);
+        HHVM_FE(zmq_socket_shm);
+        HHVM_FE(zmq_socket_decode);
+        HHVM_FE(zmq_socket_send_queue_enable);
+        HHVM_FE(zmq_socket_send_queue_disable);
+        HHVM_FE(zmq_socket_send_queue_stats);
+        HHVM_FE(zmq_socket_recv_batch);
+        HHVM_FE(zmq_socket_recv_async);
+        HHVM_FE(zmq_socket_send_async);
         HHVM_FE(zmq_socket_set_opt);
+        HHVM_FE(zmq_socket_set_opts);
         HHVM_FE(zmq_socket_get_opt);
+        HHVM_FE(zmq_socket_stats);
+        HHVM_FE(zmq_stats);
+        HHVM_FE(zmq_socket_monitor_enable);
+        HHVM_FE(zmq_socket_monitor_disable);
+        HHVM_FE(zmq_socket_monitor_events);
+        HHVM_FE(zmq_socket_monitor_counters);
+        HHVM_FE(zmq_device_create);
+        HHVM_FE(zmq_device_start);
+        HHVM_FE(zmq_device_command);
+        HHVM_FE(zmq_device_statistics);
+        HHVM_FE(zmq_broker_create);
+        HHVM_FE(zmq_broker_start);
+        HHVM_FE(zmq_broker_stop);
+        HHVM_FE(zmq_broker_stats);
+        HHVM_FE(zmq_rpc_create);
+        HHVM_FE(zmq_rpc_call);
+        HHVM_FE(zmq_rpc_poll);
+        HHVM_FE(zmq_rpc_stats);
         HHVM_FE(zmq_poll_poll);
         HHVM_FE(zmq_poll_create);
         HHVM_FE(zmq_poll_add);
         HHVM_FE(zmq_poll_remove);
         HHVM_FE(zmq_poll_clear);
 
+        // Server.Type = zmq
+        ServerFactoryRegistry::getInstance()->registerFactory(
+            "zmq", std::make_shared<ZmqServerFactory>());
+
         loadSystemlib();
     }
+
+    virtual void moduleShutdown() {
+        // offloaded payloads nobody read will not be claimed anymore
+        ZmqShmRegistry::reclaim(UINT64_MAX);
+    }
 } s_zmq_extension;
 
 // Uncomment for non-bundled module
@@ -17,8 +17,8 @@ class ZMQ {
   const SOCKET_XREP = 6;
   const SOCKET_PUSH = 8;
   const SOCKET_PULL =7;
-  const SOCKET_ROUTER =5;
-  const SOCKET_DEALER =6;
+  const SOCKET_ROUTER =6;
+  const SOCKET_DEALER =5;
   const SOCKET_XPUB =9;
   const SOCKET_XSUB =10;
 
@@ -52,6 +52,13 @@ class ZMQ {
   const SOCKOPT_TCP_ACCEPT_FILTER = 38;
   const SOCKOPT_DELAY_ATTACH_ON_CONNECT = 39;
   const SOCKOPT_XPUB_VERBOSE = 40;
+  const SOCKOPT_IMMEDIATE = 39;
+  const SOCKOPT_CONFLATE = 54;
+  const SOCKOPT_ROUTER_HANDOVER = 56;
+  const SOCKOPT_HEARTBEAT_IVL = 75;
+  const SOCKOPT_HEARTBEAT_TTL = 76;
+  const SOCKOPT_HEARTBEAT_TIMEOUT = 77;
+  const SOCKOPT_TCP_MAXRT = 80;
 
   /**
    *
@@ -59,10 +66,51 @@ class ZMQ {
    */
   const POLL_IN = 1;
   const POLL_OUT = 2;
+  const POLL_ERR = 4;
+
+  /**
+   *
+   * socket monitor events
+   */
+  const EVENT_CONNECTED = 1;
+  const EVENT_CONNECT_DELAYED = 2;
+  const EVENT_CONNECT_RETRIED = 4;
+  const EVENT_LISTENING = 8;
+  const EVENT_BIND_FAILED = 16;
+  const EVENT_ACCEPTED = 32;
+  const EVENT_ACCEPT_FAILED = 64;
+  const EVENT_CLOSED = 128;
+  const EVENT_CLOSE_FAILED = 256;
+  const EVENT_DISCONNECTED = 512;
+  const EVENT_ALL = 0xFFFF;
+
+  /**
+   *
+   * send queue overflow behaviour
+   */
+  const SEND_QUEUE_DROP_NEWEST = 0;
+  const SEND_QUEUE_DROP_OLDEST = 1;
+  const SEND_QUEUE_BLOCK = 2;
+
+  /**
+   *
+   * envelopes a receiving socket unwraps, see setDecoding()
+   */
+  const DECODE_BATCH = 1;
+  const DECODE_COMPRESSED = 2;
+  const DECODE_SHARED = 4;
 
   const ZMQ_IO_THREADS = 1;
   const ZMQ_MAX_SOCKETS = 2;
 
+  /**
+   *
+   * I/O thread scheduling policies, as in sched.h
+   */
+  const SCHED_OTHER = 0;
+  const SCHED_FIFO = 1;
+  const SCHED_RR = 2;
+
   /*  message options  */ 
   const MODE_NOBLOCK = 1;
   const MODE_DONTWAIT = 1;
@@ -86,15 +134,30 @@ class ZMQContext {
     * persistent sockets.
     *
     *
+    * A persistent context is shared by every request of the server process
+    * that asks for the same io_threads, max_sockets and options; it is never
+    * closed at the end of the request.
+    *
+    * Options for the I/O threads:
+    *  - cpus:            CPU ids the I/O threads may run on, e.g. the cores
+    *                     of one NUMA node (libzmq 4.3)
+    *  - sched_policy:    ZMQ::SCHED_* policy of the I/O threads (libzmq 4.1)
+    *  - thread_priority: their priority under that policy (libzmq 4.1)
+    *  - auto_affinity:   give every new socket of the context the next I/O
+    *                     thread in turn through ZMQ::SOCKOPT_AFFINITY
+    *
     * @param integer $io_threads     Number of io threads
     * @param boolean $is_persistent  Whether the context is persistent
+    * @param integer $max_sockets    Maximum number of sockets of the context
+    * @param array   $options        I/O thread options
     *
+    * @throws Exception if an option is unknown or not supported by libzmq
     * @return void
     */
-   public function __construct(int $io_threads = 1, bool $is_persistent = true)
+   public function __construct(int $io_threads = 1, bool $is_persistent = true, int $max_sockets = 1023, array $options = array())
    {
        $this->is_persistent = $is_persistent;
-       $ctx = zmq_context_create($io_threads);
+       $ctx = zmq_context_create($io_threads, $is_persistent, $max_sockets, $options);
        if(!$ctx){
            throw new Exception("create zmq context failed");
        }
@@ -148,11 +211,33 @@ class ZMQContext {
        return $this->is_persistent;
    }
 
+   /**
+    * Statistics of the process-wide persistent contexts: how many were
+    * created and how many times an existing one was reused.
+    *
+    * @return array
+    */
+   public static function getPersistentStats() : array
+   {
+       return zmq_persistent_stats();
+   }
+
    public function getOpt(int $key) : int
    {
        return zmq_context_get_opt($this->context, $key);
    }
 
+   /**
+    * Sets ZMQ::ZMQ_IO_THREADS or ZMQ::ZMQ_MAX_SOCKETS. A persistent context
+    * is shared with other requests, so it is not changed: this object
+    * switches to the persistent context with the new value, and only the
+    * sockets created afterwards use it.
+    *
+    * @param integer $key   The option key
+    * @param integer $value The option value
+    *
+    * @return integer 0 on success, -1 on failure
+    */
    public function setOpt(int $key , int $value) : int
    {
        return zmq_context_set_opt($this->context, $key, $value);
@@ -171,14 +256,22 @@ class ZMQSocket {
    private array $conn_dsns = array();
    private array $bind_dsns = array();
    private int $type;
+   private array $handlers = array();
    /**
     * Construct a new ZMQ object. The extending class must call this method.
     * The type is one of the ZMQ::SOCKET_* constants.
-    * Persistent id allows reusing the socket over multiple requests.
-    * If persistent_id parameter is specific the type parameter is ignored and the
-    * socket is of type that it was initially created with. Persistent context must
-    * be enabled for persistent_id to work. Setting incorrect socket type might
-    * cause failure later in connect/bind/setSockOpt.
+    * Persistent id allows reusing the socket over multiple requests: sockets
+    * of a persistent context are pooled per server process by type and
+    * persistent_id, and come back with their connections already open.
+    * Persistent context must be enabled for persistent_id to work.
+    * $on_new_socket is only called when the pool had no idle socket.
+    *
+    * A reused socket ends up with the endpoints the request asks for:
+    * connect() and bind() are free for endpoints it already has, and the
+    * ones that earlier requests used and this one does not ask for are
+    * dropped before the first message. A request that connects nothing
+    * keeps all of them. Options changed on a reused socket and
+    * subscriptions made with subscribe() only last for the request.
     *
     * @param ZMQContext $context           ZMQContext to build this object
     * @param integer    $type              The type of the socket
@@ -190,31 +283,24 @@ class ZMQSocket {
     */
    public function __construct(ZMQContext $context, int $type, ?string $persistent_id = null, mixed $on_new_socket = null)
    {
-       //if persistent id
-       if(!empty($persistent_id)){
-           $this->persistent_id = $persistent_id;
-           
-           $socket = zmq_socket_create($context->getContext(), $type);
-           
-           if($socket == -1){
-               throw new ZMQException("create zmq socket failed");
-           }
-
-           $this->socket = $socket;
-           if(!$this->setSockOpt(ZMQ::SOCKOPT_IDENTITY, $persistent_id)){
-               throw new ZMQException("set zmq socket persistent id failed");
-           }
+       $socket = zmq_socket_create($context->getContext(), $type, (string)$persistent_id);
+       if(!$socket){
+           throw new ZMQException("create zmq socket failed");
+       }
+       $this->socket = $socket;
+       $this->type = $type;
 
+       //persistent sockets handed back by the pool keep their identity and endpoints
+       if(zmq_socket_is_reused($socket)){
            $this->persistent_id = $persistent_id;
+           return;
+       }
 
-       }else{
-           $socket = zmq_socket_create($context->getContext(), $type);
-           if($socket == -1){
-               throw new ZMQException("create zmq socket failed");
-           }
-           $this->socket = $socket;
+       //if persistent id
+       if(!empty($persistent_id)){
+           $this->setSockOpt(ZMQ::SOCKOPT_IDENTITY, $persistent_id);
+           $this->persistent_id = $persistent_id;
        }
-       $this->type = $type;
 
        if($on_new_socket != null && is_callable($on_new_socket)){
           call_user_func($on_new_socket);
@@ -224,6 +310,13 @@ class ZMQSocket {
    /**
     * Sends a message to the queue.
     *
+    * On a socket without a persistent id, messages of 16KB or more are
+    * handed to libzmq without a copy, so they reference request memory.
+    * Closing the socket therefore gives them at most 100ms, or the linger
+    * period if that is shorter, to go out; after that they are dropped
+    * whatever SOCKOPT_LINGER says. Smaller messages, and all messages of
+    * persistent sockets, are copied and honor the linger period.
+    *
     * @param string  $message  The message to send
     * @param integer $flags    self::MODE_NOBLOCK or 0
     * @throws ZMQException if sending message fails
@@ -255,6 +348,262 @@ class ZMQSocket {
        return $message;
    }
 
+   /**
+    * Sends a multipart message, one frame per array element, in a single
+    * native call.
+    *
+    * @param array   $message  The frames to send
+    * @param integer $flags    self::MODE_NOBLOCK or 0
+    * @throws ZMQException if sending message fails
+    *
+    * @return ZMQ
+    */
+   public function sendMulti(array $message, int $flags = 0) : mixed
+   {
+       if(zmq_socket_send_multi($this->socket, $message, $flags) != 0){
+           throw new ZMQException("zmq socket send multipart message failed");
+       }
+
+       return $this;
+   }
+
+   /**
+    * Receives all the frames of a multipart message in a single native call.
+    *
+    * @param integer $flags self::MODE_NOBLOCK or 0
+    * @throws ZMQException if receiving fails.
+    *
+    * @return array
+    */
+   public function recvMulti(int $flags = 0): array
+   {
+       $message = zmq_socket_recv_multi($this->socket, $flags);
+       if($message === false){
+           throw new ZMQException("zmq socket recv multipart message failed");
+       }
+       return $message;
+   }
+
+   /**
+    * Subscribes a SUB socket to a topic prefix and registers the prefix in
+    * a native trie, so that recvTagged() and dispatch() tell which
+    * subscription a message matched without any matching in PHP. A message
+    * matches the longest subscribed prefix of its first frame. On a
+    * persistent socket these subscriptions end with the request, like the
+    * handlers, so subscribe in every request.
+    *
+    * @param string   $prefix   The topic prefix, '' for every message
+    * @param function $handler  Called by dispatch() with the frames of the
+    *                           message and the prefix
+    *
+    * @throws ZMQException
+    * @return ZMQ
+    */
+   public function subscribe(string $prefix, mixed $handler = null): mixed
+   {
+      if(zmq_socket_subscribe($this->socket, $prefix) != 0){
+          throw new ZMQException('zmq socket subscribe failed');
+      }
+      if($handler !== null){
+          $this->handlers[$prefix] = $handler;
+      }
+      return $this;
+   }
+
+   /**
+    * @throws ZMQException if the prefix was not subscribed with subscribe()
+    * @return ZMQ
+    */
+   public function unsubscribe(string $prefix): mixed
+   {
+      if(zmq_socket_unsubscribe($this->socket, $prefix) != 0){
+          throw new ZMQException('zmq socket unsubscribe failed');
+      }
+      unset($this->handlers[$prefix]);
+      return $this;
+   }
+
+   /**
+    * Subscriptions made with subscribe(): prefix => number of messages
+    * that matched it.
+    *
+    * @return array
+    */
+   public function getSubscriptions(): array
+   {
+      return zmq_socket_subscriptions($this->socket);
+   }
+
+   /**
+    * Receives one message tagged with the subscription it matched: an array
+    * with 'subscription' (the prefix, null if none matched) and 'frames'.
+    *
+    * @param integer $timeout Timeout in milliseconds, -1 waits forever
+    *
+    * @throws ZMQException if receiving fails
+    * @return array|null null on timeout
+    */
+   public function recvTagged(int $timeout = -1): ?array
+   {
+      $messages = zmq_socket_recv_tagged($this->socket, 1, $timeout);
+      if($messages === false){
+          throw new ZMQException('zmq socket recv tagged message failed');
+      }
+      return $messages ? $messages[0] : null;
+   }
+
+   /**
+    * Receives up to $max messages in one native call and calls the handler
+    * of the subscription each one matched. Messages without a handler are
+    * skipped.
+    *
+    * @param integer $max     Maximum number of messages to dispatch
+    * @param integer $timeout Timeout for the first message in milliseconds,
+    *                         -1 waits forever
+    *
+    * @throws ZMQException if receiving fails
+    * @return integer the number of messages received
+    */
+   public function dispatch(int $max = 100, int $timeout = -1): int
+   {
+      $messages = zmq_socket_recv_tagged($this->socket, $max, $timeout);
+      if($messages === false){
+          throw new ZMQException('zmq socket recv tagged message failed');
+      }
+      foreach($messages as $message){
+          $prefix = $message['subscription'];
+          if($prefix !== null && isset($this->handlers[$prefix])){
+              call_user_func($this->handlers[$prefix], $message['frames'], $prefix);
+          }
+      }
+      return count($messages);
+   }
+
+   /**
+    * Sends an array encoded as MessagePack in native code, without a
+    * serialize() or json_encode() string in between. Lists are encoded as
+    * MessagePack arrays, other arrays as maps. Values must be null, bool,
+    * int, float, string or array.
+    *
+    * @param array   $value  The array to send
+    * @param integer $flags  self::MODE_NOBLOCK or 0
+    * @throws ZMQException if the array cannot be encoded or sending fails
+    *
+    * @return ZMQ
+    */
+   public function sendArray(array $value, int $flags = 0) : mixed
+   {
+       if(zmq_socket_send_array($this->socket, $value, $flags) != 0){
+           throw new ZMQException("zmq socket send array failed");
+       }
+       return $this;
+   }
+
+   /**
+    * Receives a message holding a MessagePack array or map, as sent by
+    * sendArray() or any other MessagePack producer, and decodes it straight
+    * from the message.
+    *
+    * @param integer $flags self::MODE_NOBLOCK or 0
+    * @throws ZMQException if receiving fails or the message is not an
+    *                      encoded array
+    *
+    * @return array
+    */
+   public function recvArray(int $flags = 0): array
+   {
+       $value = zmq_socket_recv_array($this->socket, $flags);
+       if($value === false){
+           throw new ZMQException("zmq socket recv array failed");
+       }
+       return $value;
+   }
+
+   /**
+    * Sends every element of the array as a separate message in a single
+    * native call. Sending stops at the first message that would block
+    * (with self::MODE_NOBLOCK) and the number of messages sent is returned.
+    *
+    * @param array   $messages The messages to send
+    * @param integer $flags    self::MODE_NOBLOCK or 0
+    * @throws ZMQException if no message could be sent because of an error
+    *
+    * @return integer
+    */
+   public function sendBatch(array $messages, int $flags = 0) : int
+   {
+       $sent = zmq_socket_send_batch($this->socket, $messages, $flags);
+       if($sent < 0){
+           throw new ZMQException("zmq socket send batch failed");
+       }
+       return $sent;
+   }
+
+   /**
+    * Waits up to $timeout milliseconds for a message, then drains the
+    * messages already queued on the socket without blocking, up to $max
+    * messages in total. An empty array means the timeout expired.
+    * Single-frame messages are strings, a multipart message is the array
+    * of its frames.
+    *
+    * @param integer $max      Maximum number of messages to return
+    * @param integer $timeout  Timeout for the first message in milliseconds,
+    *                          -1 waits forever
+    * @throws ZMQException if receiving fails.
+    *
+    * @return array
+    */
+   public function recvBatch(int $max, int $timeout = -1): array
+   {
+       $messages = zmq_socket_recv_batch($this->socket, $max, $timeout);
+       if($messages === false){
+           throw new ZMQException("zmq socket recv batch failed");
+       }
+       return $messages;
+   }
+
+   /**
+    * Receives a message without blocking the request thread. The socket is
+    * watched through its ZMQ_FD by the extension's event loop, so the
+    * request can await other I/O in the meantime. Until the received
+    * message has been awaited, send, receive and poll calls on the socket
+    * fail.
+    *
+    * @param integer $timeout Timeout in milliseconds, -1 waits forever
+    * @throws ZMQException if receiving fails or times out.
+    *
+    * @return Awaitable<string>
+    */
+   public async function recvAsync(int $timeout = -1): Awaitable<string>
+   {
+       $message = await zmq_socket_recv_async($this->socket, $timeout);
+       if($message === false){
+           throw new ZMQException("zmq socket async recv message failed");
+       }
+       return $message;
+   }
+
+   /**
+    * Sends a message without blocking the request thread. Messages batched
+    * by coalesce() go out first; if they cannot go out at once the send
+    * fails. Until the returned awaitable is done, send, receive and poll
+    * calls on the socket fail.
+    *
+    * @param string  $message The message to send
+    * @param integer $timeout Timeout in milliseconds, -1 waits forever
+    * @throws ZMQException if sending fails or times out.
+    *
+    * @return Awaitable<ZMQSocket>
+    */
+   public async function sendAsync(string $message, int $timeout = -1): Awaitable<ZMQSocket>
+   {
+       $rc = await zmq_socket_send_async($this->socket, $message, $timeout);
+       if($rc === false){
+           throw new ZMQException("zmq socket async send message failed");
+       }
+       return $this;
+   }
+
    /**
     * Connect the socket to a remote endpoint. For more information about the dsn
     * see http://api.zeromq.org/zmq_connect.html. By default the method does not
@@ -280,7 +629,7 @@ class ZMQSocket {
 
    public function disconnect(string $dsn) : mixed
    {
-       if(isset($this->conn_dsns[$dsn])){
+       if(isset($this->getEndpoints()['connect'][$dsn])){
            if(zmq_socket_disconnect($this->socket, $dsn) != 0){
                throw new ZMQException("zmq socket disconnect " . $dsn . " failed");
            }
@@ -314,7 +663,7 @@ class ZMQSocket {
 
    public function unbind(string $dsn) : mixed
    {
-       if(isset($this->bind_dsns[$dsn])){
+       if(isset($this->getEndpoints()['bind'][$dsn])){
            if(zmq_socket_unbind($this->socket, $dsn) != 0){
                throw new ZMQException("zmq socket unbind " . $dsn . " failed");
            }
@@ -342,6 +691,25 @@ class ZMQSocket {
       return $this;
    }
 
+   /**
+    * Sets many socket options in one call, as an array of
+    * ZMQ::SOCKOPT_* => value. Every key is checked before any option is
+    * set, so an unknown or read-only key leaves the socket untouched.
+    *
+    * @param array $options
+    *
+    * @throws ZMQException naming the option that could not be set
+    * @return ZMQSocket
+    */
+   public function setSockOpts(array $options): ZMQSocket
+   {
+      $failed = null;
+      if(zmq_socket_set_opts($this->socket, $options, &$failed) != 0){
+          throw new ZMQException('zmq socket set option ' . $failed . ' failed');
+      }
+      return $this;
+   }
+
    /**
     * Gets a socket option. This method is available if ZMQ extension
     * has been compiled against ZMQ version 2.0.7 or higher
@@ -358,105 +726,696 @@ class ZMQSocket {
    }
 
    /**
-    * Get endpoints where the socket is connected to. The return array
-    * contains two sub-arrays: 'connect' and 'bind'
+    * Packs small messages of a PUB or PUSH socket into one larger frame,
+    * which saves the per-frame overhead when publishing many tiny events.
+    * A batch goes out when it would exceed $max_bytes, or once its oldest
+    * message is $flush_interval_us old: with a send queue the writer thread
+    * keeps that timer, otherwise the next send(), a poll on the socket,
+    * flush() or closing the socket sends it. Larger messages and the
+    * frames of multipart messages (from the first one sent with
+    * MODE_SNDMORE to the last) are sent as usual, after the pending batch.
+    *
+    * Receivers that setDecoding(ZMQ::DECODE_BATCH) split batches
+    * transparently in recv(), recvBatch() and recvAsync(); others get the
+    * batch as one message. Batches start with an envelope, not with the
+    * topic, so subscribers of a coalescing PUB socket must subscribe to
+    * everything.
+    *
+    * @param integer $max_bytes          Maximum size of a batch, 0 turns
+    *                                    coalescing off
+    * @param integer $flush_interval_us  Longest time a message is held back
     *
     * @throws ZMQException
-    * @return array
+    * @return ZMQ
     */
-   public function getEndpoints(): array
+   public function setCoalescing(int $max_bytes, int $flush_interval_us = 1000): mixed
    {
-       return array(
-           'connect' => $this->conn_dsns,
-           'bind' => $this->bind_dsns
-       );
+      if(zmq_socket_coalesce($this->socket, $max_bytes, $flush_interval_us) != 0){
+          throw new ZMQException('zmq socket set coalescing failed');
+      }
+      return $this;
    }
 
    /**
-    * Return the socket type. Returns one of ZMQ::SOCKET_* constants
+    * Compresses outgoing frames of at least $threshold bytes with LZ4 in
+    * native code. Each compressed frame is tagged, so receivers that
+    * setDecoding(ZMQ::DECODE_COMPRESSED) inflate them transparently and
+    * still accept plain frames from producers that do not compress. Frames
+    * that would not shrink are sent as they are.
+    * Topic frames below the threshold stay readable for SUB filtering.
+    *
+    * Needs the extension built with liblz4.
+    *
+    * @param integer $threshold     Smallest frame to compress, -1 turns
+    *                               compression off
+    * @param integer $acceleration  LZ4 acceleration, higher is faster and
+    *                               compresses less
     *
     * @throws ZMQException
-    * @return integer
+    * @return ZMQ
     */
-   public function getSocketType(): int
+   public function setCompression(int $threshold = 1024, int $acceleration = 1): mixed
    {
-       return $this->type;
+      if(zmq_socket_compress($this->socket, $threshold, $acceleration) != 0){
+          throw new ZMQException('zmq socket set compression failed');
+      }
+      return $this;
    }
 
    /**
-    * Whether the socket is persistent
+    * For peers on the same host: frames of at least $threshold bytes are
+    * written to a POSIX shared memory object and only a small handle frame
+    * goes through the socket. Receivers that setDecoding(ZMQ::DECODE_SHARED)
+    * read the payload back transparently and release the object. Objects
+    * that are not read within $ttl milliseconds, because the message was
+    * dropped or the peer went away, are removed; their handle frame is then
+    * received as it is. Both ends must run as the same user.
     *
-    * @return boolean
+    * Every message must have exactly one reader, so PUB and XPUB sockets
+    * cannot offload. Both the offload and DECODE_SHARED need every endpoint
+    * of the socket to be ipc:// or inproc://, and connecting or binding to
+    * another transport fails while they are on.
+    *
+    * @param integer $threshold  Smallest frame to offload, -1 turns the
+    *                            offload off
+    * @param integer $ttl        Milliseconds an unread payload is kept
+    *
+    * @throws ZMQException
+    * @return ZMQSocket
     */
-   public function isPersistent() : bool
-   {
-       return !empty($this->persistent_id);
-   }
-
-   public function getPersistentId() : ?string
+   public function setSharedMemory(int $threshold = 1048576, int $ttl = 60000): ZMQSocket
    {
-       return $this->persistent_id;
+      if(zmq_socket_shm($this->socket, $threshold, $ttl) != 0){
+          throw new ZMQException('zmq socket set shared memory failed');
+      }
+      return $this;
    }
 
-   public function getSocket(): resource
+   /**
+    * Selects the envelopes of setCoalescing() and its siblings that this
+    * socket unwraps on receive, as a mask of ZMQ::DECODE_* constants.
+    * Nothing is unwrapped by default: a frame from a peer that happens to
+    * look like an envelope is delivered as it was sent.
+    *
+    * @param integer $envelopes ZMQ::DECODE_* constants or'ed together, 0
+    *                           for none
+    *
+    * @throws ZMQException if DECODE_COMPRESSED is asked for and the
+    *                      extension was built without liblz4, or
+    *                      DECODE_SHARED and the socket has an endpoint
+    *                      that is not ipc:// or inproc://
+    * @return ZMQSocket
+    */
+   public function setDecoding(int $envelopes): ZMQSocket
    {
-       return $this->socket;
+      if(zmq_socket_decode($this->socket, $envelopes) != 0){
+          throw new ZMQException('zmq socket set decoding failed');
+      }
+      return $this;
    }
-}
-
-class ZMQPoll {
-
-    private resource $poll; 
-   private array $sockets;
-   private array $errors;
 
-   public function __construct()
+   /**
+    * Sends the pending batch of a coalescing socket now.
+    *
+    * @param integer $flags self::MODE_NOBLOCK or 0
+    * @throws ZMQException if sending the batch fails
+    *
+    * @return ZMQ
+    */
+   public function flush(int $flags = 0): mixed
    {
-      $this->sockets = array();
-      $this->errors = array();
-      $poll = zmq_poll_create();
-      if(!$poll){
-        throw new ZMQException('create zmq poll failed');
+      if(zmq_socket_flush($this->socket, $flags) != 0){
+          throw new ZMQException('zmq socket flush failed');
       }
-      $this->poll = $poll;
+      return $this;
    }
 
    /**
-    * Add a new object into the poll set. Returns the id for the object
-    * in the pollset.
+    * Hands the socket to a native writer thread: send(), sendMulti() and
+    * sendBatch() then copy the message into a bounded queue and return at
+    * once, even when the peer is at SNDHWM. When the queue is full the
+    * message is dropped (SEND_QUEUE_DROP_NEWEST), makes room by dropping the
+    * oldest queued one (SEND_QUEUE_DROP_OLDEST), or send waits for room up
+    * to SNDTIMEO (SEND_QUEUE_BLOCK, MODE_NOBLOCK fails at once). Dropped
+    * messages only show in getSendQueueStats().
     *
-    * @param ZMQ $object Object to add to set
-    * @param integer $type Bit-mask of ZMQ::POLL_* constants
+    * Set the options and endpoints first: until disableSendQueue() every
+    * call on the socket other than sending, receiving, polling, options,
+    * connect and bind included, fails. The queue stays with a
+    * persistent socket across requests; a plain socket flushes it for up to
+    * its linger period when it is closed.
     *
-    * @throws ZMQPollException if the object has not been initialized with polling
+    * @param integer $capacity  Maximum number of queued messages
+    * @param integer $overflow  One of ZMQ::SEND_QUEUE_* constants
+    *
+    * @throws ZMQException
+    * @return ZMQ
+    */
+   public function enableSendQueue(int $capacity = 1024, int $overflow = ZMQ::SEND_QUEUE_DROP_NEWEST): mixed
+   {
+      if(zmq_socket_send_queue_enable($this->socket, $capacity, $overflow) != 0){
+          throw new ZMQException('zmq socket enable send queue failed');
+      }
+      return $this;
+   }
+
+   /**
+    * Flushes the queue for up to the linger period and gives the socket
+    * back to the request.
+    *
+    * @throws ZMQException if the queue is not enabled
+    * @return ZMQ
+    */
+   public function disableSendQueue(): mixed
+   {
+      if(zmq_socket_send_queue_disable($this->socket) != 0){
+          throw new ZMQException('zmq socket send queue is not enabled');
+      }
+      return $this;
+   }
+
+   /**
+    * Counters of the send queue: 'capacity', 'queued', 'enqueued', 'sent',
+    * 'dropped', 'failed' and 'blocked' (sends that had to wait for room).
+    *
+    * @throws ZMQException if the queue is not enabled
+    * @return array
+    */
+   public function getSendQueueStats(): array
+   {
+      $stats = zmq_socket_send_queue_stats($this->socket);
+      if($stats === false){
+          throw new ZMQException('zmq socket send queue is not enabled');
+      }
+      return $stats;
+   }
+
+   /**
+    * Hot path counters of the socket: messages and bytes sent/received,
+    * EAGAIN and timeout counts, and histograms of the time spent blocked in
+    * send and recv ('count', 'total_us', 'max_us' and 'buckets' as upper
+    * bound in microseconds => count).
+    *
+    * @return array
+    */
+   public function getStats(): array
+   {
+      return zmq_socket_stats($this->socket);
+   }
+
+   /**
+    * Starts monitoring the socket on a native thread. Events are buffered
+    * natively and read with getMonitorEvents(); the send and recv paths are
+    * not affected. The monitor stays with the socket, also across requests
+    * for persistent sockets, until disableMonitor() is called.
+    *
+    * @param integer $events Bit-mask of ZMQ::EVENT_* constants
+    *
+    * @throws ZMQException
+    * @return ZMQ
+    */
+   public function enableMonitor(int $events = ZMQ::EVENT_ALL): mixed
+   {
+      if(zmq_socket_monitor_enable($this->socket, $events) != 0){
+          throw new ZMQException('zmq socket enable monitor failed');
+      }
+      return $this;
+   }
+
+   public function disableMonitor(): mixed
+   {
+      if(zmq_socket_monitor_disable($this->socket) != 0){
+          throw new ZMQException('zmq socket disable monitor failed');
+      }
+      return $this;
+   }
+
+   /**
+    * Returns the buffered monitor events without blocking, oldest first.
+    * Each event is an array with 'event' (one of ZMQ::EVENT_*), 'address'
+    * and 'time'.
+    *
+    * @param integer $max Maximum number of events to return, 0 for all
+    *
+    * @throws ZMQException if the monitor is not enabled
+    * @return array
+    */
+   public function getMonitorEvents(int $max = 0): array
+   {
+      $events = zmq_socket_monitor_events($this->socket, $max);
+      if($events === false){
+          throw new ZMQException('zmq socket monitor is not enabled');
+      }
+      return $events;
+   }
+
+   /**
+    * Returns how many times each event happened since the monitor started,
+    * e.g. 'connect_retried', 'accept_failed' or 'disconnected', and how
+    * many events were dropped because nobody read them.
+    *
+    * @throws ZMQException if the monitor is not enabled
+    * @return array
+    */
+   public function getMonitorCounters(): array
+   {
+      $counters = zmq_socket_monitor_counters($this->socket);
+      if($counters === false){
+          throw new ZMQException('zmq socket monitor is not enabled');
+      }
+      return $counters;
+   }
+
+   /**
+    * Get endpoints where the socket is connected to. The return array
+    * contains two sub-arrays: 'connect' and 'bind'
+    *
+    * @throws ZMQException
+    * @return array
+    */
+   public function getEndpoints(): array
+   {
+       return zmq_socket_get_endpoints($this->socket);
+   }
+
+   /**
+    * Return the socket type. Returns one of ZMQ::SOCKET_* constants
+    *
+    * @throws ZMQException
     * @return integer
     */
-   public function add(ZMQSocket $object, int $type): ?string
+   public function getSocketType(): int
+   {
+       return $this->type;
+   }
+
+   /**
+    * Whether the socket is persistent
+    *
+    * @return boolean
+    */
+   public function isPersistent() : bool
+   {
+       return !empty($this->persistent_id);
+   }
+
+   public function getPersistentId() : ?string
+   {
+       return $this->persistent_id;
+   }
+
+   /**
+    * Whether the socket came from the pool of persistent sockets with its
+    * connections already open
+    *
+    * @return boolean
+    */
+   public function isReused() : bool
+   {
+       return zmq_socket_is_reused($this->socket);
+   }
+
+   public function getSocket(): resource
+   {
+       return $this->socket;
+   }
+}
+
+class ZMQDevice {
+
+   private resource $device;
+   private array $sockets;
+
+   /**
+    * Build a device forwarding messages between the frontend and the
+    * backend, and copying them to the optional capture socket. The proxy
+    * runs natively on its own thread once started; until the device is
+    * stopped, every call on its sockets fails.
+    *
+    * @param ZMQSocket $frontend Frontend socket
+    * @param ZMQSocket $backend  Backend socket
+    * @param ZMQSocket $capture  Capture socket, or null
+    *
+    * @throws ZMQException if the libzmq in use has no steerable proxy
+    * @return void
+    */
+   public function __construct(ZMQSocket $frontend, ZMQSocket $backend, ?ZMQSocket $capture = null)
+   {
+       $device = zmq_device_create($frontend->getSocket(), $backend->getSocket(),
+                                   $capture === null ? null : $capture->getSocket());
+       if(!$device){
+           throw new ZMQException("create zmq device failed");
+       }
+       $this->device = $device;
+       //keep the sockets alive as long as the device runs
+       $this->sockets = array($frontend, $backend, $capture);
+   }
+
+   /**
+    * Starts the proxy thread and returns immediately.
+    *
+    * @throws ZMQException
+    * @return ZMQDevice
+    */
+   public function start(): ZMQDevice
+   {
+       if(zmq_device_start($this->device) != 0){
+           throw new ZMQException("zmq device start failed");
+       }
+       return $this;
+   }
+
+   public function pause(): ZMQDevice
+   {
+       return $this->command('PAUSE');
+   }
+
+   public function resume(): ZMQDevice
+   {
+       return $this->command('RESUME');
+   }
+
+   /**
+    * Terminates the proxy thread and waits for it to exit. The sockets can
+    * be used by PHP again afterwards.
+    *
+    * @return ZMQDevice
+    */
+   public function stop(): ZMQDevice
+   {
+       return $this->command('TERMINATE');
+   }
+
+   /**
+    * Message and byte counters of the proxy, requires libzmq 4.3
+    *
+    * @throws ZMQException if the proxy does not reply within a second
+    * @return array
+    */
+   public function getStatistics(): array
+   {
+       $stats = zmq_device_statistics($this->device);
+       if($stats === false){
+           throw new ZMQException("zmq device statistics failed");
+       }
+       return $stats;
+   }
+
+   private function command(string $command): ZMQDevice
+   {
+       if(zmq_device_command($this->device, $command) != 0){
+           throw new ZMQException("zmq device " . $command . " failed");
+       }
+       return $this;
+   }
+}
+
+class ZMQBroker {
+
+   private resource $broker;
+   private ZMQSocket $frontend;
+   private ZMQSocket $backend;
+
+   /**
+    * Build a load balancing broker. Clients (REQ, DEALER or ZMQRpcClient)
+    * connect to the frontend, workers (REQ) to the backend. A worker
+    * announces itself with a one-frame message such as "READY" and gets the
+    * requests as [client envelope][""][body...]; its reply has the same
+    * shape. The broker runs natively on its own thread once started and
+    * hands every request to the worker that has been ready the longest.
+    *
+    * @param ZMQContext $context
+    * @param string $frontend    DSN clients connect to
+    * @param string $backend     DSN workers connect to
+    * @param integer $max_queue  Requests held while no worker is ready
+    *
+    * @throws ZMQException
+    * @return void
+    */
+   public function __construct(ZMQContext $context, string $frontend, string $backend, int $max_queue = 1000)
+   {
+       $this->frontend = new ZMQSocket($context, ZMQ::SOCKET_ROUTER);
+       $this->backend = new ZMQSocket($context, ZMQ::SOCKET_ROUTER);
+       $this->frontend->setSockOpt(ZMQ::SOCKOPT_LINGER, 0);
+       $this->backend->setSockOpt(ZMQ::SOCKOPT_LINGER, 0);
+       $this->frontend->bind($frontend);
+       $this->backend->bind($backend);
+       $broker = zmq_broker_create($this->frontend->getSocket(), $this->backend->getSocket(), $max_queue);
+       if(!$broker){
+           throw new ZMQException("create zmq broker failed");
+       }
+       $this->broker = $broker;
+   }
+
+   /**
+    * Starts the broker thread and returns immediately.
+    *
+    * @throws ZMQException
+    * @return ZMQBroker
+    */
+   public function start(): ZMQBroker
+   {
+       if(zmq_broker_start($this->broker) != 0){
+           throw new ZMQException("zmq broker start failed");
+       }
+       return $this;
+   }
+
+   /**
+    * Stops the broker thread and waits for it to exit. Queued requests
+    * are dropped.
+    *
+    * @return ZMQBroker
+    */
+   public function stop(): ZMQBroker
+   {
+       if(zmq_broker_stop($this->broker) != 0){
+           throw new ZMQException("zmq broker stop failed");
+       }
+       return $this;
+   }
+
+   /**
+    * Counters of the broker: requests, dispatched, replies, unroutable,
+    * queue_depth, max_queue, ready_workers, and per worker identity its
+    * ready credits, inflight and handled requests. A worker is dropped when
+    * a request cannot be routed to it, or when it has no credits left and
+    * has been silent for a minute.
+    *
+    * @return array
+    */
+   public function getStats(): array
+   {
+       return zmq_broker_stats($this->broker);
+   }
+}
+
+/**
+ * Pipelined request/reply client on a DEALER socket. Any number of calls can
+ * be in flight; every call carries a correlation id that REP and ROUTER
+ * servers echo, so replies are matched whatever their order. A call without
+ * a reply is sent again after the attempt timeout, to the next server, until
+ * its retries or its deadline run out.
+ */
+class ZMQRpcClient {
+
+   private resource $rpc;
+   private ZMQSocket $socket;
+   private int $timeout;
+   private array $replies = array();
+
+   /**
+    * Options:
+    *  - timeout:         default deadline of a call in milliseconds (5000)
+    *  - attempt_timeout: how long one attempt waits for its reply (1000)
+    *  - retries:         how many times a call is sent again (2)
+    *  - failover:        connect to one endpoint at a time and move to the
+    *                     next one after failover_after unanswered attempts,
+    *                     instead of spreading calls over all of them (false)
+    *  - failover_after:  (1)
+    *
+    * @param ZMQContext $context
+    * @param array $endpoints  DSNs of the servers
+    * @param array $options
+    *
+    * @throws ZMQException
+    * @return void
+    */
+   public function __construct(ZMQContext $context, array $endpoints, array $options = array())
+   {
+       $this->timeout = isset($options['timeout']) ? $options['timeout'] : 5000;
+       $this->socket = new ZMQSocket($context, ZMQ::SOCKET_DEALER);
+       $this->socket->setSockOpt(ZMQ::SOCKOPT_LINGER, 0);
+       $rpc = zmq_rpc_create($this->socket->getSocket(), array_values($endpoints),
+                             isset($options['attempt_timeout']) ? $options['attempt_timeout'] : 1000,
+                             isset($options['retries']) ? $options['retries'] : 2,
+                             isset($options['failover']) ? (bool)$options['failover'] : false,
+                             isset($options['failover_after']) ? $options['failover_after'] : 1);
+       if(!$rpc){
+           throw new ZMQException("create zmq rpc client failed");
+       }
+       $this->rpc = $rpc;
+   }
+
+   /**
+    * Sends a request without waiting for the reply. The request is a string
+    * or an array of frames. Returns the id of the call.
+    *
+    * @param mixed $request
+    * @param integer $timeout  Deadline in milliseconds, -1 for the default
+    *
+    * @throws ZMQException
+    * @return integer
+    */
+   public function call(mixed $request, int $timeout = -1): int
+   {
+       $id = zmq_rpc_call($this->rpc, $request, $timeout < 0 ? $this->timeout : $timeout);
+       if($id === false){
+           throw new ZMQException("zmq rpc call failed");
+       }
+       return $id;
+   }
+
+   /**
+    * Waits up to timeout milliseconds for results and returns them as
+    * id => array of reply frames, or id => false when the deadline of the
+    * call passed. Returns an empty array when nothing is in flight.
+    *
+    * @param integer $timeout  -1 waits until there is a result
+    *
+    * @throws ZMQException
+    * @return array
+    */
+   public function poll(int $timeout = -1): array
+   {
+       $results = $this->replies;
+       $this->replies = array();
+       if(!empty($results)){
+           return $results;
+       }
+       $results = zmq_rpc_poll($this->rpc, $timeout);
+       if($results === false){
+           throw new ZMQException("zmq rpc poll failed");
+       }
+       return $results;
+   }
+
+   /**
+    * Waits for the result of one call; the results of other calls that
+    * arrive meanwhile are kept for poll(). Returns the reply frames, or
+    * false when the deadline of the call passed.
+    *
+    * @param integer $id
+    *
+    * @throws ZMQException
+    * @return mixed
+    */
+   public function wait(int $id): mixed
+   {
+       while(!array_key_exists($id, $this->replies)){
+           $results = zmq_rpc_poll($this->rpc, -1);
+           if($results === false){
+               throw new ZMQException("zmq rpc poll failed");
+           }
+           if(empty($results)){
+               throw new ZMQInvalidArgumentException("no call " . $id . " in flight");
+           }
+           foreach($results as $key => $result){
+               $this->replies[$key] = $result;
+           }
+       }
+       $result = $this->replies[$id];
+       unset($this->replies[$id]);
+       return $result;
+   }
+
+   /**
+    * Sends a request and waits for its reply frames.
+    *
+    * @param mixed $request
+    * @param integer $timeout  Deadline in milliseconds, -1 for the default
+    *
+    * @throws ZMQException if there is no reply before the deadline
+    * @return array
+    */
+   public function request(mixed $request, int $timeout = -1): array
+   {
+       $reply = $this->wait($this->call($request, $timeout));
+       if($reply === false){
+           throw new ZMQException("zmq rpc request timed out");
+       }
+       return $reply;
+   }
+
+   /**
+    * Number of calls in flight
+    *
+    * @return integer
+    */
+   public function pending(): int
+   {
+       $stats = zmq_rpc_stats($this->rpc);
+       return $stats['inflight'];
+   }
+
+   /**
+    * Counters of the client: sent, retries, replies, timeouts,
+    * late_replies, failovers, inflight and, in failover mode, the current
+    * endpoint.
+    *
+    * @return array
+    */
+   public function getStats(): array
+   {
+       return zmq_rpc_stats($this->rpc);
+   }
+}
+
+class ZMQPoll {
+
+    private resource $poll; 
+   private array $sockets;
+   private array $errors;
+
+   public function __construct()
+   {
+      $this->sockets = array();
+      $this->errors = array();
+      $poll = zmq_poll_create();
+      if(!$poll){
+        throw new ZMQException('create zmq poll failed');
+      }
+      $this->poll = $poll;
+   }
+
+   /**
+    * Add a new object into the poll set. Returns the id for the object
+    * in the pollset.
+    *
+    * @param ZMQ $object Object to add to set
+    * @param integer $type Bit-mask of ZMQ::POLL_* constants
+    *
+    * @throws ZMQPollException if the object has not been initialized with polling
+    * @return integer
+    */
+   public function add(ZMQSocket $object, int $type): int
    {
        if(!($object instanceof ZMQSocket)){
            throw new ZMQInvalidArgumentException("object should be instance of ZMQSocket");
        }
 
-       $id = spl_object_hash($object);
-       if(!isset($this->sockets[$id])){
-            if(zmq_poll_add($this->poll, $object->getSocket(), $id, $type) == 0){
-                $this->sockets[$id] = array(
-                 'type' => $type,
-                 'socket' => $object
-              );
-            }else{
-              throw new ZMQException('zmq poll add socket failed');
-            }
-           
+       $id = zmq_poll_add($this->poll, $object->getSocket(), $type);
+       if($id < 0){
+           throw new ZMQException('zmq poll add socket failed');
        }
+       $this->sockets[$id] = $object;
 
        return $id;
    }
 
    /**
     * Execute the poll. Readable and writable sockets are returned
-    * in the arrays passed by reference. If either of the given arrays
-    * is null the events of that type are not returned. Returns an integer
+    * in the arrays passed by reference. Returns an integer
     * indicated the amount of objects with events pending.
     *
     * @param array &$readable   array where to return the readable objects
@@ -468,27 +1427,28 @@ class ZMQPoll {
     */
    public function poll(array &$readable, array &$writable, int $timeout = -1): int
    {
+       $readable = array();
+       $writable = array();
+       $this->errors = array();
        if(empty($this->sockets))
            return 0;
 
-        $r_arr = array();
-        $w_arr = array();
-        
-       $rc = zmq_poll_poll($this->poll, $timeout, &$r_arr, &$w_arr, $timeout);
+       $ready = array();
+       $rc = zmq_poll_poll($this->poll, $timeout, &$ready);
        
        if($rc < 0){
            throw new ZMQException("zmq poll failed");
        }
 
-       foreach ($r_arr as $id) {
-         if(isset($this->sockets[$id])){
-            $readable[] = $this->sockets[$id]['socket'];
+       foreach ($ready as $id => $events) {
+         if($events & ZMQ::POLL_IN){
+            $readable[] = $this->sockets[$id];
          }
-       }
-
-       foreach ($w_arr as $id) {
-         if(isset($this->sockets[$id])){
-            $writable[] = $this->sockets[$id]['socket'];
+         if($events & ZMQ::POLL_OUT){
+            $writable[] = $this->sockets[$id];
+         }
+         if($events & ZMQ::POLL_ERR){
+            $this->errors[] = $id;
          }
        }
 
@@ -508,26 +1468,20 @@ class ZMQPoll {
    }
 
    /**
-    * Removes an item from the poll object. The parameter can be ZMQ object,
-    * resource or the string id returned by 'add' method. Returns true if the
+    * Removes an item from the poll object. Returns true if the
     * item was removed and false if item had not been added to the poll object.
     *
-    * @throws ZMQPollException if the poll object is empty
-    * @throws ZMQPollException if $item parameter is object but not an instance of ZMQ
-    *
-    * @param mixed $item  The item to remove
+    * @param ZMQSocket $object  The item to remove
     * @return boolean
     */
    public function remove(ZMQSocket $object): bool
    {
-       $id = spl_object_hash($object);
-       if(isset($this->sockets[$id])){
-          if(zmq_poll_remove($this->poll, $id) == 0){
-             unset($this->sockets[$id]);
-            return true;
-         }
+       $id = zmq_poll_remove($this->poll, $object->getSocket());
+       if($id < 0){
+           return false;
        }
-       return false;
+       unset($this->sockets[$id]);
+       return true;
    }
 
    /**
@@ -560,10 +1514,19 @@ class ZMQPoll {
 }
 
 <<__Native>>
-function zmq_context_create(int $io_threads) : mixed;
+function zmq_context_create(int $io_threads, bool $is_persistent = false, int $max_sockets = 1023, array $options = array()) : mixed;
+
+<<__Native>>
+function zmq_persistent_stats(): array;
 
 <<__Native>>
-function zmq_socket_create(resource $context, int $type) : mixed;
+function zmq_socket_create(resource $context, int $type, string $persistent_id = "") : mixed;
+
+<<__Native>>
+function zmq_socket_is_reused(resource $socket): bool;
+
+<<__Native>>
+function zmq_socket_get_endpoints(resource $socket): array;
 
 <<__Native>>
 function zmq_context_get_opt(resource $context, int $option): int;
@@ -589,23 +1552,144 @@ function zmq_socket_send(resource $socket, string $message, int $flags): int;
 <<__Native>>
 function zmq_socket_recv(resource $socket, mixed &$message, int $flags): int;
 
+<<__Native>>
+function zmq_socket_send_multi(resource $socket, array $message, int $flags): int;
+
+<<__Native>>
+function zmq_socket_recv_multi(resource $socket, int $flags): mixed;
+
+<<__Native>>
+function zmq_socket_send_array(resource $socket, array $value, int $flags): int;
+
+<<__Native>>
+function zmq_socket_recv_array(resource $socket, int $flags): mixed;
+
+<<__Native>>
+function zmq_socket_subscribe(resource $socket, string $prefix): int;
+
+<<__Native>>
+function zmq_socket_unsubscribe(resource $socket, string $prefix): int;
+
+<<__Native>>
+function zmq_socket_subscriptions(resource $socket): mixed;
+
+<<__Native>>
+function zmq_socket_recv_tagged(resource $socket, int $max, int $timeout): mixed;
+
+<<__Native>>
+function zmq_socket_send_batch(resource $socket, array $messages, int $flags): int;
+
+<<__Native>>
+function zmq_socket_recv_batch(resource $socket, int $max, int $timeout): mixed;
+
+<<__Native>>
+function zmq_socket_coalesce(resource $socket, int $max_bytes, int $interval_us): int;
+
+<<__Native>>
+function zmq_socket_decode(resource $socket, int $envelopes): int;
+
+<<__Native>>
+function zmq_socket_flush(resource $socket, int $flags): int;
+
+<<__Native>>
+function zmq_socket_compress(resource $socket, int $threshold, int $acceleration): int;
+
+<<__Native>>
+function zmq_socket_shm(resource $socket, int $threshold, int $ttl): int;
+
+<<__Native>>
+function zmq_socket_send_queue_enable(resource $socket, int $capacity, int $overflow): int;
+
+<<__Native>>
+function zmq_socket_send_queue_disable(resource $socket): int;
+
+<<__Native>>
+function zmq_socket_send_queue_stats(resource $socket): mixed;
+
+<<__Native>>
+function zmq_socket_recv_async(resource $socket, int $timeout): Awaitable<mixed>;
+
+<<__Native>>
+function zmq_socket_send_async(resource $socket, string $message, int $timeout): Awaitable<mixed>;
+
 <<__Native>>
 function zmq_socket_set_opt(resource $socket, int $key, mixed $value): int;
 
+<<__Native>>
+function zmq_socket_set_opts(resource $socket, array $options, mixed &$failed): int;
+
 <<__Native>>
 function zmq_socket_get_opt(resource $socket, int $key): mixed;
 
+<<__Native>>
+function zmq_socket_stats(resource $socket): array;
+
+/**
+ * Process-wide counters summed over all threads, same layout as
+ * ZMQSocket::getStats() plus 'poll_wait' and the persistent pool stats.
+ */
+<<__Native>>
+function zmq_stats(): array;
+
+<<__Native>>
+function zmq_socket_monitor_enable(resource $socket, int $events): int;
+
+<<__Native>>
+function zmq_socket_monitor_disable(resource $socket): int;
+
+<<__Native>>
+function zmq_socket_monitor_events(resource $socket, int $max): mixed;
+
+<<__Native>>
+function zmq_socket_monitor_counters(resource $socket): mixed;
+
+<<__Native>>
+function zmq_device_create(resource $frontend, resource $backend, mixed $capture): mixed;
+
+<<__Native>>
+function zmq_device_start(resource $device): int;
+
+<<__Native>>
+function zmq_device_command(resource $device, string $command): int;
+
+<<__Native>>
+function zmq_device_statistics(resource $device): mixed;
+
+<<__Native>>
+function zmq_broker_create(resource $frontend, resource $backend, int $max_queue): mixed;
+
+<<__Native>>
+function zmq_broker_start(resource $broker): int;
+
+<<__Native>>
+function zmq_broker_stop(resource $broker): int;
+
+<<__Native>>
+function zmq_broker_stats(resource $broker): mixed;
+
+<<__Native>>
+function zmq_rpc_create(resource $socket, array $endpoints, int $attempt_timeout, int $retries, bool $failover, int $failover_after): mixed;
+
+<<__Native>>
+function zmq_rpc_call(resource $rpc, mixed $request, int $timeout): mixed;
+
+<<__Native>>
+function zmq_rpc_poll(resource $rpc, int $timeout): mixed;
+
+<<__Native>>
+function zmq_rpc_stats(resource $rpc): mixed;
+
 <<__Native>>
 function zmq_poll_create(): mixed;
 
 <<__Native>>
-function zmq_poll_add(resource $poll, resource $socket, string $id, int $type): int;
+function zmq_poll_add(resource $poll, resource $socket, int $type): int;
 
 <<__Native>>
-function zmq_poll_poll(resource $poll, int $timeout, mixed &$readSocketsId, mixed &$writeSocketsId, mixed &$errorSocketsId): int;
+function zmq_poll_poll(resource $poll, int $timeout, mixed &$ready): int;
 
 <<__Native>>
-function zmq_poll_remove(resource $poll, string $id): int;
+function zmq_poll_remove(resource $poll, resource $socket): int;
 
 <<__Native>>
 function zmq_poll_clear(resource $poll): int;
\ No newline at end of file